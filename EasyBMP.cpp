@@ -19,12 +19,27 @@
 *************************************************/
 
 #include "EasyBMP.h"
+#include <climits>
+
+#ifdef EasyBMP_PARALLEL_READ
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+// The vector row decoders are compiled for their own instruction sets 
+// with the target attribute and picked at run time, so they are there 
+// whatever the compiler flags. See SetEasyBMPsimdLevel(). 
+#define EasyBMP_X86_DISPATCH
+#include <immintrin.h>
+#endif
 
 /* These functions are defined in EasyBMP.h */
 
 //#define DO_RANGE_CHECK
 
 bool EasyBMPwarnings = true;
+int EasyBMPreadThreads = 1;
 
 void SetEasyBMPwarningsOff( void )
 { EasyBMPwarnings = false; }
@@ -33,6 +48,44 @@ void SetEasyBMPwarningsOn( void )
 bool GetEasyBMPwarningState( void )
 { return EasyBMPwarnings; }
 
+void SetEasyBMPreadThreads( int NumberOfThreads )
+{
+ if( NumberOfThreads < 1 )
+ { NumberOfThreads = 1; }
+ EasyBMPreadThreads = NumberOfThreads; 
+}
+int GetEasyBMPreadThreads( void )
+{ return EasyBMPreadThreads; }
+
+EasyBMPreadHook EasyBMPrangeHook = NULL;
+
+void SetEasyBMPreadHook( EasyBMPreadHook Hook )
+{ EasyBMPrangeHook = Hook; }
+
+static int DetectEasyBMPsimdLevel( void )
+{
+#ifdef EasyBMP_X86_DISPATCH
+ __builtin_cpu_init();
+ if( __builtin_cpu_supports( "avx2" ) )
+ { return 2; }
+ if( __builtin_cpu_supports( "ssse3" ) )
+ { return 1; }
+#endif
+ return 0;
+}
+
+int EasyBMPsimdLevel = DetectEasyBMPsimdLevel();
+
+void SetEasyBMPsimdLevel( int Level )
+{
+ int Supported = DetectEasyBMPsimdLevel();
+ if( Level < 0 )
+ { Level = 0; }
+ EasyBMPsimdLevel = Level < Supported ? Level : Supported;
+}
+int GetEasyBMPsimdLevel( void )
+{ return EasyBMPsimdLevel; }
+
 /* These functions are defined in EasyBMP_DataStructures.h */
 
 int IntPow( int base, int exponent )
@@ -226,13 +279,103 @@ RGBApixel BMP::GetColor( int ColorNumber )
  return Output;
 }
 
-BMP::BMP()
+// All of an image's pixels, and the table of column pointers that 
+// Pixels points to, live in a single block. Each column starts on a 
+// 64 byte boundary, ColumnPitch pixels after the one before it, so 
+// Pixels[i][j] works just like it always did. 
+
+static const long EasyBMPpixelAlignment = 64;
+
+static long EasyBMPcolumnPitch( int NewHeight )
+{
+ long PitchBytes = NewHeight * (long) sizeof(RGBApixel);
+ PitchBytes = ( PitchBytes + EasyBMPpixelAlignment-1 ) 
+              / EasyBMPpixelAlignment * EasyBMPpixelAlignment;
+ // Decoding writes one pixel to every column in turn. If the columns 
+ // were a multiple of 256 bytes apart, they would all land in the same 
+ // few cache sets and evict each other (a 1024 pixel tall image was 
+ // twice as slow to decode), so nudge them apart. 
+ if( PitchBytes % 256 == 0 )
+ { PitchBytes += EasyBMPpixelAlignment; }
+ return PitchBytes / (long) sizeof(RGBApixel);
+}
+
+static long EasyBMPpixelBlockSize( int NewWidth, int NewHeight )
 {
- Width = 1;
- Height = 1;
+ long TableBytes = NewWidth * (long) sizeof(RGBApixel*);
+ TableBytes = ( TableBytes + EasyBMPpixelAlignment-1 ) 
+              / EasyBMPpixelAlignment * EasyBMPpixelAlignment;
+ return EasyBMPpixelAlignment-1 + TableBytes 
+        + (long) NewWidth * EasyBMPcolumnPitch( NewHeight ) 
+          * (long) sizeof(RGBApixel);
+}
+
+EasyBMPpixelArena::EasyBMPpixelArena()
+{
+ NumberOfBlocks = 0;
+}
+
+EasyBMPpixelArena::~EasyBMPpixelArena()
+{
+ for( int n=0 ; n < NumberOfBlocks ; n++ )
+ { delete [] Blocks[n]; }
+}
+
+ebmpBYTE* EasyBMPpixelArena::Take( long Size, long& ActualSize )
+{
+ // the smallest block that is big enough
+ int Best = -1;
+ for( int n=0 ; n < NumberOfBlocks ; n++ )
+ {
+  if( BlockSizes[n] >= Size && 
+      ( Best < 0 || BlockSizes[n] < BlockSizes[Best] ) )
+  { Best = n; }
+ }
+ if( Best < 0 )
+ {
+  ActualSize = Size;
+  return new ebmpBYTE [Size];
+ }
+ ebmpBYTE* Block = Blocks[Best];
+ ActualSize = BlockSizes[Best];
+ NumberOfBlocks--;
+ Blocks[Best] = Blocks[NumberOfBlocks];
+ BlockSizes[Best] = BlockSizes[NumberOfBlocks];
+ return Block;
+}
+
+void EasyBMPpixelArena::Give( ebmpBYTE* Block, long Size )
+{
+ if( NumberOfBlocks == MaximumBlocks )
+ {
+  // make room by dropping the smallest block we have
+  int Smallest = 0;
+  for( int n=1 ; n < NumberOfBlocks ; n++ )
+  {
+   if( BlockSizes[n] < BlockSizes[Smallest] )
+   { Smallest = n; }
+  }
+  if( BlockSizes[Smallest] >= Size )
+  { delete [] Block; return; }
+  delete [] Blocks[Smallest];
+  NumberOfBlocks--;
+  Blocks[Smallest] = Blocks[NumberOfBlocks];
+  BlockSizes[Smallest] = BlockSizes[NumberOfBlocks];
+ }
+ Blocks[NumberOfBlocks] = Block;
+ BlockSizes[NumberOfBlocks] = Size;
+ NumberOfBlocks++;
+}
+
+void BMP::InitializeEmpty( void )
+{
+ Width = 0;
+ Height = 0;
  BitDepth = 24;
- Pixels = new RGBApixel* [Width];
- Pixels[0] = new RGBApixel [Height];
+ Pixels = NULL;
+ PixelBlock = NULL;
+ PixelBlockSize = 0;
+ Arena = NULL;
  Colors = NULL;
  
  XPelsPerMeter = 0;
@@ -244,32 +387,28 @@ BMP::BMP()
  SizeOfMetaData2 = 0;
 }
 
+BMP::BMP()
+{
+ InitializeEmpty();
+ AllocatePixels( 1, 1 );
+}
+
 // BMP::BMP( const BMP& Input )
 BMP::BMP( BMP& Input )
 {
  // first, make the image empty.
 
- Width = 1;
- Height = 1;
- BitDepth = 24;
- Pixels = new RGBApixel* [Width];
- Pixels[0] = new RGBApixel [Height];
- Colors = NULL; 
- XPelsPerMeter = 0;
- YPelsPerMeter = 0;
- 
- MetaData1 = NULL;
- SizeOfMetaData1 = 0;
- MetaData2 = NULL;
- SizeOfMetaData2 = 0;
+ InitializeEmpty();
+ AllocatePixels( 1, 1 );
 
  // now, set the correct bit depth
  
  SetBitDepth( Input.TellBitDepth() );
  
- // set the correct pixel size 
+ // set the correct pixel size, without clearing it, since all of the 
+ // pixels are copied over below 
  
- SetSize( Input.TellWidth() , Input.TellHeight() );
+ AllocatePixels( Input.TellWidth() , Input.TellHeight() );
 
  // set the DPI information from Input
  
@@ -286,24 +425,50 @@ BMP::BMP( BMP& Input )
   }
  }
  
- // get all the pixels 
+ // get all the pixels, a whole column at a time 
  
- for( int j=0; j < Height ; j++ )
- {
-  for( int i=0; i < Width ; i++ )
-  {
-   Pixels[i][j] = *Input(i,j);
-//   Pixels[i][j] = Input.GetPixel(i,j); // *Input(i,j);
-  }
- }
+ for( int i=0 ; i < Width ; i++ )
+ { memcpy( (char*) Pixels[i], (char*) Input.Pixels[i], Height*sizeof(RGBApixel) ); }
+}
+
+#if __cplusplus >= 201103L
+BMP::BMP( BMP&& Input )
+{
+ InitializeEmpty();
+ Swap( Input );
+}
+
+BMP& BMP::operator=( BMP&& Input )
+{
+ Swap( Input );
+ return *this;
+}
+#endif
+
+template <class T> static void EasyBMPswap( T& A, T& B )
+{ T Temp = A; A = B; B = Temp; }
+
+void BMP::Swap( BMP& Other )
+{
+ EasyBMPswap( BitDepth, Other.BitDepth );
+ EasyBMPswap( Width, Other.Width );
+ EasyBMPswap( Height, Other.Height );
+ EasyBMPswap( Pixels, Other.Pixels );
+ EasyBMPswap( PixelBlock, Other.PixelBlock );
+ EasyBMPswap( PixelBlockSize, Other.PixelBlockSize );
+ EasyBMPswap( Arena, Other.Arena );
+ EasyBMPswap( Colors, Other.Colors );
+ EasyBMPswap( XPelsPerMeter, Other.XPelsPerMeter );
+ EasyBMPswap( YPelsPerMeter, Other.YPelsPerMeter );
+ EasyBMPswap( MetaData1, Other.MetaData1 );
+ EasyBMPswap( SizeOfMetaData1, Other.SizeOfMetaData1 );
+ EasyBMPswap( MetaData2, Other.MetaData2 );
+ EasyBMPswap( SizeOfMetaData2, Other.SizeOfMetaData2 );
 }
 
 BMP::~BMP()
 {
- int i;
- for(i=0;i<Width;i++)
- { delete [] Pixels[i]; }
- delete [] Pixels;
+ FreePixels();
  if( Colors )
  { delete [] Colors; }
  
@@ -313,6 +478,77 @@ BMP::~BMP()
  { delete [] MetaData2; }
 } 
 
+void BMP::SetPixelArena( EasyBMPpixelArena* NewArena )
+{
+ // the current block has to go back to where it came from, so this 
+ // starts over with a fresh 1 x 1 image from the new arena 
+ FreePixels();
+ Arena = NewArena;
+ AllocatePixels( 1, 1 );
+}
+
+void BMP::FreePixels( void )
+{
+ if( PixelBlock )
+ {
+  if( Arena )
+  { Arena->Give( PixelBlock, PixelBlockSize ); }
+  else
+  { delete [] PixelBlock; }
+ }
+ PixelBlock = NULL;
+ PixelBlockSize = 0;
+ Pixels = NULL;
+}
+
+bool BMP::AllocatePixels( int NewWidth, int NewHeight )
+{
+ long Size = EasyBMPpixelBlockSize( NewWidth, NewHeight );
+
+ // keep the block we have if it is big enough
+ if( !PixelBlock || PixelBlockSize < Size )
+ {
+  FreePixels();
+  if( Arena )
+  { PixelBlock = Arena->Take( Size, PixelBlockSize ); }
+  else
+  {
+   PixelBlock = new ebmpBYTE [Size];
+   PixelBlockSize = Size;
+  }
+ }
+
+ Width = NewWidth;
+ Height = NewHeight;
+
+ long TableBytes = NewWidth * (long) sizeof(RGBApixel*);
+ TableBytes = ( TableBytes + EasyBMPpixelAlignment-1 ) 
+              / EasyBMPpixelAlignment * EasyBMPpixelAlignment;
+ size_t Address = (size_t) PixelBlock;
+ Address = ( Address + EasyBMPpixelAlignment-1 ) 
+           / EasyBMPpixelAlignment * EasyBMPpixelAlignment;
+ Pixels = (RGBApixel**) Address;
+ RGBApixel* FirstPixel = (RGBApixel*) ( Address + TableBytes );
+ long ColumnPitch = EasyBMPcolumnPitch( Height );
+ for( int i=0 ; i < Width ; i++ )
+ { Pixels[i] = FirstPixel + (long) i * ColumnPitch; }
+ return true;
+}
+
+void BMP::FillRowsWhite( int FirstRow, int LastRow )
+{
+ RGBApixel WHITE;
+ WHITE.Red = 255;
+ WHITE.Green = 255;
+ WHITE.Blue = 255;
+ WHITE.Alpha = 0;
+ for( int i=0 ; i < Width ; i++ )
+ {
+  for( int j=FirstRow ; j <= LastRow ; j++ )
+  { Pixels[i][j] = WHITE; }
+ }
+}
+
 RGBApixel* BMP::operator()(int i, int j)
 {
  using namespace std;
@@ -391,6 +627,14 @@ bool BMP::SetBitDepth( int NewDepth )
 }
 
 bool BMP::SetSize(int NewWidth , int NewHeight )
+{
+ if( !SetSizeWithoutClearing( NewWidth, NewHeight ) )
+ { return false; }
+ FillRowsWhite( 0, Height-1 );
+ return true; 
+}
+
+bool BMP::SetSizeWithoutClearing( int NewWidth , int NewHeight )
 {
  using namespace std;
  if( NewWidth <= 0 || NewHeight <= 0 )
@@ -404,31 +648,18 @@ bool BMP::SetSize(int NewWidth , int NewHeight )
   return false;
  }
 
- int i,j; 
-
- for(i=0;i<Width;i++)
- { delete [] Pixels[i]; }
- delete [] Pixels;
+ return AllocatePixels( NewWidth, NewHeight );
+}
 
- Width = NewWidth;
- Height = NewHeight;
- Pixels = new RGBApixel* [ Width ]; 
- 
- for(i=0; i<Width; i++)
- { Pixels[i] = new RGBApixel [ Height ]; }
- 
- for( i=0 ; i < Width ; i++)
- {
-  for( j=0 ; j < Height ; j++ )
-  {
-   Pixels[i][j].Red = 255; 
-   Pixels[i][j].Green = 255; 
-   Pixels[i][j].Blue = 255; 
-   Pixels[i][j].Alpha = 0;    
-  }
- }
+// how many rows WriteToFile() encodes before handing them to fwrite() 
+static const int WriteBandRows = 64;
 
- return true; 
+// copies Bytes bytes to File at Position, and moves Position on 
+static inline void PutBytes( ebmpBYTE* File, long& Position, 
+                             const void* Data, int Bytes )
+{
+ memcpy( File + Position, Data, Bytes );
+ Position += Bytes;
 }
 
 bool BMP::WriteToFile( const char* FileName )
@@ -483,6 +714,13 @@ bool BMP::WriteToFile( const char* FileName )
  
  double dTotalFileSize = 14 + 40 + dPaletteSize + dTotalPixelBytes;
  
+ // the headers and then a band of rows at a time are put together in 
+ // memory, and each is written with one call 
+ 
+ ebmpBYTE Headers[14+40+4*256];
+ long Position = 0;
+ ebmpBYTE* File = Headers;
+ 
  // write the file header 
  
  BMFH bmfh;
@@ -494,11 +732,11 @@ bool BMP::WriteToFile( const char* FileName )
  if( IsBigEndian() )
  { bmfh.SwitchEndianess(); }
  
- fwrite( (char*) &(bmfh.bfType) , sizeof(ebmpWORD) , 1 , fp );
- fwrite( (char*) &(bmfh.bfSize) , sizeof(ebmpDWORD) , 1 , fp );
- fwrite( (char*) &(bmfh.bfReserved1) , sizeof(ebmpWORD) , 1 , fp );
- fwrite( (char*) &(bmfh.bfReserved2) , sizeof(ebmpWORD) , 1 , fp );
- fwrite( (char*) &(bmfh.bfOffBits) , sizeof(ebmpDWORD) , 1 , fp );
+ PutBytes( File, Position, &(bmfh.bfType) , sizeof(ebmpWORD) );
+ PutBytes( File, Position, &(bmfh.bfSize) , sizeof(ebmpDWORD) );
+ PutBytes( File, Position, &(bmfh.bfReserved1) , sizeof(ebmpWORD) );
+ PutBytes( File, Position, &(bmfh.bfReserved2) , sizeof(ebmpWORD) );
+ PutBytes( File, Position, &(bmfh.bfOffBits) , sizeof(ebmpDWORD) );
  
  // write the info header 
  
@@ -529,17 +767,17 @@ bool BMP::WriteToFile( const char* FileName )
  if( IsBigEndian() )
  { bmih.SwitchEndianess(); }
  
- fwrite( (char*) &(bmih.biSize) , sizeof(ebmpDWORD) , 1 , fp );
- fwrite( (char*) &(bmih.biWidth) , sizeof(ebmpDWORD) , 1 , fp );
- fwrite( (char*) &(bmih.biHeight) , sizeof(ebmpDWORD) , 1 , fp );
- fwrite( (char*) &(bmih.biPlanes) , sizeof(ebmpWORD) , 1 , fp );
- fwrite( (char*) &(bmih.biBitCount) , sizeof(ebmpWORD) , 1 , fp );
- fwrite( (char*) &(bmih.biCompression) , sizeof(ebmpDWORD) , 1 , fp );
- fwrite( (char*) &(bmih.biSizeImage) , sizeof(ebmpDWORD) , 1 , fp );
- fwrite( (char*) &(bmih.biXPelsPerMeter) , sizeof(ebmpDWORD) , 1 , fp );
- fwrite( (char*) &(bmih.biYPelsPerMeter) , sizeof(ebmpDWORD) , 1 , fp ); 
- fwrite( (char*) &(bmih.biClrUsed) , sizeof(ebmpDWORD) , 1 , fp);
- fwrite( (char*) &(bmih.biClrImportant) , sizeof(ebmpDWORD) , 1 , fp);
+ PutBytes( File, Position, &(bmih.biSize) , sizeof(ebmpDWORD) );
+ PutBytes( File, Position, &(bmih.biWidth) , sizeof(ebmpDWORD) );
+ PutBytes( File, Position, &(bmih.biHeight) , sizeof(ebmpDWORD) );
+ PutBytes( File, Position, &(bmih.biPlanes) , sizeof(ebmpWORD) );
+ PutBytes( File, Position, &(bmih.biBitCount) , sizeof(ebmpWORD) );
+ PutBytes( File, Position, &(bmih.biCompression) , sizeof(ebmpDWORD) );
+ PutBytes( File, Position, &(bmih.biSizeImage) , sizeof(ebmpDWORD) );
+ PutBytes( File, Position, &(bmih.biXPelsPerMeter) , sizeof(ebmpDWORD) );
+ PutBytes( File, Position, &(bmih.biYPelsPerMeter) , sizeof(ebmpDWORD) ); 
+ PutBytes( File, Position, &(bmih.biClrUsed) , sizeof(ebmpDWORD) );
+ PutBytes( File, Position, &(bmih.biClrImportant) , sizeof(ebmpDWORD) );
  
  // write the palette 
  if( BitDepth == 1 || BitDepth == 4 || BitDepth == 8 )
@@ -554,128 +792,82 @@ bool BMP::WriteToFile( const char* FileName )
    CreateStandardColorTable(); 
   }
    
-  int n;
-  for( n=0 ; n < NumberOfColors ; n++ )
-  { fwrite( (char*) &(Colors[n]) , 4 , 1 , fp ); }
+  PutBytes( File, Position, Colors, 4*NumberOfColors );
  }
  
- // write the pixels 
- int i,j;
- if( BitDepth != 16 )
- {  
-  ebmpBYTE* Buffer;
-  int BufferSize = (int) ( (Width*BitDepth)/8.0 );
-  while( 8*BufferSize < Width*BitDepth )
-  { BufferSize++; }
-  while( BufferSize % 4 )
-  { BufferSize++; }
-  
-  Buffer = new ebmpBYTE [BufferSize];
-  for( j=0 ; j < BufferSize; j++ )
-  { Buffer[j] = 0; }
-    
-  j=Height-1;
-  
-  while( j > -1 )
+ // write the bit masks for 16-bit files 
+ if( BitDepth == 16 )
+ {
+  ebmpWORD Masks[3] = { 63488, 2016, 31 }; // bits 1-5, 6-11 and 12-16
+  ebmpWORD ZeroWORD = 0;
+  for( int n=0 ; n < 3 ; n++ )
+  {
+   if( IsBigEndian() )
+   { Masks[n] = FlipWORD( Masks[n] ); }
+   PutBytes( File, Position, &Masks[n], 2 );
+   PutBytes( File, Position, &ZeroWORD, 2 );
+  }
+ }
+ 
+ bool Success = (long) fwrite( (char*) Headers, 1, Position, fp ) == Position;
+ 
+ // write the pixels, a band of whole rows (with their padding) at a time 
+ 
+ int RowBytes = (int) dActualBytesPerRow;
+ int BandRows = WriteBandRows;
+ if( BandRows > Height )
+ { BandRows = Height; }
+ ebmpBYTE* Band = new ebmpBYTE [ (long) BandRows * RowBytes ];
+ ColorCache* Cache = NULL;
+ if( BitDepth < 16 )
+ { 
+  Cache = new ColorCache; 
+  memset( Cache->Keys, 0, sizeof(Cache->Keys) );
+ }
+ 
+ int j = Height-1;
+ while( j >= 0 && Success )
+ {
+  int Rows = 0;
+  for( ; Rows < BandRows && j >= 0 && Success ; Rows++, j-- )
   {
-   bool Success = false;
+   ebmpBYTE* Buffer = Band + (long) Rows * RowBytes;
    if( BitDepth == 32 )
-   { Success = Write32bitRow( Buffer, BufferSize, j ); }
+   { Success = Write32bitRow( Buffer, RowBytes, j ); }
    if( BitDepth == 24 )
-   { Success = Write24bitRow( Buffer, BufferSize, j ); }
+   { Success = Write24bitRow( Buffer, RowBytes, j ); }
+   if( BitDepth == 16 )
+   { Success = Write16bitRow( Buffer, RowBytes, j ); }
    if( BitDepth == 8  )
-   { Success = Write8bitRow( Buffer, BufferSize, j ); }
+   { Success = Write8bitRow( Buffer, RowBytes, j, *Cache ); }
    if( BitDepth == 4  )
-   { Success = Write4bitRow( Buffer, BufferSize, j ); }
+   { Success = Write4bitRow( Buffer, RowBytes, j, *Cache ); }
    if( BitDepth == 1  )
-   { Success = Write1bitRow( Buffer, BufferSize, j ); }
-   if( Success )
-   {
-    int BytesWritten = (int) fwrite( (char*) Buffer, 1, BufferSize, fp );
-    if( BytesWritten != BufferSize )
-    { Success = false; }
-   }
-   if( !Success )
-   {
-    if( EasyBMPwarnings )
-    {
-     cout << "EasyBMP Error: Could not write proper amount of data." << endl;
-	}
-    j = -1; 
-   }
-   j--; 
+   { Success = Write1bitRow( Buffer, RowBytes, j, *Cache ); }
+   memset( Buffer + (int) dBytesPerRow, 0, BytePaddingPerRow );
+  }
+  if( Success )
+  { 
+   long Bytes = (long) Rows * RowBytes;
+   Success = (long) fwrite( (char*) Band, 1, Bytes, fp ) == Bytes; 
   }
-  
-  delete [] Buffer;
  }
  
- if( BitDepth == 16 )
+ if( !Success && EasyBMPwarnings )
  {
-  // write the bit masks
-
-  ebmpWORD BlueMask = 31;    // bits 12-16
-  ebmpWORD GreenMask = 2016; // bits 6-11
-  ebmpWORD RedMask = 63488;  // bits 1-5
-  ebmpWORD ZeroWORD;
-  
-  if( IsBigEndian() )
-  { RedMask = FlipWORD( RedMask ); }
-  fwrite( (char*) &RedMask , 2 , 1 , fp );
-  fwrite( (char*) &ZeroWORD , 2 , 1 , fp );
-
-  if( IsBigEndian() )
-  { GreenMask = FlipWORD( GreenMask ); }
-  fwrite( (char*) &GreenMask , 2 , 1 , fp );
-  fwrite( (char*) &ZeroWORD , 2 , 1 , fp );
-
-  if( IsBigEndian() )
-  { BlueMask = FlipWORD( BlueMask ); }
-  fwrite( (char*) &BlueMask , 2 , 1 , fp );
-  fwrite( (char*) &ZeroWORD , 2 , 1 , fp );
-
-  int DataBytes = Width*2;
-  int PaddingBytes = ( 4 - DataBytes % 4 ) % 4;
-  
-  // write the actual pixels
-  
-  for( j=Height-1 ; j >= 0 ; j-- )
-  {
-   // write all row pixel data
-   i=0;
-   int WriteNumber = 0;
-   while( WriteNumber < DataBytes )
-   {
-    ebmpWORD TempWORD;
-	
-	ebmpWORD RedWORD = (ebmpWORD) ((Pixels[i][j]).Red / 8);
-	ebmpWORD GreenWORD = (ebmpWORD) ((Pixels[i][j]).Green / 4);
-	ebmpWORD BlueWORD = (ebmpWORD) ((Pixels[i][j]).Blue / 8);
-	
-    TempWORD = (RedWORD<<11) + (GreenWORD<<5) + BlueWORD;
-	if( IsBigEndian() )
-	{ TempWORD = FlipWORD( TempWORD ); }
-	
-    fwrite( (char*) &TempWORD , 2, 1, fp);
-    WriteNumber += 2;
-	i++;
-   }
-   // write any necessary row padding
-   WriteNumber = 0;
-   while( WriteNumber < PaddingBytes )
-   {
-    ebmpBYTE TempBYTE;
-    fwrite( (char*) &TempBYTE , 1, 1, fp);
-    WriteNumber++;
-   }
-  }
-  
+  cout << "EasyBMP Error: Could not write proper amount of data." << endl;
  }
-
+ 
+ delete [] Band;
+ delete Cache;
  fclose(fp);
  return true;
 }
 
 bool BMP::ReadFromFile( const char* FileName )
+{ return ReadRowsFromFile( FileName, 0, INT_MAX ); }
+
+bool BMP::ReadRowsFromFile( const char* FileName, int FirstRow, int LastRow )
 { 
  using namespace std;
  if( !EasyBMPcheckDataSize() )
@@ -776,14 +968,17 @@ bool BMP::ReadFromFile( const char* FileName )
  XPelsPerMeter = bmih.biXPelsPerMeter;
  YPelsPerMeter = bmih.biYPelsPerMeter;
  
- // if bmih.biCompression 1 or 2, then the file is RLE compressed
+ // if bmih.biCompression 1 or 2, then the file is RLE compressed, 
+ // which only goes with 8 and 4 bits respectively
  
- if( bmih.biCompression == 1 || bmih.biCompression == 2 )
+ bool IsRLE = bmih.biCompression == 1 || bmih.biCompression == 2;
+ if( ( bmih.biCompression == 1 && bmih.biBitCount != 8 ) || 
+     ( bmih.biCompression == 2 && bmih.biBitCount != 4 ) )
  {
   if( EasyBMPwarnings )
   {
-   cout << "EasyBMP Error: " << FileName << " is (RLE) compressed." << endl
-        << "               EasyBMP does not support compression." << endl;
+   cout << "EasyBMP Error: " << FileName << " is (RLE) compressed" << endl
+        << "               at the wrong bit depth." << endl;
   }
   SetSize(1,1);
   SetBitDepth(1);
@@ -857,7 +1052,14 @@ bool BMP::ReadFromFile( const char* FileName )
   fclose(fp);
   return false;
  } 
- SetSize( (int) bmih.biWidth , (int) bmih.biHeight );
+ // every pixel is about to be decoded, so don't bother clearing them. 
+ // Any rows that can't be read are cleared below, and rows outside 
+ // FirstRow to LastRow are left as they are. 
+ SetSizeWithoutClearing( (int) bmih.biWidth , (int) bmih.biHeight );
+ if( FirstRow < 0 )
+ { FirstRow = 0; }
+ if( LastRow > Height-1 )
+ { LastRow = Height-1; }
   
  // some preliminaries
  
@@ -930,11 +1132,37 @@ bool BMP::ReadFromFile( const char* FileName )
   delete [] TempSkipBYTE;
  } 
   
+ // RLE files are read whole and decoded a run at a time. Anything 
+ // that the runs skip over is palette entry 0. 
+
+ int j;
+ if( IsRLE )
+ {
+  long DataStart = ftell( fp );
+  fseek( fp, 0, SEEK_END );
+  long DataBytes = ftell( fp ) - DataStart;
+  fseek( fp, DataStart, SEEK_SET );
+  if( DataBytes < 0 )
+  { DataBytes = 0; }
+  ebmpBYTE* Data = new ebmpBYTE [DataBytes+1];
+  DataBytes = (long) fread( (char*) Data, 1, DataBytes, fp );
+  for( int i=0 ; i < Width ; i++ )
+  {
+   for( j=0 ; j < Height ; j++ )
+   { Pixels[i][j] = Colors[0]; }
+  }
+  if( !DecodeEasyBMPrle( Data, DataBytes, BitDepth, Width, Height, 
+                         SetRLErun, this ) && EasyBMPwarnings )
+  {
+   cout << "EasyBMP Warning: " << FileName << " ends before its last run." << endl;
+  }
+  delete [] Data;
+ }
+
  // This code reads 1, 4, 8, 24, and 32-bpp files 
  // with a more-efficient buffered technique.
 
- int i,j;
- if( BitDepth != 16 )
+ if( BitDepth != 16 && !IsRLE )
  {
   int BufferSize = (int) ( (Width*BitDepth) / 8.0 );
   while( 8*BufferSize < Width*BitDepth )
@@ -943,12 +1171,18 @@ bool BMP::ReadFromFile( const char* FileName )
   { BufferSize++; }
   ebmpBYTE* Buffer;
   Buffer = new ebmpBYTE [BufferSize];
-  j= Height-1;
-  while( j > -1 )
+  j= LastRow;
+  if( ReadRowsInParallel( fp, BufferSize, NULL, NULL, FirstRow, LastRow ) )
+  { j = -1; }
+  // rows are stored bottom up, so skip the ones below LastRow 
+  else if( j >= FirstRow )
+  { fseek( fp, (long) (Height-1-LastRow) * BufferSize, SEEK_CUR ); }
+  while( j >= FirstRow )
   {
    int BytesRead = (int) fread( (char*) Buffer, 1, BufferSize, fp );
    if( BytesRead < BufferSize )
    {
+    FillRowsWhite( FirstRow, j );
     j = -1; 
     if( EasyBMPwarnings )
     {
@@ -974,6 +1208,7 @@ bool BMP::ReadFromFile( const char* FileName )
      {
       cout << "EasyBMP Error: Could not read enough pixel data!" << endl;
 	 }
+	 FillRowsWhite( FirstRow, j );
 	 j = -1;
     }
    }   
@@ -1050,42 +1285,33 @@ bool BMP::ReadFromFile( const char* FileName )
   while( TempShiftWORD > 31 )
   { TempShiftWORD = TempShiftWORD>>1; RedShift++; }  
   
-  // read the actual pixels
+  // read the actual pixels, a whole row (with its padding) at a time
   
-  for( j=Height-1 ; j >= 0 ; j-- )
+  int BufferSize = DataBytes + PaddingBytes;
+  ebmpBYTE* Buffer = new ebmpBYTE [BufferSize];
+  ebmpWORD Masks[3] = { RedMask, GreenMask, BlueMask };
+  int Shifts[3] = { RedShift, GreenShift, BlueShift };
+  j = LastRow;
+  if( ReadRowsInParallel( fp, BufferSize, Masks, Shifts, FirstRow, LastRow ) )
+  { j = -1; }
+  else if( j >= FirstRow )
+  { fseek( fp, (long) (Height-1-LastRow) * BufferSize, SEEK_CUR ); }
+  for( ; j >= FirstRow ; j-- )
   {
-   i=0;
-   int ReadNumber = 0;
-   while( ReadNumber < DataBytes )
-   {
-	ebmpWORD TempWORD;
-	SafeFread( (char*) &TempWORD , 2 , 1 , fp );
-	if( IsBigEndian() )
-	{ TempWORD = FlipWORD(TempWORD); }
-    ReadNumber += 2;
-  
-    ebmpWORD Red = RedMask & TempWORD;
-    ebmpWORD Green = GreenMask & TempWORD;
-    ebmpWORD Blue = BlueMask & TempWORD;
-				
-	ebmpBYTE BlueBYTE = (ebmpBYTE) 8*(Blue>>BlueShift);
-    ebmpBYTE GreenBYTE = (ebmpBYTE) 8*(Green>>GreenShift);
-    ebmpBYTE RedBYTE = (ebmpBYTE) 8*(Red>>RedShift);
-		
-	(Pixels[i][j]).Red = RedBYTE;
-	(Pixels[i][j]).Green = GreenBYTE;
-	(Pixels[i][j]).Blue = BlueBYTE;
-	
-	i++;
-   }
-   ReadNumber = 0;
-   while( ReadNumber < PaddingBytes )
+   int BytesRead = (int) fread( (char*) Buffer, 1, BufferSize, fp );
+   if( BytesRead < BufferSize || 
+       !Read16bitRow( Buffer, BufferSize, j, RedMask, GreenMask, BlueMask, 
+                      RedShift, GreenShift, BlueShift ) )
    {
-    ebmpBYTE TempBYTE;
-    SafeFread( (char*) &TempBYTE , 1, 1, fp);
-    ReadNumber++;
+    if( EasyBMPwarnings )
+    {
+     cout << "EasyBMP Error: Could not read proper amount of data." << endl;
+    }
+    FillRowsWhite( FirstRow, j );
+    break;
    }
   }
+  delete [] Buffer;
 
  }
  
@@ -1568,6 +1794,148 @@ bool CreateGrayscaleColorTable( BMP& InputImage )
  return true;
 }
 
+bool BMP::ReadRow( ebmpBYTE* Buffer, int BufferSize, int Row, 
+                   const ebmpWORD* Masks, const int* Shifts )
+{
+ if( BitDepth == 1  )
+ { return Read1bitRow(  Buffer, BufferSize, Row ); }
+ if( BitDepth == 4  )
+ { return Read4bitRow(  Buffer, BufferSize, Row ); }
+ if( BitDepth == 8  )
+ { return Read8bitRow(  Buffer, BufferSize, Row ); }
+ if( BitDepth == 16 )
+ {
+  return Read16bitRow( Buffer, BufferSize, Row, Masks[0], Masks[1], Masks[2], 
+                       Shifts[0], Shifts[1], Shifts[2] ); 
+ }
+ if( BitDepth == 24 )
+ { return Read24bitRow( Buffer, BufferSize, Row ); }
+ if( BitDepth == 32 )
+ { return Read32bitRow( Buffer, BufferSize, Row ); }
+ return false;
+}
+
+// Every row sits at a known place in the file, so each thread can pread 
+// its own range of rows without sharing a file position. The ranges are 
+// contiguous, so two threads only ever write to the same cache line 
+// where their ranges meet. 
+
+struct EasyBMProwRange
+{
+ BMP* Image;
+ int FileDescriptor;
+ long DataStart;
+ int BufferSize;
+ int FirstFileRow;
+ int LastFileRow;
+ const ebmpWORD* Masks;
+ const int* Shifts;
+ bool Success;
+};
+
+void* BMP::ReadRowRange( void* Input )
+{
+ EasyBMProwRange* Range = (EasyBMProwRange*) Input;
+ BMP* Image = Range->Image;
+ Range->Success = true;
+#ifdef EasyBMP_PARALLEL_READ
+ // in image rows, which are the file rows upside down 
+ int FirstRow = Image->Height - Range->LastFileRow;
+ int LastRow = Image->Height - 1 - Range->FirstFileRow;
+ if( EasyBMPrangeHook )
+ { EasyBMPrangeHook( true, FirstRow, LastRow ); }
+ ebmpBYTE* Buffer = new ebmpBYTE [Range->BufferSize];
+ for( int FileRow = Range->FirstFileRow ; FileRow < Range->LastFileRow ; FileRow++ )
+ {
+  long Offset = Range->DataStart + (long) FileRow * Range->BufferSize;
+  int BytesRead = (int) pread( Range->FileDescriptor, Buffer, 
+                               Range->BufferSize, Offset );
+  // rows are stored bottom up
+  if( BytesRead < Range->BufferSize || 
+      !Image->ReadRow( Buffer, Range->BufferSize, Image->Height-1-FileRow, 
+                       Range->Masks, Range->Shifts ) )
+  {
+   Range->Success = false; 
+   Image->FillRowsWhite( Image->Height-Range->LastFileRow, 
+                         Image->Height-1-FileRow );
+   break; 
+  }
+ }
+ delete [] Buffer;
+ if( EasyBMPrangeHook )
+ { EasyBMPrangeHook( false, FirstRow, LastRow ); }
+#endif
+ return NULL;
+}
+
+bool BMP::ReadRowsInParallel( FILE* fp, int BufferSize, 
+                              const ebmpWORD* Masks, const int* Shifts, 
+                              int FirstRow, int LastRow )
+{
+ using namespace std;
+#ifndef EasyBMP_PARALLEL_READ
+ return false;
+#else
+ // don't bother with threads for less than this much data per thread
+ const long MinimumBytesPerThread = 1024*1024;
+
+ // the file rows from FirstFileRow up to (not including) EndFileRow 
+ int FirstFileRow = Height-1-LastRow;
+ int EndFileRow = Height-FirstRow;
+ int Rows = EndFileRow - FirstFileRow;
+ long TotalBytes = (long) BufferSize * Rows;
+ int NumberOfThreads = EasyBMPreadThreads;
+ if( NumberOfThreads > TotalBytes / MinimumBytesPerThread )
+ { NumberOfThreads = (int) ( TotalBytes / MinimumBytesPerThread ); }
+ if( NumberOfThreads > Rows )
+ { NumberOfThreads = Rows; }
+ if( NumberOfThreads < 2 )
+ { return false; }
+
+ EasyBMProwRange* Ranges = new EasyBMProwRange [NumberOfThreads];
+ pthread_t* Threads = new pthread_t [NumberOfThreads];
+ bool* Started = new bool [NumberOfThreads];
+ long DataStart = ftell( fp );
+ int n;
+ for( n=0 ; n < NumberOfThreads ; n++ )
+ {
+  Ranges[n].Image = this;
+  Ranges[n].FileDescriptor = fileno( fp );
+  Ranges[n].DataStart = DataStart;
+  Ranges[n].BufferSize = BufferSize;
+  Ranges[n].FirstFileRow = FirstFileRow 
+                           + (int) ( (long) Rows * n / NumberOfThreads );
+  Ranges[n].LastFileRow = FirstFileRow 
+                          + (int) ( (long) Rows * (n+1) / NumberOfThreads );
+  Ranges[n].Masks = Masks;
+  Ranges[n].Shifts = Shifts;
+  // the last range is done on this thread
+  Started[n] = false;
+  if( n < NumberOfThreads-1 )
+  { Started[n] = pthread_create( &Threads[n], NULL, ReadRowRange, &Ranges[n] ) == 0; }
+  if( !Started[n] )
+  { ReadRowRange( &Ranges[n] ); }
+ }
+ 
+ bool Success = true;
+ for( n=0 ; n < NumberOfThreads ; n++ )
+ {
+  if( Started[n] )
+  { pthread_join( Threads[n], NULL ); }
+  Success &= Ranges[n].Success;
+ }
+ delete [] Ranges;
+ delete [] Threads;
+ delete [] Started;
+
+ if( !Success && EasyBMPwarnings )
+ {
+  cout << "EasyBMP Error: Could not read proper amount of data." << endl;
+ }
+ return true;
+#endif
+}
+
 bool BMP::Read32bitRow( ebmpBYTE* Buffer, int BufferSize, int Row )
 { 
  int i;
@@ -1578,13 +1946,110 @@ bool BMP::Read32bitRow( ebmpBYTE* Buffer, int BufferSize, int Row )
  return true;
 }
 
+// The row decoders below read a whole row from Buffer in one pass, and 
+// go straight to Pixels and Colors instead of through operator() and 
+// GetColor(), which check their arguments on every pixel. 
+
+#ifdef EasyBMP_X86_DISPATCH
+
+// spread 4 packed BGR pixels out to 4 BGRA pixels with one shuffle. 
+// Each load reads 16 bytes but only uses 12, so stop early enough that 
+// the load stays inside the buffer. Returns how many pixels it did. 
+__attribute__((target("ssse3")))
+static int Spread24bitSSSE3( const ebmpBYTE* Buffer, int BufferSize, 
+                             int Count, ebmpDWORD* Spread )
+{
+ const __m128i Shuffle = _mm_setr_epi8( 0,1,2,-128, 3,4,5,-128, 
+                                        6,7,8,-128, 9,10,11,-128 );
+ int i=0;
+ while( 3*i + 16 <= BufferSize && i+4 <= Count )
+ {
+  __m128i Packed = _mm_loadu_si128( (const __m128i*) (Buffer+3*i) );
+  _mm_storeu_si128( (__m128i*) (Spread+i), _mm_shuffle_epi8( Packed, Shuffle ) );
+  i += 4;
+ }
+ return i;
+}
+
+// the same, 8 pixels at a time. The shuffle can't cross the two 16 byte 
+// halves, so first move bytes 12 to 27 up into the top half, which can 
+// then be shuffled just like the bottom one. 
+__attribute__((target("avx2")))
+static int Spread24bitAVX2( const ebmpBYTE* Buffer, int BufferSize, 
+                            int Count, ebmpDWORD* Spread )
+{
+ const __m256i Halves = _mm256_setr_epi32( 0,1,2,3, 3,4,5,6 );
+ const __m256i Shuffle = _mm256_setr_epi8( 0,1,2,-128, 3,4,5,-128, 
+                                           6,7,8,-128, 9,10,11,-128, 
+                                           0,1,2,-128, 3,4,5,-128, 
+                                           6,7,8,-128, 9,10,11,-128 );
+ int i=0;
+ while( 3*i + 32 <= BufferSize && i+8 <= Count )
+ {
+  __m256i Packed = _mm256_loadu_si256( (const __m256i*) (Buffer+3*i) );
+  Packed = _mm256_permutevar8x32_epi32( Packed, Halves );
+  _mm256_storeu_si256( (__m256i*) (Spread+i), _mm256_shuffle_epi8( Packed, Shuffle ) );
+  i += 8;
+ }
+ return i + Spread24bitSSSE3( Buffer+3*i, BufferSize-3*i, Count-i, Spread+i );
+}
+
+#endif
+
+// spreads Count packed BGR pixels out to BGRA, with Alpha = 0 
+static void Spread24bitPixels( const ebmpBYTE* Buffer, int BufferSize, 
+                               int Count, ebmpDWORD* Spread )
+{
+ int i=0;
+#ifdef EasyBMP_X86_DISPATCH
+ if( EasyBMPsimdLevel >= 2 )
+ { i = Spread24bitAVX2( Buffer, BufferSize, Count, Spread ); }
+ else if( EasyBMPsimdLevel == 1 )
+ { i = Spread24bitSSSE3( Buffer, BufferSize, Count, Spread ); }
+#endif
+
+ // without vectors, do 4 pixels at a time out of 3 little endian DWORDs
+ if( !IsBigEndian() )
+ {
+  while( i+4 <= Count )
+  {
+   ebmpDWORD Words[3];
+   memcpy( (char*) Words, Buffer+3*i, 12 );
+   Spread[i  ] = Words[0] & 0x00FFFFFF;
+   Spread[i+1] = ( Words[0] >> 24 ) | ( (Words[1] & 0x0000FFFF) << 8 );
+   Spread[i+2] = ( Words[1] >> 16 ) | ( (Words[2] & 0x000000FF) << 16 );
+   Spread[i+3] = Words[2] >> 8;
+   i += 4;
+  }
+ }
+
+ for( ; i < Count ; i++ )
+ {
+  RGBApixel Pixel;
+  memcpy( (char*) &Pixel, Buffer+3*i, 3 );
+  Pixel.Alpha = 0;
+  memcpy( (char*) &Spread[i], (char*) &Pixel, 4 );
+ }
+}
+
 bool BMP::Read24bitRow( ebmpBYTE* Buffer, int BufferSize, int Row )
 { 
- int i;
  if( Width*3 > BufferSize )
  { return false; }
- for( i=0 ; i < Width ; i++ )
- { memcpy( (char*) &(Pixels[i][Row]), Buffer+3*i, 3 ); }
+
+ // spread a block of the row at a time, then copy it into the columns
+ ebmpDWORD Spread[64];
+ int i=0;
+ while( i < Width )
+ {
+  int Count = Width - i;
+  if( Count > 64 )
+  { Count = 64; }
+  Spread24bitPixels( Buffer+3*i, BufferSize-3*i, Count, Spread );
+  for( int k=0 ; k < Count ; k++ )
+  { memcpy( (char*) &(Pixels[i+k][Row]), (char*) &Spread[k], 4 ); }
+  i += Count;
+ }
  return true;
 }
 
@@ -1593,60 +2058,148 @@ bool BMP::Read8bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row )
  int i;
  if( Width > BufferSize )
  { return false; }
+ // Colors always has 256 entries at this depth, so any byte is safe
  for( i=0 ; i < Width ; i++ )
- {
-  int Index = Buffer[i];
-  *( this->operator()(i,Row) )= GetColor(Index); 
- }
+ { Pixels[i][Row] = Colors[ Buffer[i] ]; }
  return true;
 }
 
 bool BMP::Read4bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row )
 {
- int Shifts[2] = {4  ,0 };
- int Masks[2]  = {240,15};
- 
  int i=0;
- int j;
  int k=0;
  if( Width > 2*BufferSize )
  { return false; }
- while( i < Width )
+ while( i+2 <= Width )
  {
-  j=0;
-  while( j < 2 && i < Width )
-  {
-   int Index = (int) ( (Buffer[k]&Masks[j]) >> Shifts[j]);
-   *( this->operator()(i,Row) )= GetColor(Index); 
-   i++; j++;   
-  }
-  k++;
+  Pixels[i  ][Row] = Colors[ Buffer[k] >> 4 ];
+  Pixels[i+1][Row] = Colors[ Buffer[k] & 15 ];
+  i += 2; k++;
  }
+ if( i < Width )
+ { Pixels[i][Row] = Colors[ Buffer[k] >> 4 ]; }
  return true;
 }
+void BMP::SetRLErun( int Row, int X, int Length, ebmpBYTE Index, 
+                     void* Image )
+{
+ BMP& Target = *(BMP*) Image;
+ int j = Target.Height - 1 - Row;
+ for( int i=X ; i < X + Length ; i++ )
+ { Target.Pixels[i][j] = Target.Colors[Index]; }
+}
+
 bool BMP::Read1bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row )
 {
- int Shifts[8] = {7  ,6 ,5 ,4 ,3,2,1,0};
- int Masks[8]  = {128,64,32,16,8,4,2,1};
- 
  int i=0;
  int j;
  int k=0;
  
  if( Width > 8*BufferSize )
  { return false; }
- while( i < Width )
+ while( i+8 <= Width )
+ {
+  int Byte = Buffer[k];
+  for( j=0 ; j < 8 ; j++ )
+  { Pixels[i+j][Row] = Colors[ (Byte >> (7-j)) & 1 ]; }
+  i += 8; k++;
+ }
+ for( j=0 ; i < Width ; i++, j++ )
+ { Pixels[i][Row] = Colors[ (Buffer[k] >> (7-j)) & 1 ]; }
+ return true;
+}
+
+bool BMP::Read16bitRow( ebmpBYTE* Buffer, int BufferSize, int Row, 
+                        ebmpWORD RedMask, ebmpWORD GreenMask, ebmpWORD BlueMask, 
+                        int RedShift, int GreenShift, int BlueShift )
+{
+ int i;
+ if( Width*2 > BufferSize )
+ { return false; }
+ for( i=0 ; i < Width ; i++ )
+ {
+  ebmpWORD TempWORD = (ebmpWORD) ( Buffer[2*i] | (Buffer[2*i+1] << 8) );
+  (Pixels[i][Row]).Red   = (ebmpBYTE) ( 8*((RedMask & TempWORD) >> RedShift) );
+  (Pixels[i][Row]).Green = (ebmpBYTE) ( 8*((GreenMask & TempWORD) >> GreenShift) );
+  (Pixels[i][Row]).Blue  = (ebmpBYTE) ( 8*((BlueMask & TempWORD) >> BlueShift) );
+ }
+ return true;
+}
+
+#ifdef EasyBMP_X86_DISPATCH
+
+// the reverse of Spread24bitSSSE3: pack 4 BGRA pixels down to 12 bytes 
+// of BGR with one shuffle. Each store writes 16 bytes, so stop early 
+// enough that it stays inside the buffer. Returns how many pixels it did. 
+__attribute__((target("ssse3")))
+static int Pack24bitSSSE3( const ebmpDWORD* Spread, int Count, 
+                           ebmpBYTE* Buffer, int BufferSize )
+{
+ const __m128i Shuffle = _mm_setr_epi8( 0,1,2, 4,5,6, 8,9,10, 12,13,14, 
+                                        -128,-128,-128,-128 );
+ int i=0;
+ while( 3*i + 16 <= BufferSize && i+4 <= Count )
+ {
+  __m128i Pixels = _mm_loadu_si128( (const __m128i*) (Spread+i) );
+  _mm_storeu_si128( (__m128i*) (Buffer+3*i), _mm_shuffle_epi8( Pixels, Shuffle ) );
+  i += 4;
+ }
+ return i;
+}
+
+// the same, 8 pixels at a time. Each half is packed into its bottom 12 
+// bytes, and then the two are moved together. 
+__attribute__((target("avx2")))
+static int Pack24bitAVX2( const ebmpDWORD* Spread, int Count, 
+                          ebmpBYTE* Buffer, int BufferSize )
+{
+ const __m256i Shuffle = _mm256_setr_epi8( 0,1,2, 4,5,6, 8,9,10, 12,13,14, 
+                                           -128,-128,-128,-128, 
+                                           0,1,2, 4,5,6, 8,9,10, 12,13,14, 
+                                           -128,-128,-128,-128 );
+ const __m256i Together = _mm256_setr_epi32( 0,1,2, 4,5,6, 7,7 );
+ int i=0;
+ while( 3*i + 32 <= BufferSize && i+8 <= Count )
  {
-  j=0;
-  while( j < 8 && i < Width )
+  __m256i Pixels = _mm256_loadu_si256( (const __m256i*) (Spread+i) );
+  Pixels = _mm256_shuffle_epi8( Pixels, Shuffle );
+  _mm256_storeu_si256( (__m256i*) (Buffer+3*i), 
+                       _mm256_permutevar8x32_epi32( Pixels, Together ) );
+  i += 8;
+ }
+ return i + Pack24bitSSSE3( Spread+i, Count-i, Buffer+3*i, BufferSize-3*i );
+}
+
+#endif
+
+// packs Count BGRA pixels down to BGR 
+static void Pack24bitPixels( const ebmpDWORD* Spread, int Count, 
+                             ebmpBYTE* Buffer, int BufferSize )
+{
+ int i=0;
+#ifdef EasyBMP_X86_DISPATCH
+ if( EasyBMPsimdLevel >= 2 )
+ { i = Pack24bitAVX2( Spread, Count, Buffer, BufferSize ); }
+ else if( EasyBMPsimdLevel == 1 )
+ { i = Pack24bitSSSE3( Spread, Count, Buffer, BufferSize ); }
+#endif
+
+ // without vectors, do 4 pixels at a time into 3 little endian DWORDs
+ if( !IsBigEndian() )
+ {
+  while( i+4 <= Count )
   {
-   int Index = (int) ( (Buffer[k]&Masks[j]) >> Shifts[j]);
-   *( this->operator()(i,Row) )= GetColor(Index); 
-   i++; j++;   
+   ebmpDWORD Words[3];
+   Words[0] = ( Spread[i  ] & 0x00FFFFFF ) | ( Spread[i+1] << 24 );
+   Words[1] = ( ( Spread[i+1] >> 8 ) & 0x0000FFFF ) | ( Spread[i+2] << 16 );
+   Words[2] = ( ( Spread[i+2] >> 16 ) & 0x000000FF ) | ( Spread[i+3] << 8 );
+   memcpy( Buffer+3*i, (char*) Words, 12 );
+   i += 4;
   }
-  k++;
  }
- return true;
+
+ for( ; i < Count ; i++ )
+ { memcpy( Buffer+3*i, (char*) &Spread[i], 3 ); }
 }
 
 bool BMP::Write32bitRow( ebmpBYTE* Buffer, int BufferSize, int Row )
@@ -1661,52 +2214,91 @@ bool BMP::Write32bitRow( ebmpBYTE* Buffer, int BufferSize, int Row )
 
 bool BMP::Write24bitRow( ebmpBYTE* Buffer, int BufferSize, int Row )
 { 
- int i;
  if( Width*3 > BufferSize )
  { return false; }
- for( i=0 ; i < Width ; i++ )
- { memcpy( (char*) Buffer+3*i,  (char*) &(Pixels[i][Row]), 3 ); }
+
+ // copy a block of the row out of the columns at a time, then pack it
+ ebmpDWORD Spread[64];
+ int i=0;
+ while( i < Width )
+ {
+  int Count = Width - i;
+  if( Count > 64 )
+  { Count = 64; }
+  for( int k=0 ; k < Count ; k++ )
+  { memcpy( (char*) &Spread[k], (char*) &(Pixels[i+k][Row]), 4 ); }
+  Pack24bitPixels( Spread, Count, Buffer+3*i, BufferSize-3*i );
+  i += Count;
+ }
+ return true;
+}
+
+bool BMP::Write16bitRow( ebmpBYTE* Buffer, int BufferSize, int Row )
+{
+ if( Width*2 > BufferSize )
+ { return false; }
+ for( int i=0 ; i < Width ; i++ )
+ {
+  const RGBApixel& Pixel = Pixels[i][Row];
+  ebmpWORD RedWORD = (ebmpWORD) (Pixel.Red / 8);
+  ebmpWORD GreenWORD = (ebmpWORD) (Pixel.Green / 4);
+  ebmpWORD BlueWORD = (ebmpWORD) (Pixel.Blue / 8);
+  ebmpWORD TempWORD = (RedWORD<<11) + (GreenWORD<<5) + BlueWORD;
+  if( IsBigEndian() )
+  { TempWORD = FlipWORD( TempWORD ); }
+  memcpy( (char*) Buffer+2*i, (char*) &TempWORD, 2 );
+ }
  return true;
 }
 
-bool BMP::Write8bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row )
+// FindClosestColor() searches the whole palette, so remember its answers 
+// for as long as the file is being written. 
+
+ebmpBYTE BMP::FindClosestColorCached( RGBApixel& Input, ColorCache& Cache )
+{
+ ebmpDWORD Key = 0x80000000 | ( (ebmpDWORD) Input.Red << 16 ) | 
+                 ( (ebmpDWORD) Input.Green << 8 ) | Input.Blue;
+ int Slot = (int) ( ( Key * 2654435761u ) >> 16 ) & 65535;
+ if( Cache.Keys[Slot] != Key )
+ {
+  Cache.Keys[Slot] = Key;
+  Cache.Indices[Slot] = FindClosestColor( Input );
+ }
+ return Cache.Indices[Slot];
+}
+
+bool BMP::Write8bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row, 
+                         ColorCache& Cache )
 {
  int i;
  if( Width > BufferSize )
  { return false; }
  for( i=0 ; i < Width ; i++ )
- { Buffer[i] = FindClosestColor( Pixels[i][Row] ); }
+ { Buffer[i] = FindClosestColorCached( Pixels[i][Row], Cache ); }
  return true;
 }
 
-bool BMP::Write4bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row )
+bool BMP::Write4bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row, 
+                         ColorCache& Cache )
 { 
- int PositionWeights[2]  = {16,1};
- 
  int i=0;
- int j;
  int k=0;
  if( Width > 2*BufferSize )
  { return false; }
  while( i < Width )
  {
-  j=0;
-  int Index = 0;
-  while( j < 2 && i < Width )
-  {
-   Index += ( PositionWeights[j]* (int) FindClosestColor( Pixels[i][Row] ) ); 
-   i++; j++;   
-  }
+  int Index = FindClosestColorCached( Pixels[i][Row], Cache ) << 4;
+  if( i+1 < Width )
+  { Index |= FindClosestColorCached( Pixels[i+1][Row], Cache ); }
   Buffer[k] = (ebmpBYTE) Index;
-  k++;
+  i += 2; k++;
  }
  return true;
 }
 
-bool BMP::Write1bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row )
+bool BMP::Write1bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row, 
+                         ColorCache& Cache )
 { 
- int PositionWeights[8]  = {128,64,32,16,8,4,2,1};
- 
  int i=0;
  int j;
  int k=0;
@@ -1714,13 +2306,9 @@ bool BMP::Write1bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row )
  { return false; }
  while( i < Width )
  {
-  j=0;
   int Index = 0;
-  while( j < 8 && i < Width )
-  {
-   Index += ( PositionWeights[j]* (int) FindClosestColor( Pixels[i][Row] ) ); 
-   i++; j++;   
-  }
+  for( j=0 ; j < 8 && i < Width ; j++, i++ )
+  { Index |= FindClosestColorCached( Pixels[i][Row], Cache ) << (7-j); }
   Buffer[k] = (ebmpBYTE) Index;
   k++;
  }
@@ -1913,3 +2501,101 @@ bool Rescale( BMP& InputImage , char mode, int NewDimension )
  *InputImage(NewWidth-1,NewHeight-1) = *OldImage(OldWidth-1,OldHeight-1);
  return true;
 }
+
+// Collects pixels into runs, so that the callback sees each run of one 
+// index once, however the encoder happened to split it up. 
+
+struct EasyBMPrunJoiner
+{
+ EasyBMPrunCallback Run;
+ void* UserData;
+ int Row;
+ int X;
+ int Length;
+ ebmpBYTE Index;
+};
+
+static void JoinRun( EasyBMPrunJoiner& Joiner, int Row, int X, int Length, 
+                     ebmpBYTE Index )
+{
+ if( Length <= 0 )
+ { return; }
+ if( Joiner.Length > 0 && Joiner.Row == Row && Joiner.Index == Index && 
+     Joiner.X + Joiner.Length == X )
+ { Joiner.Length += Length; return; }
+ if( Joiner.Length > 0 )
+ { Joiner.Run( Joiner.Row, Joiner.X, Joiner.Length, Joiner.Index, Joiner.UserData ); }
+ Joiner.Row = Row;
+ Joiner.X = X;
+ Joiner.Length = Length;
+ Joiner.Index = Index;
+}
+
+bool DecodeEasyBMPrle( const ebmpBYTE* Data, long DataBytes, int BitDepth, 
+                       int Width, int Height, 
+                       EasyBMPrunCallback Run, void* UserData )
+{
+ EasyBMPrunJoiner Joiner;
+ Joiner.Run = Run;
+ Joiner.UserData = UserData;
+ Joiner.Length = 0;
+
+ long k = 0;
+ int Row = 0;
+ int X = 0;
+ bool Ended = false;
+ while( !Ended && Row < Height && k+2 <= DataBytes )
+ {
+  int Count = Data[k];
+  int Value = Data[k+1];
+  k += 2;
+  if( Count > 0 )
+  {
+   // an encoded run. At 4 bits the two nibbles take turns. 
+   int Length = Count;
+   if( X + Length > Width )
+   { Length = Width - X; }
+   if( BitDepth == 8 || (Value >> 4) == (Value & 15) )
+   { JoinRun( Joiner, Row, X, Length, (ebmpBYTE) (BitDepth == 8 ? Value : Value & 15) ); }
+   else
+   {
+    for( int i=0 ; i < Length ; i++ )
+    { JoinRun( Joiner, Row, X+i, 1, (ebmpBYTE) ( i % 2 ? Value & 15 : Value >> 4 ) ); }
+   }
+   X += Count;
+  }
+  else if( Value == 0 )
+  { Row++; X = 0; }
+  else if( Value == 1 )
+  { Ended = true; }
+  else if( Value == 2 )
+  {
+   if( k+2 > DataBytes )
+   { break; }
+   X += Data[k];
+   Row += Data[k+1];
+   k += 2;
+  }
+  else
+  {
+   // absolute mode: Value literal pixels, padded to a whole WORD
+   long Bytes = BitDepth == 8 ? Value : (Value+1)/2;
+   if( k + Bytes > DataBytes )
+   { break; }
+   for( int i=0 ; i < Value ; i++ )
+   {
+    int Index;
+    if( BitDepth == 8 )
+    { Index = Data[k+i]; }
+    else
+    { Index = i % 2 ? Data[k+i/2] & 15 : Data[k+i/2] >> 4; }
+    if( X+i < Width )
+    { JoinRun( Joiner, Row, X+i, 1, (ebmpBYTE) Index ); }
+   }
+   X += Value;
+   k += Bytes + Bytes % 2;
+  }
+ }
+ JoinRun( Joiner, -1, 0, 1, 0 );
+ return Ended || Row >= Height;
+}
@@ -48,6 +48,13 @@
 // where it goes. 
 #endif
 
+#if !defined(_WIN32) && !defined(EasyBMP_NO_PARALLEL_READ)
+// Large files are decoded by several threads at once, using pthreads and 
+// pread. See SetEasyBMPreadThreads(). Link with -lpthread. 
+#define EasyBMP_PARALLEL_READ
+#endif
+
+
 #ifdef __INTEL_COMPILER
 // If Intel specific code is ever required, this is 
 // where it goes. 
@@ -83,4 +90,21 @@ void SetEasyBMPwarningsOff( void );
 void SetEasyBMPwarningsOn( void );
 bool GetEasyBMPwarningState( void );
 
+// How many threads ReadFromFile may use to decode one large file. 
+// The default is 1. 
+void SetEasyBMPreadThreads( int NumberOfThreads );
+int GetEasyBMPreadThreads( void );
+
+// Called on the thread that decodes each range of rows when a file is 
+// read by several threads, with Started true before it decodes rows 
+// FirstRow to LastRow and false after. The default is none. 
+typedef void (*EasyBMPreadHook)( bool Started, int FirstRow, int LastRow );
+void SetEasyBMPreadHook( EasyBMPreadHook Hook );
+
+// Which vector instructions the 24-bit row decoder may use: 0 for none, 
+// 1 for up to SSSE3, 2 for up to AVX2. The default is the best that the 
+// CPU has, and asking for more than that gets what the CPU has. 
+void SetEasyBMPsimdLevel( int Level );
+int GetEasyBMPsimdLevel( void );
+
 #endif
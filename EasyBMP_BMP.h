@@ -21,6 +21,28 @@
 #ifndef _EasyBMP_BMP_h_
 #define _EasyBMP_BMP_h_
 
+struct EasyBMProwRange;
+
+// Keeps the pixel blocks of destroyed or resized images around so the 
+// next image can reuse them, instead of going back to the allocator for 
+// every image in a batch. Not thread safe: give each thread its own. 
+
+class EasyBMPpixelArena
+{private:
+ enum { MaximumBlocks = 8 };
+ ebmpBYTE* Blocks[MaximumBlocks];
+ long BlockSizes[MaximumBlocks];
+ int NumberOfBlocks;
+ 
+ EasyBMPpixelArena( EasyBMPpixelArena& );
+ 
+ public:
+ EasyBMPpixelArena();
+ ~EasyBMPpixelArena();
+ ebmpBYTE* Take( long Size, long& ActualSize );
+ void Give( ebmpBYTE* Block, long Size );
+};
+
 bool SafeFread( char* buffer, int size, int number, FILE* fp );
 bool EasyBMPcheckDataSize( void );
 
@@ -31,6 +53,9 @@ class BMP
  int Width;
  int Height;
  RGBApixel** Pixels;
+ ebmpBYTE* PixelBlock;
+ long PixelBlockSize;
+ EasyBMPpixelArena* Arena;
  RGBApixel* Colors;
  int XPelsPerMeter;
  int YPelsPerMeter;
@@ -45,14 +70,42 @@ class BMP
  bool Read8bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row );  
  bool Read4bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row );  
  bool Read1bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row );
+ bool Read16bitRow( ebmpBYTE* Buffer, int BufferSize, int Row, 
+                    ebmpWORD RedMask, ebmpWORD GreenMask, ebmpWORD BlueMask, 
+                    int RedShift, int GreenShift, int BlueShift );
+ bool ReadRow( ebmpBYTE* Buffer, int BufferSize, int Row, 
+               const ebmpWORD* Masks, const int* Shifts );
+ bool ReadRowsInParallel( FILE* fp, int BufferSize, 
+                          const ebmpWORD* Masks, const int* Shifts, 
+                          int FirstRow, int LastRow );
+ static void* ReadRowRange( void* Range );
+ static void SetRLErun( int Row, int X, int Length, ebmpBYTE Index, 
+                        void* Image );
    
- bool Write32bitRow( ebmpBYTE* Buffer, int BufferSize, int Row );   
- bool Write24bitRow( ebmpBYTE* Buffer, int BufferSize, int Row );   
- bool Write8bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row );  
- bool Write4bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row );  
- bool Write1bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row );
+ // FindClosestColor()'s answers, while a file is being written 
+ struct ColorCache
+ {
+  ebmpDWORD Keys[65536];
+  ebmpBYTE Indices[65536];
+ };
+
+ bool Write32bitRow( ebmpBYTE* Buffer, int BufferSize, int Row );
+ bool Write24bitRow( ebmpBYTE* Buffer, int BufferSize, int Row );
+ bool Write16bitRow( ebmpBYTE* Buffer, int BufferSize, int Row );
+ bool Write8bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row, 
+                     ColorCache& Cache );
+ bool Write4bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row, 
+                     ColorCache& Cache );
+ bool Write1bitRow(  ebmpBYTE* Buffer, int BufferSize, int Row, 
+                     ColorCache& Cache );
  
  ebmpBYTE FindClosestColor( RGBApixel& input );
+ ebmpBYTE FindClosestColorCached( RGBApixel& Input, ColorCache& Cache );
+ 
+ void InitializeEmpty( void );
+ bool AllocatePixels( int NewWidth, int NewHeight );
+ void FreePixels( void );
+ void FillRowsWhite( int FirstRow, int LastRow );
 
  public: 
 
@@ -66,7 +119,16 @@ class BMP
   
  BMP();
  BMP( BMP& Input );
+#if __cplusplus >= 201103L
+ BMP( BMP&& Input );
+ BMP& operator=( BMP&& Input );
+#endif
  ~BMP();
+ void Swap( BMP& Other );
+ 
+ // Pixel blocks come from, and go back to, this arena. The current 
+ // pixels are discarded, so set it before reading or sizing the image. 
+ void SetPixelArena( EasyBMPpixelArena* NewArena );
  RGBApixel* operator()(int i,int j);
  
  RGBApixel GetPixel( int i, int j ) const;
@@ -75,9 +137,16 @@ class BMP
  bool CreateStandardColorTable( void );
  
  bool SetSize( int NewWidth, int NewHeight );
+ // For when every pixel is about to be overwritten anyway
+ bool SetSizeWithoutClearing( int NewWidth, int NewHeight );
  bool SetBitDepth( int NewDepth );
  bool WriteToFile( const char* FileName );
  bool ReadFromFile( const char* FileName );
+ // Only decodes rows FirstRow to LastRow (0 is the top row), for a 
+ // caller that will never look at the rest, which are left as whatever 
+ // was in memory. The image is still the file's full size. RLE files 
+ // are always decoded whole. 
+ bool ReadRowsFromFile( const char* FileName, int FirstRow, int LastRow );
  
  RGBApixel GetColor( int ColorNumber );
  bool SetColor( int ColorNumber, RGBApixel NewColor ); 
@@ -40,4 +40,16 @@ bool CreateGrayscaleColorTable( BMP& InputImage );
 
 bool Rescale( BMP& InputImage , char mode, int NewDimension );
 
+// Decodes BI_RLE8 (BitDepth 8) or BI_RLE4 (BitDepth 4) pixel data, and 
+// passes each run of one palette index to Run, in the order they are in 
+// the file: bottom row (Row 0) first, and left to right. Runs are joined 
+// up where the encoder split them, and clipped to Width. Pixels that the 
+// data skips over are never passed. Returns false if the data ends 
+// before the end of bitmap marker. 
+typedef void (*EasyBMPrunCallback)( int Row, int X, int Length, 
+                                    ebmpBYTE Index, void* UserData );
+bool DecodeEasyBMPrle( const ebmpBYTE* Data, long DataBytes, int BitDepth, 
+                       int Width, int Height, 
+                       EasyBMPrunCallback Run, void* UserData );
+
 #endif
@@ -13,9 +13,121 @@ License: GPL 2
 Copyright: 2009 by Gordon McCreight
 
 usage:
-  bmpgrep return_how_many_matches pattern_threshold (the line continues...)
+  bmpgrep [options] return_how_many_matches pattern_threshold (continues...)
     tolerance_r tolerance_g tolerance_b big.bmp small.bmp
 
+  bmpgrep --serve-stdin [--shm-cache] [--trace FILE]
+
+options:
+  --stats  Print timings and scan counters to stderr, one "name=value"
+           per line.  See SearchStats in libbmpgrep.h for the meaning of
+           each one.
+
+  --serve-stdin  Read queries from stdin, one per line, until end of file.
+           Each line takes the same arguments as a normal run (including
+           --stats), and gets exactly one line of output: the matches, or
+           an empty line if there were none or the query was bad.  Decoded
+           images and compiled patterns are kept in memory between queries,
+           and queries that arrive together and share a big image are
+           searched in a single pass over it.  Big images that are mostly
+           flat areas of color are instead searched a run of one color at
+           a time (see RunTable in libbmpgrep.h).  Queries with tolerances
+           also get the sums of each big image's pixels, worked out once
+           per image, which turn down positions whose pixels add up to too
+           much or too little to match, and the range of each window of
+           it, which turns down those whose pixels are too flat or too
+           busy (see SumTable and RangeTable in libbmpgrep.h).
+
+  --perf-counters  Print the hardware performance counters of each phase
+           of the run to stderr: reading the big and small images, building
+           the pattern (compile), choosing an engine and building its
+           tables (choose_engine, see --explain) and the scan.  For each
+           phase, in the same "name=value" form as --stats, that is the id
+           of the thread it ran on (read_small runs on its own thread while
+           read_big runs), and the cycles, instructions, L1 data cache
+           read misses, last level cache misses and branch mispredictions
+           of that thread and the threads it started.  Counters that
+           aren't available read as -1.  See bmpgrep_perf.h.  Not
+           available with --serve-stdin.
+
+  --trace FILE  Write a timeline of the run to FILE when bmpgrep exits, in
+           the Trace Event Format that chrome://tracing and Perfetto load:
+           a span for each phase on the thread that ran it, for each range
+           of rows that a decoder thread read, and for each band of rows
+           that the scan checked at once.  See bmpgrep_trace.h.  With
+           --serve-stdin it covers the whole session, with a span for each
+           batch of queries, and is given to --serve-stdin itself rather
+           than on the query lines.
+
+  --explain  Print to stderr, as "name=value" lines, which engine searched
+           the big image and why.  A 1-bit, palettized or RLE big image
+           has an engine of its own (bits, indexed or rle), as do --top
+           and --scales.  Any other image gets the one that a cost model
+           expects to be quickest, from trying the pattern on a sample of
+           its positions: pixels, anchored, screened (anchored, with the
+           SumTable and RangeTable that --serve-stdin keeps) or runs (see
+           RunTable).  The estimate for each of them, in microseconds, is
+           printed too, along with what it was worked out from.  See
+           ChooseEngine in libbmpgrep.h.  Not available with --serve-stdin,
+           which builds its tables once per image instead.
+
+  --threads N  How many threads may decode one large image.  The default
+           is one per CPU.
+
+  --scales S,S,...  Also look for the small image scaled by each of these
+           factors (1.25 for 125% DPI scaling, and so on), to the nearest
+           percent.  The small image is resampled once per scale with
+           EasyBMP's Rescale(), and all of the scales are searched in a
+           single pass over the big image.  Each match is printed as
+           x,y,scale, and return_how_many_matches counts per scale.  Not
+           available with --serve-stdin.
+
+  --top K  Instead of looking for matches within the tolerances, print the
+           K positions that are closest to the small image, best first,
+           as x,y,score.  The score is the sum of the absolute differences
+           of every pixel's red, green and blue values, so 0 is an exact
+           match.  return_how_many_matches, pattern_threshold and the
+           tolerances are ignored.  See BestMatcher in libbmpgrep.h.
+
+  --max-mismatch N  Still count a position as a match if no more than N of
+           the pattern pixels fail the tolerance test, so that a cursor
+           or a few flickering pixels don't hide a match.  N can also be
+           a percentage of the pattern, like 2%.  A position is given up
+           on as soon as N+1 pixels have failed.
+
+  --deadline-ms N  Give up on the search N milliseconds after bmpgrep
+           started (or, with --serve-stdin, after the query arrived).  The
+           clock is checked before each row of positions, so it can run
+           over by about a row's worth, and the images are always read in
+           full.  The matches found by then are printed as usual, followed
+           by " incomplete:R/T" on the same line, meaning that the first R
+           of the T rows of positions were searched.  Not available with
+           --top.
+
+  --shard I/N  Only search the Ith (counting from 1) of N horizontal
+           strips of positions, so that one search can be split between
+           machines.  Matches are still printed in the big image's
+           coordinates, and bmpgrep_merge puts the outputs of the shards
+           back together (see bmpgrep_merge.cpp).  A shard of a 24 or
+           32-bit BMP only decodes its strip of rows, plus the small
+           image's height less one below it.  Not available with --top.
+
+  --simd LEVEL  The most capable vector instructions to use: scalar, sse2,
+           avx2 or avx512.  The default is the best this CPU has (see
+           SetSimdLevel in libbmpgrep.h), so this is only needed to rule
+           the vector code out, or to compare the variants.
+
+  --shm-cache  Share decoded images with other bmpgrep processes on this
+           host through POSIX shared memory (see bmpgrep_shm.h).  A file
+           that some other process has already decoded is mapped instead
+           of being decoded again.  With --serve-stdin it applies to the
+           whole session and is ignored on the query lines.
+
+Either image can also be raw pixels (raw:FORMAT:WIDTHxHEIGHT:STRIDE:SOURCE)
+or a binary PPM (ppm:SOURCE), read from a file, stdin or shared memory,
+which saves a screen grabber from writing out a BMP for every frame.  See
+bmpgrep_raw.h for the details.
+
 If return_how_many_matches is set to 0, then it will find as many as it can.
 
 "pattern_threshold" determines how aggressively it tries to shrink the pattern
@@ -25,12 +137,24 @@ there may not be enough pixels to check.
 
 tolerances are 0-255
 
+When both images are 1, 4 or 8-bit palettized BMPs, they are searched by
+palette index instead of by color (see bmpgrep_indexed.h), which uses a
+quarter of the memory.  When both are 1-bit, they stay packed 64 pixels
+to a word and are compared a word at a time.  An RLE8 or RLE4 big image
+is searched without being decompressed, a run at a time.  The results are
+the same either way.
+
 description: Find the location of a small BMP within a big one.
 Prints a comma seperated list of x,y (for one match)
 or x,y,x,y,x,y for multiple matches.
 
 Note: Can be compiled like so:
-g++ -o bmpgrep bmpgrep.cpp EasyBMP.cpp
+g++ -o bmpgrep bmpgrep.cpp libbmpgrep.cpp bmpgrep_cache.cpp bmpgrep_shm.cpp \
+  bmpgrep_indexed.cpp bmpgrep_raw.cpp bmpgrep_perf.cpp bmpgrep_trace.cpp \
+  EasyBMP.cpp -lrt -lpthread
+
+The search itself lives in libbmpgrep.cpp, so it can also be linked into
+another program.  See libbmpgrep.h for that.
 
 After you compile, you might want to test with this (the result should be
 six numbers long):
@@ -41,201 +165,1098 @@ pushes the tests a bit harder.  You can also run that test script
 with the option 1 ( so, like ./compile_and_test.pl 1 ) and it will
 run it as a performance test.
 
-One note, we modify the stock EasyBMP library in one place where is does
-bounds checking on the pixel requested.  We've removed the bounds checking.
-This speeds things up a bit.
+One note, we modify the stock EasyBMP library in a few places.  We've
+removed the bounds checking on the pixel requested, which speeds things up
+a bit.  The row decoders in ReadFromFile also work on a whole row at a
+time instead of going through operator() and GetColor() for each pixel,
+and the 24-bit one uses SSSE3 or AVX2 when the CPU has them.  Large
+files are decoded by several threads (see SetEasyBMPreadThreads).  All of
+an image's pixels live in one block, which can come from an
+EasyBMPpixelArena, and ReadFromFile doesn't clear them before decoding.
+ReadFromFile also decodes RLE8 and RLE4 files (see DecodeEasyBMPrle),
+which stock EasyBMP refuses.
 
 TODO: Better options verification and add help information.
 ******************************************************************************
 *****************************************************************************/
 
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
 #include "EasyBMP.h"
+#include "libbmpgrep.h"
+#include "bmpgrep_cache.h"
+#include "bmpgrep_shm.h"
+#include "bmpgrep_indexed.h"
+#include "bmpgrep_raw.h"
+#include "bmpgrep_perf.h"
+#include "bmpgrep_trace.h"
 using namespace std;
 
-// This needs to be created as a global because it potentially needs to be
-// really big.  Arrays allocated inside a function cannot be this big.
-int fast_pattern[800 * 600][5];
+// How much decoded image data --serve-stdin keeps between batches
+static const long SERVE_CACHE_BYTES = 512L * 1024 * 1024;
+
+// How much decoded image data --shm-cache keeps, across all processes
+static const long SHARED_CACHE_BYTES = 2048L * 1024 * 1024;
 
-static inline double Abs (double Nbr) {
-    if( Nbr >= 0 )
-        return Nbr;
-    else
-        return -Nbr;
+static int CpuCount() {
+    return (int) sysconf(_SC_NPROCESSORS_ONLN);
 }
 
-int main( int argc, char* argv[] ) {
+struct Query {
+    int show_stats;
+    int show_perf_counters;
+    int explain;
+    // Empty if there is no --trace
+    string trace_filename;
+    int use_shared_cache;
+    int threads;
+    vector<double> scales;
+    int top;
+    // Below 0 if there is no deadline
+    double deadline_ms;
+    SimdLevel simd_level;
+    // Whether simd_level came from --simd rather than the CPU
+    int is_simd_level_given;
+    int pattern_threshold;
+    string big_filename;
+    string small_filename;
+    MatchOptions options;
+    SearchStats stats;
+    SearchProgress progress;
+};
 
-    int optind = 1;
+/*
+Fills in the query from the command line arguments.  argv[0] is expected
+to be the first argument, not the program name.
+*/
+static bool ParseQuery( int argc, char* argv[], Query& query ) {
 
-    int return_how_many_matches = atoi(argv[ optind ]);
-    optind++;
+    int optind = 0;
+
+    query.show_stats = false;
+    query.show_perf_counters = false;
+    query.explain = false;
+    query.trace_filename.clear();
+    query.use_shared_cache = false;
+    query.threads = 0;
+    query.scales.clear();
+    query.top = 0;
+    query.deadline_ms = -1;
+    query.simd_level = DetectSimdLevel();
+    query.is_simd_level_given = false;
+    while ( optind < argc && strncmp(argv[ optind ], "--", 2) == 0 ) {
+        if ( strcmp(argv[ optind ], "--stats") == 0 ) {
+            query.show_stats = true;
+        }
+        else if ( strcmp(argv[ optind ], "--perf-counters") == 0 ) {
+            query.show_perf_counters = true;
+        }
+        else if ( strcmp(argv[ optind ], "--explain") == 0 ) {
+            query.explain = true;
+        }
+        else if ( strcmp(argv[ optind ], "--shm-cache") == 0 ) {
+            query.use_shared_cache = true;
+        }
+        else if ( strcmp(argv[ optind ], "--trace") == 0
+          && optind + 1 < argc ) {
+            optind++;
+            query.trace_filename = argv[ optind ];
+        }
+        else if ( strcmp(argv[ optind ], "--threads") == 0
+          && optind + 1 < argc ) {
+            optind++;
+            query.threads = atoi(argv[ optind ]);
+        }
+        else if ( strcmp(argv[ optind ], "--simd") == 0
+          && optind + 1 < argc ) {
+            optind++;
+            int level;
+            for ( level = SIMD_SCALAR; level <= SIMD_AVX512; level++ ) {
+                if ( strcmp(argv[ optind ], SimdLevelName((SimdLevel) level))
+                  == 0 ) {
+                    break;
+                }
+            }
+            if ( level > SIMD_AVX512 ) {
+                cerr << "Unknown --simd level " << argv[ optind ] << endl;
+                return false;
+            }
+            query.simd_level = (SimdLevel) level;
+            query.is_simd_level_given = true;
+        }
+        else if ( strcmp(argv[ optind ], "--top") == 0
+          && optind + 1 < argc ) {
+            optind++;
+            query.top = atoi(argv[ optind ]);
+            if ( query.top <= 0 ) {
+                cerr << "--top needs a count above 0" << endl;
+                return false;
+            }
+        }
+        else if ( strcmp(argv[ optind ], "--deadline-ms") == 0
+          && optind + 1 < argc ) {
+            optind++;
+            char* end;
+            query.deadline_ms = strtod(argv[ optind ], &end);
+            if ( end == argv[ optind ] || *end != '\0'
+              || query.deadline_ms < 0 ) {
+                cerr << "Bad --deadline-ms " << argv[ optind ] << endl;
+                return false;
+            }
+        }
+        else if ( strcmp(argv[ optind ], "--shard") == 0
+          && optind + 1 < argc ) {
+            optind++;
+            int shard, shard_count;
+            char extra;
+            if ( sscanf(argv[ optind ], "%d/%d%c", &shard, &shard_count,
+              &extra) != 2 || shard < 1 || shard > shard_count ) {
+                cerr << "Bad --shard " << argv[ optind ] << endl;
+                return false;
+            }
+            query.options.shard = shard - 1;
+            query.options.shard_count = shard_count;
+        }
+        else if ( strcmp(argv[ optind ], "--max-mismatch") == 0
+          && optind + 1 < argc ) {
+            optind++;
+            char* end;
+            double budget = strtod(argv[ optind ], &end);
+            if ( end == argv[ optind ] || budget < 0
+              || (*end != '\0' && strcmp(end, "%") != 0) ) {
+                cerr << "Bad --max-mismatch " << argv[ optind ] << endl;
+                return false;
+            }
+            if ( *end == '%' ) {
+                query.options.max_mismatch_percent = budget;
+            }
+            else {
+                query.options.max_mismatches = (int) budget;
+            }
+        }
+        else if ( strcmp(argv[ optind ], "--scales") == 0
+          && optind + 1 < argc ) {
+            optind++;
+            char* scale_text = argv[ optind ];
+            char* end;
+            do {
+                double scale = strtod(scale_text, &end);
+                if ( end == scale_text || scale <= 0 ) {
+                    cerr << "Bad scale list " << argv[ optind ] << endl;
+                    return false;
+                }
+                query.scales.push_back(scale);
+                scale_text = end + 1;
+            } while ( *end == ',' );
+            if ( *end != '\0' ) {
+                cerr << "Bad scale list " << argv[ optind ] << endl;
+                return false;
+            }
+        }
+        else {
+            cerr << "Unknown option " << argv[ optind ] << endl;
+            return false;
+        }
+        optind++;
+    }
 
-    int pattern_threshold = atoi(argv[ optind ]);
+    if ( query.top > 0 && !query.scales.empty() ) {
+        cerr << "--top and --scales can't be used together" << endl;
+        return false;
+    }
+    if ( query.top > 0 && query.deadline_ms >= 0 ) {
+        cerr << "--top and --deadline-ms can't be used together" << endl;
+        return false;
+    }
+    if ( query.top > 0 && query.options.shard_count > 1 ) {
+        cerr << "--top and --shard can't be used together" << endl;
+        return false;
+    }
+
+    if ( argc - optind != 7 ) {
+        cerr << "Expected 7 arguments, see the top of bmpgrep.cpp" << endl;
+        return false;
+    }
+
+    query.options.return_how_many_matches = atoi(argv[ optind ]);
     optind++;
 
-    int tolerance_r = atoi(argv[ optind ]);
+    query.pattern_threshold = atoi(argv[ optind ]);
     optind++;
 
-    int tolerance_g = atoi(argv[ optind ]);
+    query.options.tolerance_r = atoi(argv[ optind ]);
     optind++;
 
-    int tolerance_b = atoi(argv[ optind ]);
+    query.options.tolerance_g = atoi(argv[ optind ]);
     optind++;
 
-    int has_tolerances = false;
-    if (tolerance_r > 0 || tolerance_g > 0 || tolerance_b > 0) {
-        has_tolerances = true;
-    }
+    query.options.tolerance_b = atoi(argv[ optind ]);
+    optind++;
 
-    BMP Big;
-    Big.ReadFromFile(argv[ optind ]);
+    query.big_filename = argv[ optind ];
     optind++;
 
-    BMP Small;
-    Small.ReadFromFile(argv[ optind ]);
+    query.small_filename = argv[ optind ];
     optind++;
 
-    int big_x, big_y, small_x, small_y;
+    return true;
+}
 
-    int big_height = Big.TellHeight();
-    int big_width = Big.TellWidth();
-    int small_height = Small.TellHeight();
-    int small_width = Small.TellWidth();
+// The span of a range of rows is labelled with its first row alone
+static void TraceReadRange( bool Started, int FirstRow, int ) {
+    if ( Started ) {
+        TraceBegin("decode_rows", "first_row", FirstRow);
+    }
+    else {
+        TraceEnd();
+    }
+}
 
-    if ( small_height * small_width > 800 * 600 ) {
-        cout << "We can only handle small images that contain fewer than"
-          << "800 x 600 pixels" << endl;
-        return 0;
+/*
+Starts --trace, including the threads that EasyBMP decodes large files
+with.  Says why and returns false if filename can't be written.
+*/
+static bool StartTrace( const string& filename ) {
+    if ( !TraceStart(filename.c_str()) ) {
+        cerr << "Could not write " << filename << endl;
+        return false;
+    }
+    SetEasyBMPreadHook(TraceReadRange);
+    TraceThreadName("main");
+    return true;
+}
+
+// Starts the clock on the query's --deadline-ms, if it has one
+static void StartDeadline( Query& query, double start_usec ) {
+    if ( query.deadline_ms >= 0 ) {
+        query.options.deadline_usec = start_usec + query.deadline_ms * 1000;
+        query.options.progress = &query.progress;
+    }
+}
+
+/*
+EasyBMP's row decoder picks between its SSSE3 and AVX2 versions itself,
+so --simd only caps it: scalar means plain C, and sse2 the SSSE3
+version at most.
+*/
+static void UseSimdLevel( const Query& query ) {
+    SetSimdLevel(query.simd_level);
+    if ( !query.is_simd_level_given ) {
+        // Back to the best the CPU has, after an earlier query's --simd
+        SetEasyBMPsimdLevel(2);
+    }
+    else if ( query.simd_level == SIMD_SCALAR ) {
+        SetEasyBMPsimdLevel(0);
+    }
+    else if ( query.simd_level == SIMD_SSE2 ) {
+        SetEasyBMPsimdLevel(1);
+    }
+    else {
+        SetEasyBMPsimdLevel(2);
+    }
+}
+
+static void PrintMatches( const vector<Match>& matches ) {
+    for ( int index = 0; index < (int) matches.size(); index++ ) {
+        if ( index > 0 ) {
+            cout << ",";
+        }
+        cout << matches[index].x << "," << matches[index].y;
+    }
+}
+
+/*
+Prints the matches as they are found, so that a caller reading our output
+doesn't have to wait for the whole scan.
+*/
+static bool PrintMatch( const Match& match, void* user_data ) {
+    int* has_written_results = (int*) user_data;
+    if (*has_written_results == 1) {
+        cout << ",";
+    }
+    cout << match.x << "," << match.y;
+    *has_written_results = 1;
+    return true;
+}
+
+/*
+Notes how far a search that ran out of time got, after its matches.
+Returns whether anything was written.
+*/
+static bool PrintProgress( const SearchProgress& progress,
+  int has_written_results ) {
+    if ( progress.is_complete ) {
+        return false;
+    }
+    if ( has_written_results == 1 ) {
+        cout << " ";
+    }
+    cout << "incomplete:" << progress.rows_searched << "/"
+      << progress.rows_to_search;
+    return true;
+}
+
+// Ends the line of matches that PrintMatch() has been writing, if any
+static void EndResults( int has_written_results,
+  const SearchProgress& progress ) {
+    if ( PrintProgress(progress, has_written_results)
+      || has_written_results == 1 ) {
+        cout << endl;
+    }
+}
+
+static void PrintScoredMatches( const vector<ScoredMatch>& matches ) {
+    for ( int index = 0; index < (int) matches.size(); index++ ) {
+        if ( index > 0 ) {
+            cout << ",";
+        }
+        cout << matches[index].x << "," << matches[index].y << ","
+          << matches[index].score;
+    }
+}
+
+static bool AppendMatch( const Match& match, void* user_data ) {
+    vector<Match>* matches = (vector<Match>*) user_data;
+    matches->push_back(match);
+    return true;
+}
+
+/*
+One image to be decoded by LoadImage(), possibly on another thread.
+*/
+struct ImageLoad {
+    const char* filename;
+    SharedImageCache* shared_cache;
+    // The rows that a BMP file needs decoded, top row 0
+    int first_row;
+    int last_row;
+    // If set, the decode is traced as a span called phase_name, and
+    // counted in perf as a phase of that name if count_perf is set
+    const char* phase_name;
+    int count_perf;
+    PerfCounters perf;
+    BMP image;
+    SharedImage* shared;
+    RawImage raw;
+    ImageView view;
+    double read_usec;
+    bool loaded;
+
+    ImageLoad( const char* filename, SharedImageCache* shared_cache ) {
+        this->filename = filename;
+        this->shared_cache = shared_cache;
+        first_row = 0;
+        last_row = INT_MAX;
+        phase_name = NULL;
+        count_perf = false;
+        shared = NULL;
+        read_usec = 0;
+        loaded = false;
+    }
+    ~ImageLoad() {
+        delete shared;
+    }
+};
+
+static void ReadImage( ImageLoad* load ) {
+    if ( RawImage::IsRawImage(load->filename) ) {
+        double phase_start = NowMicroseconds();
+        load->loaded = load->raw.Read(load->filename);
+        load->read_usec = NowMicroseconds() - phase_start;
+        load->view = load->raw.View();
+        return;
+    }
+    if ( load->shared_cache ) {
+        load->shared = load->shared_cache->Get(load->filename, &load->read_usec);
+        load->loaded = load->shared != NULL;
+        if ( load->loaded ) {
+            load->view = load->shared->View();
+        }
+        return;
+    }
+    double phase_start = NowMicroseconds();
+    load->loaded = load->image.ReadRowsFromFile(load->filename,
+      load->first_row, load->last_row);
+    load->read_usec = NowMicroseconds() - phase_start;
+    load->view = ImageView(load->image);
+}
+
+// The counters are opened here, since they count the thread that opens them
+static void* LoadImage( void* input ) {
+    ImageLoad* load = (ImageLoad*) input;
+    if ( load->count_perf ) {
+        load->perf.Open();
+        load->perf.StartPhase();
+    }
+    double phase_start = NowMicroseconds();
+    ReadImage(load);
+    if ( load->phase_name ) {
+        TraceSpan(load->phase_name, phase_start);
+    }
+    if ( load->count_perf ) {
+        load->perf.EndPhase(load->phase_name);
+    }
+    return NULL;
+}
+
+static void* LoadSmallImage( void* input ) {
+    TraceThreadName("small_image");
+    return LoadImage(input);
+}
+
+/*
+Opens the counters of the calling thread for --perf-counters, and says so
+once if there aren't any.
+*/
+static void OpenPerfCounters( PerfCounters& perf ) {
+    static int has_warned = false;
+    if ( !perf.Open() && !has_warned ) {
+        cerr << "No performance counters: " << strerror(errno) << endl;
+        has_warned = true;
+    }
+}
+
+/*
+One scale of a --scales search.  Matches are printed as they are found,
+so the scales come out interleaved in raster order.
+*/
+struct ScaledNeedle {
+    double scale;
+    BMP image;
+    SearchStats stats;
+    SearchProgress progress;
+    int* has_written_results;
+};
+
+static bool PrintScaledMatch( const Match& match, void* user_data ) {
+    ScaledNeedle* needle = (ScaledNeedle*) user_data;
+    PrintMatch(match, needle->has_written_results);
+    cout << "," << needle->scale;
+    return true;
+}
+
+// Resamples the small image the same way EasyBMP's Rescale() always has
+static void ScaleImage( const ImageView& Small, double scale, BMP& Scaled ) {
+    Scaled.SetSize(Small.Width(), Small.Height());
+    Scaled.SetBitDepth(24);
+    for ( int x = 0; x < Small.Width(); x++ ) {
+        for ( int y = 0; y < Small.Height(); y++ ) {
+            *Scaled(x, y) = *Small.Pixel(x, y);
+        }
+    }
+    int percent = (int) (scale * 100 + 0.5);
+    if ( percent != 100 ) {
+        Rescale(Scaled, 'p', percent);
+    }
+}
+
+/*
+Ends the phase that started at phase_start, for --perf-counters and
+--trace, and starts the next one.
+*/
+static void EndPhase( PerfCounters& perf, double& phase_start,
+  const char* name ) {
+    perf.EndPhase(name);
+    TraceSpan(name, phase_start);
+    phase_start = NowMicroseconds();
+}
+
+/*
+Searches for every scale of the small image in one FindMany() pass.
+*/
+static void FindScaled( const ImageView& Big, const ImageView& Small,
+  Query& query, PerfCounters& perf, double& phase_start ) {
+
+    int scale_count = (int) query.scales.size();
+    vector<ScaledNeedle> needles(scale_count);
+    vector<Matcher*> matchers(scale_count);
+    vector<MatchJob> jobs(scale_count);
+    int has_written_results = 0;
+
+    for ( int index = 0; index < scale_count; index++ ) {
+        ScaledNeedle& needle = needles[index];
+        needle.scale = query.scales[index];
+        needle.has_written_results = &has_written_results;
+        ScaleImage(Small, needle.scale, needle.image);
+        matchers[index] = new Matcher( ImageView(needle.image),
+          query.pattern_threshold );
+
+        jobs[index].matcher = matchers[index];
+        jobs[index].options = query.options;
+        jobs[index].options.stats = query.show_stats ? &needle.stats : NULL;
+        jobs[index].options.progress = &needle.progress;
+        jobs[index].callback = PrintScaledMatch;
+        jobs[index].user_data = &needle;
+    }
+
+    EndPhase(perf, phase_start, "compile");
+    FindMany(Big, jobs);
+    EndPhase(perf, phase_start, "scan");
+
+    // Every scale stops at the same row, unless it had already finished
+    SearchProgress progress;
+    for ( int index = 0; index < scale_count; index++ ) {
+        if ( !needles[index].progress.is_complete ) {
+            progress = needles[index].progress;
+            break;
+        }
+    }
+    EndResults(has_written_results, progress);
+
+    for ( int index = 0; index < scale_count; index++ ) {
+        if ( query.show_stats ) {
+            needles[index].stats.read_big_usec = query.stats.read_big_usec;
+            needles[index].stats.read_small_usec = query.stats.read_small_usec;
+            cerr << "scale=" << needles[index].scale << endl;
+            needles[index].stats.Print(cerr);
+        }
+        delete matchers[index];
     }
+}
+
+/*
+Whether a SumTable or RangeTable of the big image could turn positions
+down for this query.  See SumTable in libbmpgrep.h.
+*/
+static bool UsesSumWindow( const Query& query, const Matcher& matcher ) {
+    return (query.options.tolerance_r > 0 || query.options.tolerance_g > 0
+      || query.options.tolerance_b > 0) && matcher.Window().width > 0
+      && AllowedMismatches(query.options, (int) matcher.Pattern().size())
+        == 0;
+}
+
+/*
+Runs every query of one batch.  Queries that share a big image and a
+--simd level are handed to FindMany() together, and the answers are
+printed in the order the queries came in.  Each image is decoded with
+its own query's --threads and --simd as that query is read.
+*/
+static void ServeBatch( const vector<string>& lines, ImageCache& cache ) {
 
-    int small_pattern_array_size = 0;
-    int last_pattern_pixel_brightness = -1;
-    for (small_y = 0; small_y < small_height; small_y++) {
-        for (small_x = 0; small_x < small_width; small_x++) {
-            RGBApixel* SmallPixel = Small(small_x, small_y);
-            int this_pixel_brightness = SmallPixel->Red
-              + SmallPixel->Green + SmallPixel->Blue;
-            if ( Abs( this_pixel_brightness - last_pattern_pixel_brightness )
-              >= pattern_threshold ) {
-                fast_pattern[small_pattern_array_size][0] = small_x;
-                fast_pattern[small_pattern_array_size][1] = small_y;
-                fast_pattern[small_pattern_array_size][2] = SmallPixel->Red;
-                fast_pattern[small_pattern_array_size][3] = SmallPixel->Green;
-                fast_pattern[small_pattern_array_size][4] = SmallPixel->Blue;
+    double batch_start = NowMicroseconds();
+    int query_count = (int) lines.size();
+    vector<Query> queries(query_count);
+    vector<int> is_valid(query_count);
+    vector<const ImageView*> bigs(query_count);
+    vector<const RunTable*> big_runs(query_count);
+    vector<const Matcher*> matchers(query_count);
+    vector< vector<Match> > results(query_count);
+    vector< vector<ScoredMatch> > scored_results(query_count);
 
-                last_pattern_pixel_brightness = this_pixel_brightness;
-                small_pattern_array_size++;
+    for ( int index = 0; index < query_count; index++ ) {
+        vector<char*> arguments;
+        vector<char> line(lines[index].begin(), lines[index].end());
+        line.push_back('\0');
+        char* token = strtok(&line[0], " \t\r");
+        while ( token != NULL ) {
+            arguments.push_back(token);
+            token = strtok(NULL, " \t\r");
+        }
+
+        Query& query = queries[index];
+        is_valid[index] = ParseQuery((int) arguments.size(),
+          arguments.empty() ? NULL : &arguments[0], query);
+        if ( !is_valid[index] ) {
+            continue;
+        }
+        if ( !query.scales.empty() ) {
+            cerr << "--scales can't be used with --serve-stdin" << endl;
+            is_valid[index] = false;
+            continue;
+        }
+        if ( query.show_perf_counters ) {
+            cerr << "--perf-counters can't be used with --serve-stdin" << endl;
+            is_valid[index] = false;
+            continue;
+        }
+        if ( query.explain ) {
+            cerr << "--explain can't be used with --serve-stdin" << endl;
+            is_valid[index] = false;
+            continue;
+        }
+        if ( !query.trace_filename.empty() ) {
+            cerr << "--trace goes before the queries, as in"
+              << " --serve-stdin --trace FILE" << endl;
+            is_valid[index] = false;
+            continue;
+        }
+        if ( query.show_stats ) {
+            query.options.stats = &query.stats;
+        }
+        StartDeadline(query, batch_start);
+        SetEasyBMPreadThreads( query.threads > 0 ? query.threads : CpuCount() );
+        UseSimdLevel(query);
+
+        double load_start = NowMicroseconds();
+        bigs[index] = cache.GetImage(query.big_filename.c_str(),
+          &query.stats.read_big_usec, &big_runs[index]);
+        TraceSpan("read_big", load_start);
+        if ( query.top > 0 ) {
+            // Compares whole images, so it has no use for FindMany()
+            const ImageView* Small = cache.GetImage(
+              query.small_filename.c_str(), &query.stats.read_small_usec);
+            if ( bigs[index] == NULL || Small == NULL ) {
+                cerr << "Could not read " << query.big_filename << " or "
+                  << query.small_filename << endl;
+            }
+            else {
+                BestMatcher best_matcher( *Small );
+                scored_results[index] = best_matcher.Find(*bigs[index],
+                  query.top, query.options.stats);
             }
+            is_valid[index] = false;
+            continue;
+        }
+        load_start = NowMicroseconds();
+        matchers[index] = cache.GetMatcher(query.small_filename.c_str(),
+          query.pattern_threshold, &query.stats.read_small_usec);
+        TraceSpan("read_small", load_start);
+        if ( bigs[index] == NULL || matchers[index] == NULL ) {
+            cerr << "Could not read " << query.big_filename << " or "
+              << query.small_filename << endl;
+            is_valid[index] = false;
+        }
+        else if ( UsesSumWindow(query, *matchers[index]) ) {
+            const SumWindow& window = matchers[index]->Window();
+            double phase_start = NowMicroseconds();
+            query.options.sums = cache.GetSums(query.big_filename.c_str());
+            query.stats.sum_table_usec = NowMicroseconds() - phase_start;
+            TraceSpan("sum_table", phase_start);
+            phase_start = NowMicroseconds();
+            query.options.ranges = cache.GetRanges(query.big_filename.c_str(),
+              window.width, window.height);
+            query.stats.range_table_usec = NowMicroseconds() - phase_start;
+            TraceSpan("range_table", phase_start);
         }
     }
- 
-    //#define DEBUG_THE_FAST_PATTERN
-    #ifdef DEBUG_THE_FAST_PATTERN
-    for ( int pattern_index = 0; pattern_index < 5; pattern_index++ ) {
-        for ( int part = 0; part < 5; part++ ) {
-            cout << fast_pattern[pattern_index][part] << endl;
+
+    vector<int> is_searched(query_count);
+    for ( int first = 0; first < query_count; first++ ) {
+        if ( !is_valid[first] || is_searched[first] ) {
+            continue;
+        }
+        vector<MatchJob> jobs;
+        for ( int index = first; index < query_count; index++ ) {
+            if ( !is_valid[index] || bigs[index] != bigs[first]
+              || queries[index].simd_level != queries[first].simd_level ) {
+                continue;
+            }
+            MatchJob job;
+            job.matcher = matchers[index];
+            job.options = queries[index].options;
+            job.callback = AppendMatch;
+            job.user_data = &results[index];
+            jobs.push_back(job);
+            is_searched[index] = true;
+        }
+
+        /*
+        A big image that is mostly flat is quicker to search a run at a
+        time, once per query, than a pixel at a time in one shared pass.
+        */
+        // By now, the last query's --simd is in force
+        SetSimdLevel(queries[first].simd_level);
+        double scan_start = NowMicroseconds();
+        if ( big_runs[first] ) {
+            for ( int job = 0; job < (int) jobs.size(); job++ ) {
+                jobs[job].options.runs = big_runs[first];
+                jobs[job].matcher->Find(*bigs[first], jobs[job].options,
+                  jobs[job].callback, jobs[job].user_data);
+            }
+        }
+        else {
+            FindMany(*bigs[first], jobs);
         }
+        TraceSpan("scan", scan_start, "queries", (long) jobs.size());
+    }
+
+    for ( int index = 0; index < query_count; index++ ) {
+        PrintMatches(results[index]);
+        PrintScoredMatches(scored_results[index]);
+        PrintProgress(queries[index].progress, !results[index].empty());
         cout << endl;
+        if ( (is_valid[index] || queries[index].top > 0)
+          && queries[index].show_stats ) {
+            queries[index].stats.Print(cerr);
+        }
     }
-    cout << small_pattern_array_size << endl;
+    TraceSpan("batch", batch_start, "queries", query_count);
+}
+
+/*
+Lines that are already waiting on stdin when we get around to reading it
+arrived "together", and are run as one batch.
+*/
+static int ServeStdin( int use_shared_cache ) {
+
+    // EasyBMP writes its warnings to stdout, which is where our answers go
+    SetEasyBMPwarningsOff();
+
+    SharedImageCache shared_cache( SHARED_CACHE_BYTES );
+    ImageCache cache( SERVE_CACHE_BYTES,
+      use_shared_cache ? &shared_cache : NULL );
+    string pending;
+    char buffer[65536];
+    int at_end_of_file = false;
+
+    while ( !at_end_of_file ) {
+        struct pollfd input;
+        input.fd = 0;
+        input.events = POLLIN;
+        do {
+            ssize_t bytes_read = read(0, buffer, sizeof(buffer));
+            if ( bytes_read <= 0 ) {
+                at_end_of_file = true;
+                break;
+            }
+            pending.append(buffer, bytes_read);
+        } while ( poll(&input, 1, 0) > 0 );
+
+        if ( at_end_of_file && !pending.empty()
+          && pending[pending.size() - 1] != '\n' ) {
+            pending += '\n';
+        }
+
+        vector<string> lines;
+        size_t line_start = 0;
+        size_t line_end;
+        while ( (line_end = pending.find('\n', line_start)) != string::npos ) {
+            lines.push_back(pending.substr(line_start, line_end - line_start));
+            line_start = line_end + 1;
+        }
+        pending.erase(0, line_start);
+
+        if ( !lines.empty() ) {
+            ServeBatch(lines, cache);
+            cout.flush();
+            cache.Trim();
+        }
+    }
+
     return 0;
-    #endif
+}
 
-    /*
-    You don't need to check the whole big image.
-    For example, if the small image is 100 pixels wide, then you
-    know that there's no way it could match in the 99 right-most
-    pixels of the big image.  The same idea is applicable for the height.
-    */
+// In the order the phases start
+static void PrintPerfCounters( const ImageLoad& BigLoad,
+  const ImageLoad& SmallLoad, const PerfCounters& perf ) {
+    BigLoad.perf.Print(cerr);
+    SmallLoad.perf.Print(cerr);
+    perf.Print(cerr);
+}
 
-    int max_y_to_check = big_height - small_height;
-    int max_x_to_check = big_width - small_width;
+int main( int argc, char* argv[] ) {
 
-    int has_written_results = 0;
-    int has_matched_x_times = 0;
+    double start_usec = NowMicroseconds();
+    SetEasyBMPreadThreads( CpuCount() );
+
+    if ( argc >= 2 && strcmp(argv[1], "--serve-stdin") == 0 ) {
+        int use_shared_cache = false;
+        for ( int index = 2; index < argc; index++ ) {
+            if ( strcmp(argv[index], "--shm-cache") == 0 ) {
+                use_shared_cache = true;
+            }
+            else if ( strcmp(argv[index], "--trace") == 0
+              && index + 1 < argc ) {
+                index++;
+                if ( !StartTrace(argv[index]) ) {
+                    return 1;
+                }
+            }
+            else {
+                cerr << "--serve-stdin only takes --shm-cache and --trace"
+                  << endl;
+                return 1;
+            }
+        }
+        return ServeStdin(use_shared_cache);
+    }
+
+    Query query;
+    if ( !ParseQuery(argc - 1, argv + 1, query) ) {
+        return 1;
+    }
+    if ( !query.trace_filename.empty() && !StartTrace(query.trace_filename) ) {
+        return 1;
+    }
+    if ( query.threads > 0 ) {
+        SetEasyBMPreadThreads(query.threads);
+    }
+    UseSimdLevel(query);
+    if ( query.show_stats ) {
+        query.options.stats = &query.stats;
+    }
+    StartDeadline(query, start_usec);
+    if ( RawImage::ReadsStdin(query.big_filename.c_str())
+      && RawImage::ReadsStdin(query.small_filename.c_str()) ) {
+        cerr << "Only one of the images can come from stdin" << endl;
+        return 1;
+    }
 
     /*
-    This is declared here instead of inside the inner "pattern" for loop
-    because we use it after the for loop is completed to check if there
-    was a perfect match
+    Palettized images are cheaper to search by index, and 1-bit ones
+    cheaper still as packed bits.  The small image is read first because
+    it is quick to read, and if it isn't palettized there is no point in
+    looking at the big one.
     */
-    int small_pattern_index = 0;
-
-    for (big_y = 0; big_y < max_y_to_check; ++big_y) {
-        for (big_x = 0; big_x < max_x_to_check; ++big_x) {
-
-            for ( small_pattern_index = 0;
-                small_pattern_index < small_pattern_array_size;
-                small_pattern_index++ ) {
-
-                RGBApixel* BigPixel = Big(big_x + fast_pattern[small_pattern_index][0],
-                               big_y + fast_pattern[small_pattern_index][1]);
-
-                /*
-                Do these as preprocessor macros for two reasons.
-                The first is that they're used in two places, and
-                the code looks a lot cleaner.
-                The second is that it's better than writing them
-                to variables, since they may not all three be used
-                in each comparison, and variables are overkill anyhow.
-                */
-                #define SMALL_RED fast_pattern[small_pattern_index][2]
-                #define SMALL_GREEN fast_pattern[small_pattern_index][3]
-                #define SMALL_BLUE fast_pattern[small_pattern_index][4]
-
-                if ( has_tolerances == false ) {
-                    // zero tolerance, so do it faster
-                    if ( BigPixel->Red != SMALL_RED ) {
-                        break;
-                    }
-                    else if ( BigPixel->Green != SMALL_GREEN ) {
-                        break;
-                    }
-                    else if ( BigPixel->Blue != SMALL_BLUE ) {
-                        break;
-                    }
+    if ( !query.use_shared_cache && query.scales.empty() && query.top == 0 ) {
+        // Closed before the small image's thread starts, which would count
+        PerfCounters perf;
+        if ( query.show_perf_counters ) {
+            OpenPerfCounters(perf);
+        }
+
+        double phase_start = NowMicroseconds();
+        perf.StartPhase();
+        BitImage BitSmall;
+        if ( BitSmall.ReadFromFile(query.small_filename.c_str()) ) {
+            query.stats.read_small_usec = NowMicroseconds() - phase_start;
+            EndPhase(perf, phase_start, "read_small");
+            BitImage BitBig;
+            if ( BitBig.ReadFromFile(query.big_filename.c_str()) ) {
+                query.stats.read_big_usec = NowMicroseconds() - phase_start;
+                EndPhase(perf, phase_start, "read_big");
+
+                BitMatcher matcher( BitSmall, query.pattern_threshold );
+                EndPhase(perf, phase_start, "compile");
+                if ( query.explain ) {
+                    cerr << "engine=bits" << endl;
+                }
+                int has_written_results = 0;
+                matcher.Find( BitBig, query.options, PrintMatch,
+                  &has_written_results );
+                EndPhase(perf, phase_start, "scan");
+                EndResults(has_written_results, query.progress);
+                if ( query.show_stats ) {
+                    query.stats.Print(cerr);
                 }
-                else {
-                    if ( Abs(BigPixel->Red - SMALL_RED )
-                        > tolerance_r ) {
-                        break;
-                    }
-                    else if ( Abs(BigPixel->Green - SMALL_GREEN )
-                        > tolerance_g ) {
-                        break;
-                    }
-                    else if ( Abs(BigPixel->Blue - SMALL_BLUE )
-                        > tolerance_b ) {
-                        break;
-                    }
+                if ( query.show_perf_counters ) {
+                    perf.Print(cerr);
                 }
+                return 0;
             }
+        }
 
-            // There was a complete match!  Note that this check
-            // is done after the for loop, not inside it.  Checking
-            // outside the loop is a bit faster.
-            if (small_pattern_index == small_pattern_array_size) {
-              if (has_written_results == 1) {
-                cout << ",";
-              }
-              cout << big_x << "," << big_y;
-              has_matched_x_times++;
+        phase_start = NowMicroseconds();
+        perf.StartPhase();
+        IndexedImage IndexedSmall;
+        if ( IndexedSmall.ReadFromFile(query.small_filename.c_str()) ) {
+            query.stats.read_small_usec = NowMicroseconds() - phase_start;
+            EndPhase(perf, phase_start, "read_small");
+            IndexedImage IndexedBig;
+            if ( IndexedBig.ReadFromFile(query.big_filename.c_str()) ) {
+                query.stats.read_big_usec = NowMicroseconds() - phase_start;
+                EndPhase(perf, phase_start, "read_big");
 
-              if (has_matched_x_times == return_how_many_matches) {
-                  cout << endl;
-                  return 0;
-              }
+                IndexedMatcher matcher( IndexedSmall, query.pattern_threshold );
+                EndPhase(perf, phase_start, "compile");
+                if ( query.explain ) {
+                    cerr << "engine=indexed" << endl;
+                }
+                int has_written_results = 0;
+                matcher.Find( IndexedBig, query.options, PrintMatch,
+                  &has_written_results );
+                EndPhase(perf, phase_start, "scan");
+                EndResults(has_written_results, query.progress);
+                if ( query.show_stats ) {
+                    query.stats.Print(cerr);
+                }
+                if ( query.show_perf_counters ) {
+                    perf.Print(cerr);
+                }
+                return 0;
+            }
+        }
+
+        // An RLE big image is searched run by run, whatever the small one is
+        phase_start = NowMicroseconds();
+        perf.StartPhase();
+        RunImage RunBig;
+        if ( RunBig.ReadFromFile(query.big_filename.c_str()) ) {
+            query.stats.read_big_usec = NowMicroseconds() - phase_start;
+            EndPhase(perf, phase_start, "read_big");
+            ImageLoad SmallLoad( query.small_filename.c_str(), NULL );
+            LoadImage(&SmallLoad);
+            query.stats.read_small_usec = SmallLoad.read_usec;
+            EndPhase(perf, phase_start, "read_small");
+            if ( !SmallLoad.loaded ) {
+                cerr << "Could not read " << query.small_filename << endl;
+                return 0;
+            }
 
-              has_written_results = 1;
+            RunMatcher matcher( SmallLoad.view, query.pattern_threshold );
+            EndPhase(perf, phase_start, "compile");
+            if ( query.explain ) {
+                cerr << "engine=rle" << endl;
             }
+            int has_written_results = 0;
+            matcher.Find( RunBig, query.options, PrintMatch,
+              &has_written_results );
+            EndPhase(perf, phase_start, "scan");
+            EndResults(has_written_results, query.progress);
+            if ( query.show_stats ) {
+                query.stats.Print(cerr);
+            }
+            if ( query.show_perf_counters ) {
+                perf.Print(cerr);
+            }
+            return 0;
+        }
+    }
+
+    // The small image is decoded on its own thread while the big one loads
+    SharedImageCache shared_cache( SHARED_CACHE_BYTES );
+    ImageLoad BigLoad( query.big_filename.c_str(),
+      query.use_shared_cache ? &shared_cache : NULL );
+    ImageLoad SmallLoad( query.small_filename.c_str(),
+      query.use_shared_cache ? &shared_cache : NULL );
+    BigLoad.phase_name = "read_big";
+    BigLoad.count_perf = query.show_perf_counters;
+    SmallLoad.phase_name = "read_small";
+    SmallLoad.count_perf = query.show_perf_counters;
+
+    /*
+    A shard only needs the rows of the big image under its strip of
+    positions, which depends on how tall the small image is, so that is
+    read first.
+    */
+    int small_thread_started = false;
+    pthread_t small_thread;
+    if ( query.options.shard_count > 1 && !query.use_shared_cache
+      && query.scales.empty()
+      && !RawImage::IsRawImage(query.big_filename.c_str()) ) {
+        LoadImage(&SmallLoad);
+        if ( SmallLoad.loaded ) {
+            int big_height = (int) GetBMIH(query.big_filename.c_str()).biHeight;
+            int end_row;
+            ShardRows(big_height - SmallLoad.view.Height(), query.options.shard,
+              query.options.shard_count, BigLoad.first_row, end_row);
+            BigLoad.last_row = end_row + SmallLoad.view.Height() - 2;
+        }
+    }
+    else {
+        small_thread_started = pthread_create(&small_thread, NULL,
+          LoadSmallImage, &SmallLoad) == 0;
+        if ( !small_thread_started ) {
+            LoadImage(&SmallLoad);
+        }
+    }
+    LoadImage(&BigLoad);
+    if ( small_thread_started ) {
+        pthread_join(small_thread, NULL);
+    }
+    query.stats.read_big_usec = BigLoad.read_usec;
+    query.stats.read_small_usec = SmallLoad.read_usec;
+
+    if ( !BigLoad.loaded || !SmallLoad.loaded ) {
+        cerr << "Could not read " << query.big_filename << " or "
+          << query.small_filename << endl;
+        return 0;
+    }
+    const ImageView* Big = &BigLoad.view;
+
+    // Every other thread is done by now
+    PerfCounters perf;
+    if ( query.show_perf_counters ) {
+        OpenPerfCounters(perf);
+    }
+    double phase_start = NowMicroseconds();
+    perf.StartPhase();
+
+    if ( !query.scales.empty() ) {
+        if ( query.explain ) {
+            cerr << "engine=scales" << endl;
         }
+        FindScaled(*Big, SmallLoad.view, query, perf, phase_start);
+        if ( query.show_perf_counters ) {
+            PrintPerfCounters(BigLoad, SmallLoad, perf);
+        }
+        return 0;
     }
 
+    if ( query.top > 0 ) {
+        BestMatcher best_matcher( SmallLoad.view );
+        EndPhase(perf, phase_start, "compile");
+        if ( query.explain ) {
+            cerr << "engine=top" << endl;
+        }
+        vector<ScoredMatch> best = best_matcher.Find(*Big, query.top,
+          query.options.stats);
+        EndPhase(perf, phase_start, "scan");
+        PrintScoredMatches(best);
+        cout << endl;
+        if ( query.show_stats ) {
+            query.stats.Print(cerr);
+        }
+        if ( query.show_perf_counters ) {
+            PrintPerfCounters(BigLoad, SmallLoad, perf);
+        }
+        return 0;
+    }
 
-    if (has_written_results == 1) {
+    Matcher matcher( SmallLoad.view, query.pattern_threshold );
+    EndPhase(perf, phase_start, "compile");
+
+    // Built here, if the planner wants them, so they outlive the scan
+    double choose_start = NowMicroseconds();
+    EngineChoice choice = ChooseEngine(matcher, *Big, query.options);
+    query.stats.choose_engine_usec = NowMicroseconds() - choose_start;
+    RunTable big_runs;
+    SumTable big_sums;
+    RangeTable big_ranges;
+    if ( choice.engine == ENGINE_RUNS ) {
+        big_runs = RunTable(*Big, 0);
+        query.options.runs = &big_runs;
+    }
+    else if ( choice.engine == ENGINE_SCREENED ) {
+        double table_start = NowMicroseconds();
+        big_sums = SumTable(*Big);
+        query.stats.sum_table_usec = NowMicroseconds() - table_start;
+        table_start = NowMicroseconds();
+        big_ranges = RangeTable(*Big, matcher.Window().width,
+          matcher.Window().height);
+        query.stats.range_table_usec = NowMicroseconds() - table_start;
+        query.options.sums = &big_sums;
+        query.options.ranges = &big_ranges;
+    }
+    EndPhase(perf, phase_start, "choose_engine");
+    if ( query.explain ) {
+        choice.Print(cerr);
+    }
+
+    //#define DEBUG_THE_FAST_PATTERN
+    #ifdef DEBUG_THE_FAST_PATTERN
+    for ( int pattern_index = 0; pattern_index < 5
+      && pattern_index < (int) matcher.Pattern().size(); pattern_index++ ) {
+        const PatternPixel& pixel = matcher.Pattern()[pattern_index];
+        cout << pixel.x << endl << pixel.y << endl << pixel.red << endl
+          << pixel.green << endl << pixel.blue << endl;
         cout << endl;
     }
+    cout << matcher.Pattern().size() << endl;
+    return 0;
+    #endif
+
+    int has_written_results = 0;
+    matcher.Find( *Big, query.options, PrintMatch,
+      &has_written_results );
+    EndPhase(perf, phase_start, "scan");
+
+    EndResults(has_written_results, query.progress);
+
+    if ( query.show_stats ) {
+        query.stats.Print(cerr);
+    }
+    if ( query.show_perf_counters ) {
+        PrintPerfCounters(BigLoad, SmallLoad, perf);
+    }
 
     return 0;
 
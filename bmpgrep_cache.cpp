@@ -0,0 +1,261 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_cache
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: See bmpgrep_cache.h
+
+******************************************************************************
+*****************************************************************************/
+
+#include <string.h>
+#include <sys/stat.h>
+#include "bmpgrep_cache.h"
+using namespace std;
+
+/*
+A RunTable is only worth building for an image with at least this many
+pixels per run, on average.  Below that, checking each position costs
+about the same as checking each run.
+*/
+static const long MIN_PIXELS_PER_RUN = 16;
+
+ImageCache::ImageCache( long max_bytes, SharedImageCache* shared_cache ) {
+    this->max_bytes = max_bytes;
+    this->shared_cache = shared_cache;
+    total_bytes = 0;
+    use_counter = 0;
+    hits = 0;
+    misses = 0;
+}
+
+ImageCache::~ImageCache() {
+    while ( !entries.empty() ) {
+        Evict(entries.begin());
+    }
+    Trim();
+}
+
+ImageCache::Entry* ImageCache::Lookup( const char* FileName,
+  double* read_usec ) {
+
+    if ( read_usec ) {
+        *read_usec = 0;
+    }
+
+    // stdin is where the queries come from
+    if ( RawImage::ReadsStdin(FileName) ) {
+        cerr << "Images can't be read from stdin here" << endl;
+        return NULL;
+    }
+
+    struct stat file_info;
+    int is_description = RawImage::IsDescription(FileName);
+    if ( is_description ) {
+        memset(&file_info, 0, sizeof(file_info));
+    }
+    else if ( stat(FileName, &file_info) != 0 ) {
+        return NULL;
+    }
+
+    map<string, Entry*>::iterator found = entries.find(FileName);
+    if ( found != entries.end() ) {
+        Entry* entry = found->second;
+        if ( !is_description && entry->modified == file_info.st_mtime
+          && entry->file_size == file_info.st_size ) {
+            entry->last_used = ++use_counter;
+            hits++;
+            return entry;
+        }
+        /*
+        The file changed underneath us, so start over.  The old entry may
+        still be in use by an earlier query in this batch, so it is only
+        freed by the next Trim().
+        */
+        Evict(found);
+    }
+
+    misses++;
+    Entry* entry = new Entry;
+    entry->image = NULL;
+    entry->shared = NULL;
+    entry->raw = NULL;
+    entry->runs = NULL;
+    entry->runs_checked = false;
+    entry->sums = NULL;
+    if ( is_description || RawImage::IsRawImage(FileName) ) {
+        double phase_start = NowMicroseconds();
+        entry->raw = new RawImage;
+        if ( !entry->raw->Read(FileName) ) {
+            delete entry->raw;
+            delete entry;
+            return NULL;
+        }
+        if ( read_usec ) {
+            *read_usec = NowMicroseconds() - phase_start;
+        }
+        entry->view = entry->raw->View();
+    }
+    else if ( shared_cache ) {
+        entry->shared = shared_cache->Get(FileName, read_usec);
+        if ( entry->shared == NULL ) {
+            delete entry;
+            return NULL;
+        }
+        entry->view = entry->shared->View();
+    }
+    else {
+        double phase_start = NowMicroseconds();
+        entry->image = new BMP;
+        // Evicted images hand their pixel blocks on to the next ones
+        entry->image->SetPixelArena(&arena);
+        if ( !entry->image->ReadFromFile(FileName) ) {
+            delete entry->image;
+            delete entry;
+            return NULL;
+        }
+        if ( read_usec ) {
+            *read_usec = NowMicroseconds() - phase_start;
+        }
+        entry->view = ImageView(*entry->image);
+    }
+
+    entry->modified = file_info.st_mtime;
+    entry->file_size = file_info.st_size;
+    entry->bytes = (long) entry->view.Width() * entry->view.Height()
+      * sizeof(RGBApixel);
+    entry->last_used = ++use_counter;
+    entries[FileName] = entry;
+    total_bytes += entry->bytes;
+    return entry;
+}
+
+const ImageView* ImageCache::GetImage( const char* FileName,
+  double* read_usec, const RunTable** runs ) {
+    Entry* entry = Lookup(FileName, read_usec);
+    if ( entry == NULL ) {
+        return NULL;
+    }
+    if ( runs ) {
+        if ( !entry->runs_checked && entry->raw == NULL ) {
+            long pixels = (long) entry->view.Width() * entry->view.Height();
+            if ( RunTable::CountRuns(entry->view, 0) * MIN_PIXELS_PER_RUN
+              <= pixels ) {
+                entry->runs = new RunTable(entry->view, 0);
+            }
+        }
+        entry->runs_checked = true;
+        *runs = entry->runs;
+    }
+    return &entry->view;
+}
+
+const SumTable* ImageCache::GetSums( const char* FileName ) {
+    // Looking one of those up again would read it again
+    if ( RawImage::IsDescription(FileName) ) {
+        return NULL;
+    }
+    Entry* entry = Lookup(FileName, NULL);
+    if ( entry == NULL ) {
+        return NULL;
+    }
+    if ( entry->sums == NULL ) {
+        entry->sums = new SumTable(entry->view);
+        // Three sums of four bytes for every pixel
+        long bytes = (long) (entry->view.Width() + 1)
+          * (entry->view.Height() + 1) * 12;
+        entry->bytes += bytes;
+        total_bytes += bytes;
+    }
+    return entry->sums;
+}
+
+const RangeTable* ImageCache::GetRanges( const char* FileName,
+  int window_width, int window_height ) {
+    if ( RawImage::IsDescription(FileName) ) {
+        return NULL;
+    }
+    Entry* entry = Lookup(FileName, NULL);
+    if ( entry == NULL ) {
+        return NULL;
+    }
+    pair<int, int> size(window_width, window_height);
+    map< pair<int, int>, RangeTable* >::iterator found
+      = entry->ranges.find(size);
+    if ( found != entry->ranges.end() ) {
+        return found->second;
+    }
+    RangeTable* ranges = new RangeTable(entry->view, window_width,
+      window_height);
+    entry->ranges[size] = ranges;
+    // A low and a high pixel for every position
+    long bytes = (long) max(entry->view.Width() - window_width + 1, 0)
+      * max(entry->view.Height() - window_height + 1, 0) * 8;
+    entry->bytes += bytes;
+    total_bytes += bytes;
+    return ranges;
+}
+
+const Matcher* ImageCache::GetMatcher( const char* FileName,
+  int pattern_threshold, double* read_usec ) {
+    Entry* entry = Lookup(FileName, read_usec);
+    if ( entry == NULL ) {
+        return NULL;
+    }
+    map<int, Matcher*>::iterator found = entry->matchers.find(pattern_threshold);
+    if ( found != entry->matchers.end() ) {
+        return found->second;
+    }
+    Matcher* matcher = new Matcher(entry->view, pattern_threshold);
+    entry->matchers[pattern_threshold] = matcher;
+    return matcher;
+}
+
+void ImageCache::Evict( map<string, Entry*>::iterator position ) {
+    total_bytes -= position->second->bytes;
+    retired.push_back(position->second);
+    entries.erase(position);
+}
+
+void ImageCache::Release( Entry* entry ) {
+    map<int, Matcher*>::iterator matcher;
+    for ( matcher = entry->matchers.begin(); matcher != entry->matchers.end();
+      ++matcher ) {
+        delete matcher->second;
+    }
+    delete entry->image;
+    delete entry->shared;
+    delete entry->raw;
+    delete entry->runs;
+    delete entry->sums;
+    map< pair<int, int>, RangeTable* >::iterator ranges;
+    for ( ranges = entry->ranges.begin(); ranges != entry->ranges.end();
+      ++ranges ) {
+        delete ranges->second;
+    }
+    delete entry;
+}
+
+void ImageCache::Trim() {
+    while ( total_bytes > max_bytes && !entries.empty() ) {
+        map<string, Entry*>::iterator oldest = entries.begin();
+        map<string, Entry*>::iterator position;
+        for ( position = entries.begin(); position != entries.end();
+          ++position ) {
+            if ( position->second->last_used < oldest->second->last_used ) {
+                oldest = position;
+            }
+        }
+        Evict(oldest);
+    }
+    for ( int index = 0; index < (int) retired.size(); index++ ) {
+        Release(retired[index]);
+    }
+    retired.clear();
+}
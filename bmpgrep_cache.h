@@ -0,0 +1,115 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_cache
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: Keeps decoded images and compiled patterns around between
+searches, so that a long running process (like bmpgrep --serve-stdin)
+only decodes each file once.
+
+Entries are keyed by file name and are re-read if the file's size or
+modification time changes.  raw: and ppm: images (see bmpgrep_raw.h) are
+re-read every time, since a framebuffer changes without telling anyone.
+Nothing is evicted while it might still be in use: Get*() only ever adds
+to the cache, and the caller decides when it is safe to drop old entries
+by calling Trim().
+
+******************************************************************************
+*****************************************************************************/
+
+#ifndef _bmpgrep_cache_h_
+#define _bmpgrep_cache_h_
+
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include "libbmpgrep.h"
+#include "bmpgrep_shm.h"
+#include "bmpgrep_raw.h"
+
+class ImageCache {
+  public:
+    /*
+    Trim() evicts the least recently used images above this many bytes.
+    If shared_cache is given, images we don't have yet are taken from (or
+    published to) it, instead of being decoded privately.
+    */
+    explicit ImageCache( long max_bytes, SharedImageCache* shared_cache = NULL );
+    ~ImageCache();
+
+    /*
+    Returns NULL if the file can't be read.  read_usec, if given, is set
+    to the time spent decoding, which is 0 for a cache hit.  The view
+    stays valid until the next call to Trim().
+
+    If runs is given, it is set to a RunTable of the image, which is built
+    the first time it is asked for, or to NULL if the image is too busy
+    for one to help.  raw: and ppm: images never get one, since they are
+    read afresh every time.
+    */
+    const ImageView* GetImage( const char* FileName, double* read_usec,
+      const RunTable** runs = NULL );
+
+    /*
+    A SumTable of the image, built the first time it is asked for, and
+    counted towards max_bytes along with it.  NULL if the file can't be
+    read, and for raw: and ppm: images, which are read afresh every time.
+    Like the view, it stays valid until the next call to Trim().
+    */
+    const SumTable* GetSums( const char* FileName );
+
+    // Same idea, for a RangeTable with the given size of window
+    const RangeTable* GetRanges( const char* FileName, int window_width,
+      int window_height );
+
+    // Same idea, for the compiled pattern of a small image
+    const Matcher* GetMatcher( const char* FileName, int pattern_threshold,
+      double* read_usec );
+
+    void Trim();
+
+    long Hits() const { return hits; }
+    long Misses() const { return misses; }
+
+  private:
+    struct Entry {
+        // One of these
+        BMP* image;
+        SharedImage* shared;
+        RawImage* raw;
+        ImageView view;
+        std::map<int, Matcher*> matchers;
+        RunTable* runs;
+        bool runs_checked;
+        SumTable* sums;
+        std::map< std::pair<int, int>, RangeTable* > ranges;
+        time_t modified;
+        off_t file_size;
+        long bytes;
+        unsigned long last_used;
+    };
+
+    Entry* Lookup( const char* FileName, double* read_usec );
+    void Evict( std::map<std::string, Entry*>::iterator position );
+    void Release( Entry* entry );
+
+    // Declared first, so that it outlives the images that use it
+    EasyBMPpixelArena arena;
+
+    std::map<std::string, Entry*> entries;
+    std::vector<Entry*> retired;
+    SharedImageCache* shared_cache;
+    long max_bytes;
+    long total_bytes;
+    unsigned long use_counter;
+    long hits;
+    long misses;
+};
+
+#endif
@@ -0,0 +1,866 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_indexed
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: See bmpgrep_indexed.h
+
+******************************************************************************
+*****************************************************************************/
+
+#include "bmpgrep_indexed.h"
+using namespace std;
+
+static inline int Abs( int Nbr ) {
+    if( Nbr >= 0 )
+        return Nbr;
+    else
+        return -Nbr;
+}
+
+IndexedImage::IndexedImage() {
+    width = 0;
+    height = 0;
+}
+
+/*
+Reads the headers and color table of a 1, 4 or 8-bit BMP, and leaves fp
+at the first (bottom) row.  Returns the bit depth, or 0 if the file is
+anything else.  compression is 0 for uncompressed rows, and 1 or 2 for
+RLE8 or RLE4.
+*/
+static int ReadPalettizedHeader( FILE* fp, int& width, int& height,
+  vector<RGBApixel>& colors, int& compression ) {
+
+    // Same header reading as BMP::ReadFromFile, minus the warnings
+
+    BMFH bmfh;
+    BMIH bmih;
+    bool NotCorrupted = true;
+    NotCorrupted &= SafeFread( (char*) &(bmfh.bfType) , sizeof(ebmpWORD), 1, fp);
+    NotCorrupted &= SafeFread( (char*) &(bmfh.bfSize) , sizeof(ebmpDWORD) , 1, fp);
+    NotCorrupted &= SafeFread( (char*) &(bmfh.bfReserved1) , sizeof(ebmpWORD) , 1, fp);
+    NotCorrupted &= SafeFread( (char*) &(bmfh.bfReserved2) , sizeof(ebmpWORD) , 1, fp);
+    NotCorrupted &= SafeFread( (char*) &(bmfh.bfOffBits) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biSize) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biWidth) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biHeight) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biPlanes) , sizeof(ebmpWORD) , 1, fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biBitCount) , sizeof(ebmpWORD) , 1, fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biCompression) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biSizeImage) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biXPelsPerMeter) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biYPelsPerMeter) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biClrUsed) , sizeof(ebmpDWORD) , 1 , fp);
+    NotCorrupted &= SafeFread( (char*) &(bmih.biClrImportant) , sizeof(ebmpDWORD) , 1 , fp);
+
+    if ( IsBigEndian() ) {
+        bmfh.SwitchEndianess();
+        bmih.SwitchEndianess();
+    }
+
+    int bit_depth = (int) bmih.biBitCount;
+    compression = (int) bmih.biCompression;
+    if ( !NotCorrupted || bmfh.bfType != 19778
+      || (compression == 0 && bit_depth != 1 && bit_depth != 4
+        && bit_depth != 8)
+      || (compression == 1 && bit_depth != 8)
+      || (compression == 2 && bit_depth != 4) || compression > 2
+      || (int) bmih.biWidth <= 0 || (int) bmih.biHeight <= 0 ) {
+        return 0;
+    }
+
+    width = (int) bmih.biWidth;
+    height = (int) bmih.biHeight;
+
+    // Like EasyBMP, pad an underspecified color table with white
+
+    int number_of_colors = 1 << bit_depth;
+    int colors_to_read = ((int) bmfh.bfOffBits - 54) / 4;
+    if ( colors_to_read > number_of_colors ) {
+        colors_to_read = number_of_colors;
+    }
+    RGBApixel white;
+    white.Red = 255;
+    white.Green = 255;
+    white.Blue = 255;
+    white.Alpha = 0;
+    colors.assign(number_of_colors, white);
+    fseek(fp, 14 + bmih.biSize, SEEK_SET);
+    for ( int n = 0; n < colors_to_read; n++ ) {
+        SafeFread( (char*) &(colors[n]), 4, 1, fp );
+    }
+
+    fseek(fp, bmfh.bfOffBits, SEEK_SET);
+    return bit_depth;
+}
+
+bool IndexedImage::ReadFromFile( const char* FileName ) {
+
+    FILE* fp = fopen( FileName, "rb" );
+    if ( fp == NULL ) {
+        return false;
+    }
+
+    int compression;
+    int bit_depth = ReadPalettizedHeader(fp, width, height, colors,
+      compression);
+    if ( bit_depth == 0 || compression != 0 ) {
+        fclose(fp);
+        return false;
+    }
+
+    int bytes_per_row = (width * bit_depth + 31) / 32 * 4;
+    vector<ebmpBYTE> buffer(bytes_per_row);
+    indices.resize((long) width * height);
+
+    int pixels_per_byte = 8 / bit_depth;
+    int mask = (1 << bit_depth) - 1;
+
+    // Rows are stored bottom up
+    for ( int y = height - 1; y >= 0; y-- ) {
+        if ( !SafeFread( (char*) &buffer[0], bytes_per_row, 1, fp ) ) {
+            fclose(fp);
+            return false;
+        }
+        ebmpBYTE* row = &indices[(long) y * width];
+        if ( bit_depth == 8 ) {
+            memcpy(row, &buffer[0], width);
+            continue;
+        }
+        for ( int x = 0; x < width; x++ ) {
+            int shift = 8 - bit_depth * (x % pixels_per_byte + 1);
+            row[x] = (buffer[x / pixels_per_byte] >> shift) & mask;
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+IndexedMatcher::IndexedMatcher( const IndexedImage& Small,
+  int pattern_threshold ) {
+
+    double phase_start = NowMicroseconds();
+
+    small_width = Small.Width();
+    small_height = Small.Height();
+
+    // The small image is small, so it is fine to expand it once
+    vector<RGBApixel> expanded((long) small_width * small_height);
+    for ( int x = 0; x < small_width; x++ ) {
+        for ( int y = 0; y < small_height; y++ ) {
+            expanded[(long) x * small_height + y]
+              = Small.Color(Small.Indices()[(long) y * small_width + x]);
+        }
+    }
+    Matcher matcher( ImageView(&expanded[0], small_width, small_height),
+      pattern_threshold );
+    fast_pattern = matcher.Pattern();
+
+    compile_usec = NowMicroseconds() - phase_start;
+}
+
+/*
+The big image palette entries that one pattern pixel will accept, as a bit
+mask, and where the pixel is relative to the top left of the position
+being checked.
+*/
+struct IndexedPatternPixel {
+    long offset;
+    unsigned char accepted[32];
+};
+
+int IndexedMatcher::Find( const IndexedImage& Big, const MatchOptions& options,
+  MatchCallback callback, void* user_data ) const {
+
+    double phase_start = NowMicroseconds();
+
+    int small_pattern_array_size = (int) fast_pattern.size();
+    int big_width = Big.Width();
+
+    vector<IndexedPatternPixel> pattern(small_pattern_array_size);
+    int allowed_mismatches = AllowedMismatches(options,
+      small_pattern_array_size);
+    int never_matching = 0;
+    for ( int index = 0; index < small_pattern_array_size; index++ ) {
+        const PatternPixel& SmallPixel = fast_pattern[index];
+        IndexedPatternPixel& pixel = pattern[index];
+        pixel.offset = (long) SmallPixel.y * big_width + SmallPixel.x;
+        memset(pixel.accepted, 0, sizeof(pixel.accepted));
+        int accepted_count = 0;
+        for ( int color = 0; color < Big.NumberOfColors(); color++ ) {
+            const RGBApixel& BigColor = Big.Color(color);
+            if ( Abs(BigColor.Red - SmallPixel.red) <= options.tolerance_r
+              && Abs(BigColor.Green - SmallPixel.green) <= options.tolerance_g
+              && Abs(BigColor.Blue - SmallPixel.blue) <= options.tolerance_b ) {
+                pixel.accepted[color >> 3] |= 1 << (color & 7);
+                accepted_count++;
+            }
+        }
+        if ( accepted_count == 0 ) {
+            never_matching++;
+        }
+    }
+
+    SearchStats* stats = options.stats;
+    if ( stats ) {
+        stats->compile_usec = compile_usec;
+        stats->small_pattern_array_size = small_pattern_array_size;
+        stats->positions_visited = 0;
+        // One bucket per depth, plus a last one for the full matches
+        stats->reject_depth.assign(small_pattern_array_size + 1, 0);
+    }
+
+    int first_y_to_check;
+    int max_y_to_check;
+    ShardRows(Big.Height() - small_height, options.shard,
+      options.shard_count, first_y_to_check, max_y_to_check);
+    int max_x_to_check = big_width - small_width;
+    if ( never_matching > allowed_mismatches ) {
+        max_y_to_check = first_y_to_check;
+    }
+
+    const ebmpBYTE* indices = Big.Indices();
+    const IndexedPatternPixel* first = small_pattern_array_size > 0
+      ? &pattern[0] : NULL;
+
+    int has_matched_x_times = 0;
+    int keep_searching = true;
+    int searched_to_y = max_y_to_check;
+
+    for (int big_y = first_y_to_check; big_y < max_y_to_check
+      && keep_searching; ++big_y) {
+        if ( PastDeadline(options) ) {
+            searched_to_y = big_y;
+            break;
+        }
+        for (int big_x = 0; big_x < max_x_to_check; ++big_x) {
+
+            const ebmpBYTE* position = indices + (long) big_y * big_width + big_x;
+
+            int small_pattern_index;
+            int mismatches = 0;
+            for ( small_pattern_index = 0;
+                small_pattern_index < small_pattern_array_size;
+                small_pattern_index++ ) {
+                const IndexedPatternPixel& pixel = first[small_pattern_index];
+                int index = position[pixel.offset];
+                if ( !(pixel.accepted[index >> 3] & (1 << (index & 7)))
+                  && ++mismatches > allowed_mismatches ) {
+                    break;
+                }
+            }
+
+            if ( stats ) {
+                stats->positions_visited++;
+                stats->reject_depth[small_pattern_index]++;
+            }
+
+            if (small_pattern_index == small_pattern_array_size) {
+                Match match;
+                match.x = big_x;
+                match.y = big_y;
+                has_matched_x_times++;
+
+                if ( !callback(match, user_data)
+                  || has_matched_x_times == options.return_how_many_matches ) {
+                    keep_searching = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    ReportProgress(options, searched_to_y - first_y_to_check,
+      max_y_to_check - first_y_to_check);
+    if ( stats ) {
+        stats->scan_usec = NowMicroseconds() - phase_start;
+        stats->matches = has_matched_x_times;
+    }
+
+    return has_matched_x_times;
+}
+
+static inline int PopCount( unsigned long long bits ) {
+#ifdef __GNUC__
+    return __builtin_popcountll(bits);
+#else
+    int count = 0;
+    for ( ; bits; bits &= bits - 1 ) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+BitImage::BitImage() {
+    width = 0;
+    height = 0;
+    words_per_row = 0;
+}
+
+bool BitImage::ReadFromFile( const char* FileName ) {
+
+    FILE* fp = fopen( FileName, "rb" );
+    if ( fp == NULL ) {
+        return false;
+    }
+
+    int compression;
+    if ( ReadPalettizedHeader(fp, width, height, colors, compression) != 1
+      || compression != 0 ) {
+        fclose(fp);
+        return false;
+    }
+
+    // BMP rows are most significant bit first, and ours are the other way
+    ebmpBYTE reversed[256];
+    for ( int byte = 0; byte < 256; byte++ ) {
+        reversed[byte] = 0;
+        for ( int bit = 0; bit < 8; bit++ ) {
+            if ( byte & (1 << bit) ) {
+                reversed[byte] |= 1 << (7 - bit);
+            }
+        }
+    }
+
+    int bytes_per_row = (width + 31) / 32 * 4;
+    vector<ebmpBYTE> buffer(bytes_per_row);
+    words_per_row = (width + 63) / 64 + 1;
+    words.assign((long) words_per_row * height, 0);
+    unsigned long long last_word_mask = width % 64 == 0 ? ~0ULL
+      : (1ULL << (width % 64)) - 1;
+
+    // Rows are stored bottom up
+    for ( int y = height - 1; y >= 0; y-- ) {
+        if ( !SafeFread( (char*) &buffer[0], bytes_per_row, 1, fp ) ) {
+            fclose(fp);
+            return false;
+        }
+        unsigned long long* row = &words[(long) y * words_per_row];
+        for ( int byte = 0; byte < (width + 7) / 8; byte++ ) {
+            row[byte / 8] |= (unsigned long long) reversed[buffer[byte]]
+              << (8 * (byte % 8));
+        }
+        // The padding bits at the end of the row can be anything
+        row[(width - 1) / 64] &= last_word_mask;
+    }
+
+    fclose(fp);
+    return true;
+}
+
+BitMatcher::BitMatcher( const BitImage& Small, int pattern_threshold ) {
+
+    double phase_start = NowMicroseconds();
+
+    small_width = Small.Width();
+    small_height = Small.Height();
+    small_colors[0] = Small.Color(0);
+    small_colors[1] = Small.Color(1);
+
+    // The small image is small, so it is fine to expand it once
+    vector<RGBApixel> expanded((long) small_width * small_height);
+    for ( int x = 0; x < small_width; x++ ) {
+        for ( int y = 0; y < small_height; y++ ) {
+            int index = (Small.Row(y)[x / 64] >> (x % 64)) & 1;
+            expanded[(long) x * small_height + y] = Small.Color(index);
+        }
+    }
+    Matcher matcher( ImageView(&expanded[0], small_width, small_height),
+      pattern_threshold );
+    const vector<PatternPixel>& pattern = matcher.Pattern();
+    pattern_size = (int) pattern.size();
+
+    // The pattern is in raster order, so the words come out that way too
+    for ( int index = 0; index < pattern_size; index++ ) {
+        const PatternPixel& SmallPixel = pattern[index];
+        int word = SmallPixel.x / 64;
+        if ( pattern_words.empty() || pattern_words.back().y != SmallPixel.y
+          || pattern_words.back().x != word ) {
+            PatternWord pattern_word;
+            pattern_word.y = SmallPixel.y;
+            pattern_word.x = word;
+            pattern_word.is_pattern = 0;
+            pattern_word.ones = Small.Row(SmallPixel.y)[word];
+            pattern_word.pattern_before = index;
+            pattern_words.push_back(pattern_word);
+        }
+        pattern_words.back().is_pattern |= 1ULL << (SmallPixel.x % 64);
+    }
+
+    compile_usec = NowMicroseconds() - phase_start;
+}
+
+/*
+One PatternWord, made ready for a particular big image: the bits that
+have to be looked at, and the values they need to have.
+*/
+struct BitScanWord {
+    int y;
+    int x;
+    unsigned long long care;
+    unsigned long long expected;
+    unsigned long long is_pattern;
+    int pattern_before;
+};
+
+static bool Accepts( const RGBApixel& SmallColor, const RGBApixel& BigColor,
+  const MatchOptions& options ) {
+    return Abs(BigColor.Red - SmallColor.Red) <= options.tolerance_r
+      && Abs(BigColor.Green - SmallColor.Green) <= options.tolerance_g
+      && Abs(BigColor.Blue - SmallColor.Blue) <= options.tolerance_b;
+}
+
+int BitMatcher::Find( const BitImage& Big, const MatchOptions& options,
+  MatchCallback callback, void* user_data ) const {
+
+    double phase_start = NowMicroseconds();
+
+    /*
+    Whether each of the small image's two colors is accepted by each of
+    the big image's.  A pattern pixel whose color accepts both doesn't
+    need looking at, and one that accepts neither always fails, and so
+    uses up one of the allowed mismatches everywhere.
+    */
+    int accepts[2][2];
+    for ( int small_index = 0; small_index < 2; small_index++ ) {
+        for ( int big_index = 0; big_index < 2; big_index++ ) {
+            accepts[small_index][big_index] = Accepts(
+              small_colors[small_index], Big.Color(big_index), options);
+        }
+    }
+
+    int allowed_mismatches = AllowedMismatches(options, pattern_size);
+    vector<BitScanWord> scan_words;
+    for ( int index = 0; index < (int) pattern_words.size(); index++ ) {
+        const PatternWord& pattern_word = pattern_words[index];
+        BitScanWord scan_word;
+        scan_word.y = pattern_word.y;
+        scan_word.x = pattern_word.x;
+        scan_word.care = 0;
+        scan_word.expected = 0;
+        scan_word.is_pattern = pattern_word.is_pattern;
+        scan_word.pattern_before = pattern_word.pattern_before;
+        for ( int small_index = 0; small_index < 2; small_index++ ) {
+            unsigned long long pixels = pattern_word.is_pattern
+              & (small_index ? pattern_word.ones : ~pattern_word.ones);
+            if ( accepts[small_index][0] && accepts[small_index][1] ) {
+                continue;
+            }
+            if ( accepts[small_index][1] ) {
+                scan_word.care |= pixels;
+                scan_word.expected |= pixels;
+            }
+            else if ( accepts[small_index][0] ) {
+                scan_word.care |= pixels;
+            }
+            else {
+                allowed_mismatches -= PopCount(pixels);
+            }
+        }
+        if ( scan_word.care ) {
+            scan_words.push_back(scan_word);
+        }
+    }
+
+    SearchStats* stats = options.stats;
+    if ( stats ) {
+        stats->compile_usec = compile_usec;
+        stats->small_pattern_array_size = pattern_size;
+        stats->positions_visited = 0;
+        // One bucket per depth, plus a last one for the full matches
+        stats->reject_depth.assign(pattern_size + 1, 0);
+    }
+
+    int first_y_to_check;
+    int max_y_to_check;
+    ShardRows(Big.Height() - small_height, options.shard,
+      options.shard_count, first_y_to_check, max_y_to_check);
+    int max_x_to_check = Big.Width() - small_width;
+    if ( allowed_mismatches < 0 ) {
+        max_y_to_check = first_y_to_check;
+    }
+
+    int scan_word_count = (int) scan_words.size();
+    const BitScanWord* first = scan_word_count > 0 ? &scan_words[0] : NULL;
+
+    int has_matched_x_times = 0;
+    int keep_searching = true;
+    int searched_to_y = max_y_to_check;
+
+    for (int big_y = first_y_to_check; big_y < max_y_to_check
+      && keep_searching; ++big_y) {
+        if ( PastDeadline(options) ) {
+            searched_to_y = big_y;
+            break;
+        }
+        for (int big_x = 0; big_x < max_x_to_check; ++big_x) {
+
+            int shift = big_x % 64;
+            int word_offset = big_x / 64;
+            int mismatches = 0;
+            int depth = pattern_size;
+
+            for ( int index = 0; index < scan_word_count; index++ ) {
+                const BitScanWord& scan_word = first[index];
+                const unsigned long long* row = Big.Row(big_y + scan_word.y)
+                  + word_offset + scan_word.x;
+                unsigned long long pixels = row[0] >> shift;
+                if ( shift ) {
+                    pixels |= row[1] << (64 - shift);
+                }
+                unsigned long long failed = (pixels ^ scan_word.expected)
+                  & scan_word.care;
+                if ( failed == 0 ) {
+                    continue;
+                }
+                int failed_count = PopCount(failed);
+                if ( mismatches + failed_count > allowed_mismatches ) {
+                    // Find the pixel that Matcher would have given up on
+                    for ( int skip = mismatches; skip < allowed_mismatches;
+                      skip++ ) {
+                        failed &= failed - 1;
+                    }
+                    depth = scan_word.pattern_before + PopCount(
+                      scan_word.is_pattern & ((failed & (0 - failed)) - 1));
+                    break;
+                }
+                mismatches += failed_count;
+            }
+
+            if ( stats ) {
+                stats->positions_visited++;
+                stats->reject_depth[depth]++;
+            }
+
+            if (depth == pattern_size) {
+                Match match;
+                match.x = big_x;
+                match.y = big_y;
+                has_matched_x_times++;
+
+                if ( !callback(match, user_data)
+                  || has_matched_x_times == options.return_how_many_matches ) {
+                    keep_searching = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    ReportProgress(options, searched_to_y - first_y_to_check,
+      max_y_to_check - first_y_to_check);
+    if ( stats ) {
+        stats->scan_usec = NowMicroseconds() - phase_start;
+        stats->matches = has_matched_x_times;
+    }
+
+    return has_matched_x_times;
+}
+
+RunImage::RunImage() {
+    width = 0;
+    height = 0;
+    read_row = 0;
+    read_x = 0;
+}
+
+// Adds a run to the end of the row that starts at runs[row_start]
+static void AppendRun( vector<PixelRun>& runs, int row_start, int x,
+  int length, int index ) {
+    if ( (int) runs.size() > row_start && runs.back().index == index
+      && runs.back().x + runs.back().length == x ) {
+        runs.back().length += length;
+        return;
+    }
+    PixelRun run;
+    run.x = x;
+    run.length = length;
+    run.index = index;
+    runs.push_back(run);
+}
+
+// Fills whatever the file skipped over, up to Row, X, with palette entry 0
+void RunImage::FillTo( int Row, int X ) {
+    while ( read_row < Row ) {
+        if ( read_x < width ) {
+            AppendRun(runs, row_starts.back(), read_x, width - read_x, 0);
+        }
+        read_row++;
+        read_x = 0;
+        row_starts.push_back((int) runs.size());
+    }
+    if ( read_x < X ) {
+        AppendRun(runs, row_starts.back(), read_x, X - read_x, 0);
+        read_x = X;
+    }
+}
+
+void RunImage::AddRun( int Row, int X, int Length, ebmpBYTE Index,
+  void* Image ) {
+    RunImage* image = (RunImage*) Image;
+    image->FillTo(Row, X);
+    AppendRun(image->runs, image->row_starts.back(), X, Length, Index);
+    image->read_x = X + Length;
+}
+
+bool RunImage::ReadFromFile( const char* FileName ) {
+
+    FILE* fp = fopen( FileName, "rb" );
+    if ( fp == NULL ) {
+        return false;
+    }
+
+    int compression;
+    int bit_depth = ReadPalettizedHeader(fp, width, height, colors,
+      compression);
+    if ( bit_depth == 0 || compression == 0 ) {
+        fclose(fp);
+        return false;
+    }
+
+    vector<ebmpBYTE> data;
+    ebmpBYTE buffer[65536];
+    size_t bytes_read;
+    while ( (bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0 ) {
+        data.insert(data.end(), buffer, buffer + bytes_read);
+    }
+    fclose(fp);
+
+    // A file that stops early is still searched, as EasyBMP would read it
+    runs.clear();
+    row_starts.assign(1, 0);
+    read_row = 0;
+    read_x = 0;
+    DecodeEasyBMPrle(data.empty() ? NULL : &data[0], (long) data.size(),
+      bit_depth, width, height, AddRun, this);
+    FillTo(height, 0);
+
+    // The file is bottom row first, and Runs() is top row first
+    vector<PixelRun> top_first;
+    vector<int> top_first_starts(1, 0);
+    top_first.reserve(runs.size());
+    for ( int y = 0; y < height; y++ ) {
+        int row = height - 1 - y;
+        top_first.insert(top_first.end(), runs.begin() + row_starts[row],
+          runs.begin() + row_starts[row + 1]);
+        top_first_starts.push_back((int) top_first.size());
+    }
+    runs.swap(top_first);
+    row_starts.swap(top_first_starts);
+    return true;
+}
+
+RunMatcher::RunMatcher( const ImageView& Small, int pattern_threshold ) {
+
+    double phase_start = NowMicroseconds();
+
+    small_width = Small.Width();
+    small_height = Small.Height();
+    Matcher matcher( Small, pattern_threshold );
+    fast_pattern = matcher.Pattern();
+
+    compile_usec = NowMicroseconds() - phase_start;
+}
+
+/*
+One pattern pixel, with the big image palette entries that it accepts,
+and the runs of the big image row that it falls in at the current big_y.
+cursor is the run it was last found in, which is usually where it will
+be found next, since big_x only goes up.
+*/
+struct RunScanPixel {
+    int x;
+    int y;
+    unsigned char accepted[32];
+    const PixelRun* runs;
+    int number_of_runs;
+    int cursor;
+};
+
+static inline bool RunAccepted( RunScanPixel& pixel, int x ) {
+    const PixelRun* run = pixel.runs + pixel.cursor;
+    if ( x < run->x || x >= run->x + run->length ) {
+        // The run is somewhere in [low, high]
+        int low = x < run->x ? 0 : pixel.cursor + 1;
+        int high = x < run->x ? pixel.cursor - 1 : pixel.number_of_runs - 1;
+        while ( low < high ) {
+            int middle = (low + high + 1) / 2;
+            if ( pixel.runs[middle].x <= x ) {
+                low = middle;
+            }
+            else {
+                high = middle - 1;
+            }
+        }
+        pixel.cursor = low;
+        run = pixel.runs + low;
+    }
+    int index = run->index;
+    return pixel.accepted[index >> 3] & (1 << (index & 7));
+}
+
+int RunMatcher::Find( const RunImage& Big, const MatchOptions& options,
+  MatchCallback callback, void* user_data ) const {
+
+    double phase_start = NowMicroseconds();
+
+    int small_pattern_array_size = (int) fast_pattern.size();
+    int allowed_mismatches = AllowedMismatches(options,
+      small_pattern_array_size);
+
+    vector<RunScanPixel> pattern(small_pattern_array_size);
+    int never_matching = 0;
+    for ( int index = 0; index < small_pattern_array_size; index++ ) {
+        const PatternPixel& SmallPixel = fast_pattern[index];
+        RunScanPixel& pixel = pattern[index];
+        pixel.x = SmallPixel.x;
+        pixel.y = SmallPixel.y;
+        memset(pixel.accepted, 0, sizeof(pixel.accepted));
+        int accepted_count = 0;
+        for ( int color = 0; color < Big.NumberOfColors(); color++ ) {
+            const RGBApixel& BigColor = Big.Color(color);
+            if ( Abs(BigColor.Red - SmallPixel.red) <= options.tolerance_r
+              && Abs(BigColor.Green - SmallPixel.green) <= options.tolerance_g
+              && Abs(BigColor.Blue - SmallPixel.blue) <= options.tolerance_b ) {
+                pixel.accepted[color >> 3] |= 1 << (color & 7);
+                accepted_count++;
+            }
+        }
+        if ( accepted_count == 0 ) {
+            never_matching++;
+        }
+    }
+
+    SearchStats* stats = options.stats;
+    if ( stats ) {
+        stats->compile_usec = compile_usec;
+        stats->small_pattern_array_size = small_pattern_array_size;
+        stats->positions_visited = 0;
+        // One bucket per depth, plus a last one for the full matches
+        stats->reject_depth.assign(small_pattern_array_size + 1, 0);
+    }
+
+    int first_y_to_check;
+    int max_y_to_check;
+    ShardRows(Big.Height() - small_height, options.shard,
+      options.shard_count, first_y_to_check, max_y_to_check);
+    int max_x_to_check = Big.Width() - small_width;
+    if ( never_matching > allowed_mismatches ) {
+        max_y_to_check = first_y_to_check;
+    }
+
+    /*
+    Runs that the first pattern pixel can't match can only be skipped as
+    a whole when no pixel is allowed to fail.
+    */
+    bool skip_runs = allowed_mismatches == 0 && small_pattern_array_size > 0;
+    int first_checked = skip_runs ? 1 : 0;
+    RunScanPixel* first = small_pattern_array_size > 0 ? &pattern[0] : NULL;
+
+    // Without an anchor, the whole row is one span of positions to check
+    PixelRun whole_row;
+    whole_row.x = 0;
+    whole_row.length = max_x_to_check;
+    whole_row.index = 0;
+
+    int has_matched_x_times = 0;
+    int keep_searching = true;
+    int searched_to_y = max_y_to_check;
+
+    for (int big_y = first_y_to_check; big_y < max_y_to_check
+      && keep_searching; ++big_y) {
+        if ( PastDeadline(options) ) {
+            searched_to_y = big_y;
+            break;
+        }
+
+        for ( int index = 0; index < small_pattern_array_size; index++ ) {
+            RunScanPixel& pixel = first[index];
+            pixel.runs = Big.Runs(big_y + pixel.y);
+            pixel.number_of_runs = Big.NumberOfRuns(big_y + pixel.y);
+            pixel.cursor = 0;
+        }
+
+        // Each span is a run under the first pattern pixel, if it has one
+        const PixelRun* spans = &whole_row;
+        int number_of_spans = 1;
+        int span_offset = 0;
+        if ( skip_runs ) {
+            spans = first->runs;
+            number_of_spans = first->number_of_runs;
+            span_offset = first->x;
+        }
+
+        for ( int span = 0; span < number_of_spans && keep_searching;
+          span++ ) {
+
+            int start_x = max(spans[span].x - span_offset, 0);
+            int end_x = min(spans[span].x + spans[span].length - span_offset,
+              max_x_to_check);
+            if ( start_x >= end_x ) {
+                continue;
+            }
+            if ( skip_runs ) {
+                int index = spans[span].index;
+                if ( !(first->accepted[index >> 3] & (1 << (index & 7))) ) {
+                    if ( stats ) {
+                        stats->positions_visited += end_x - start_x;
+                        stats->reject_depth[0] += end_x - start_x;
+                    }
+                    continue;
+                }
+            }
+
+            for ( int big_x = start_x; big_x < end_x; big_x++ ) {
+
+                int small_pattern_index;
+                int mismatches = 0;
+                for ( small_pattern_index = first_checked;
+                    small_pattern_index < small_pattern_array_size;
+                    small_pattern_index++ ) {
+                    RunScanPixel& pixel = first[small_pattern_index];
+                    if ( !RunAccepted(pixel, big_x + pixel.x)
+                      && ++mismatches > allowed_mismatches ) {
+                        break;
+                    }
+                }
+
+                if ( stats ) {
+                    stats->positions_visited++;
+                    stats->reject_depth[small_pattern_index]++;
+                }
+
+                if (small_pattern_index == small_pattern_array_size) {
+                    Match match;
+                    match.x = big_x;
+                    match.y = big_y;
+                    has_matched_x_times++;
+
+                    if ( !callback(match, user_data) || has_matched_x_times
+                      == options.return_how_many_matches ) {
+                        keep_searching = false;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    ReportProgress(options, searched_to_y - first_y_to_check,
+      max_y_to_check - first_y_to_check);
+    if ( stats ) {
+        stats->scan_usec = NowMicroseconds() - phase_start;
+        stats->matches = has_matched_x_times;
+    }
+
+    return has_matched_x_times;
+}
@@ -0,0 +1,215 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_indexed
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: Searches 1, 4 and 8-bit palettized BMPs without expanding
+them to RGB.
+
+EasyBMP turns every pixel of a palettized file into a 4 byte RGBApixel, so
+an 8-bit image takes four times as much memory once decoded, and the scan
+has to stream all of it.  Here we keep one palette index byte per pixel
+instead.  Before a search, each pattern pixel of the small image is turned
+into the set of big image palette entries that it would match (with the
+tolerances taken into account), so the scan only ever looks at one byte
+per pixel and a small bit mask.  The results are exactly the same as
+searching the expanded images.
+
+1-bit images go further still, with BitImage and BitMatcher.  Each row
+stays packed, 64 pixels to a word, and the pattern pixels of each row of
+the small image become a pair of words: which bits to look at, and what
+they should be.  One shift, XOR, AND and popcount then checks 64 pixels,
+and the popcount is also how many of them failed, which is what
+--max-mismatch needs.
+
+RLE8 and RLE4 files are searched as they are stored, with RunImage and
+RunMatcher.  Each row is kept as a list of runs of one palette index, so
+an image of flat UI colors takes about as much memory as the file does.
+The scan walks the runs under the first pattern pixel, and a whole run
+whose color that pixel can't match is passed over at once, however long
+it is.  The rest of the pattern is only looked up, run by run, at the
+positions that are left.
+
+******************************************************************************
+*****************************************************************************/
+
+#ifndef _bmpgrep_indexed_h_
+#define _bmpgrep_indexed_h_
+
+#include <vector>
+#include "libbmpgrep.h"
+
+class IndexedImage {
+  public:
+    IndexedImage();
+
+    /*
+    Returns false, without printing anything, if the file isn't an
+    uncompressed 1, 4 or 8-bit BMP.  Callers are expected to fall back to
+    EasyBMP in that case.
+    */
+    bool ReadFromFile( const char* FileName );
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    int NumberOfColors() const { return (int) colors.size(); }
+    const RGBApixel& Color( int index ) const { return colors[index]; }
+
+    // One byte per pixel, top row first, Width() bytes per row
+    const ebmpBYTE* Indices() const { return &indices[0]; }
+
+  private:
+    std::vector<ebmpBYTE> indices;
+    std::vector<RGBApixel> colors;
+    int width;
+    int height;
+};
+
+class IndexedMatcher {
+  public:
+    // Picks the same pattern pixels that Matcher would
+    IndexedMatcher( const IndexedImage& Small, int pattern_threshold );
+
+    int Find( const IndexedImage& Big, const MatchOptions& options,
+      MatchCallback callback, void* user_data ) const;
+
+    int Width() const { return small_width; }
+    int Height() const { return small_height; }
+
+  private:
+    std::vector<PatternPixel> fast_pattern;
+    int small_width;
+    int small_height;
+    double compile_usec;
+};
+
+class BitImage {
+  public:
+    BitImage();
+
+    // Same as IndexedImage::ReadFromFile, for 1-bit BMPs only
+    bool ReadFromFile( const char* FileName );
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    const RGBApixel& Color( int index ) const { return colors[index]; }
+
+    /*
+    Top row first.  Bit x % 64 of word x / 64 is pixel x.  Each row has a
+    spare zero word on the end, so that 64 bits can be taken from any
+    position in the row with two loads.
+    */
+    const unsigned long long* Row( int y ) const {
+        return &words[(long) y * words_per_row];
+    }
+
+  private:
+    std::vector<unsigned long long> words;
+    std::vector<RGBApixel> colors;
+    int width;
+    int height;
+    int words_per_row;
+};
+
+class BitMatcher {
+  public:
+    // Picks the same pattern pixels that Matcher would
+    BitMatcher( const BitImage& Small, int pattern_threshold );
+
+    int Find( const BitImage& Big, const MatchOptions& options,
+      MatchCallback callback, void* user_data ) const;
+
+    int Width() const { return small_width; }
+    int Height() const { return small_height; }
+
+  private:
+    // The small image's pattern pixels, 64 of its pixels to a word
+    struct PatternWord {
+        int y;
+        int x;
+        unsigned long long is_pattern;
+        unsigned long long ones;
+        // Pattern pixels in the words before this one
+        int pattern_before;
+    };
+
+    std::vector<PatternWord> pattern_words;
+    RGBApixel small_colors[2];
+    int pattern_size;
+    int small_width;
+    int small_height;
+    double compile_usec;
+};
+
+// Pixels x to x + length - 1 of a row are all palette entry index
+struct PixelRun {
+    int x;
+    int length;
+    int index;
+};
+
+class RunImage {
+  public:
+    RunImage();
+
+    /*
+    Returns false, without printing anything, if the file isn't an RLE8
+    or RLE4 BMP.  Pixels that the file skips over are palette entry 0,
+    as they are with EasyBMP.
+    */
+    bool ReadFromFile( const char* FileName );
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    int NumberOfColors() const { return (int) colors.size(); }
+    const RGBApixel& Color( int index ) const { return colors[index]; }
+
+    // Top row first.  The runs of a row cover it exactly, left to right.
+    const PixelRun* Runs( int y ) const {
+        return &runs[row_starts[y]];
+    }
+    int NumberOfRuns( int y ) const {
+        return row_starts[y + 1] - row_starts[y];
+    }
+
+  private:
+    static void AddRun( int Row, int X, int Length, ebmpBYTE Index,
+      void* Image );
+    void FillTo( int Row, int X );
+
+    std::vector<PixelRun> runs;
+    // Where each row's runs start in runs, bottom row first while reading
+    std::vector<int> row_starts;
+    std::vector<RGBApixel> colors;
+    int width;
+    int height;
+    // Where the runs read so far end
+    int read_row;
+    int read_x;
+};
+
+class RunMatcher {
+  public:
+    // Picks the same pattern pixels that Matcher would
+    RunMatcher( const ImageView& Small, int pattern_threshold );
+
+    int Find( const RunImage& Big, const MatchOptions& options,
+      MatchCallback callback, void* user_data ) const;
+
+    int Width() const { return small_width; }
+    int Height() const { return small_height; }
+
+  private:
+    std::vector<PatternPixel> fast_pattern;
+    int small_width;
+    int small_height;
+    double compile_usec;
+};
+
+#endif
@@ -0,0 +1,171 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_merge
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+usage:
+  bmpgrep_merge return_how_many_matches shard_output [shard_output ...]
+
+description: Puts the outputs of bmpgrep --shard back together, for a
+search that was split between machines.  Each shard_output is a file
+holding what one shard printed (- reads it from stdin).  The matches of
+all of them are printed in raster order, exactly as a single bmpgrep run
+over the whole big image would have printed them, and cut off at
+return_how_many_matches (0 means all of them).
+
+A shard that ran out of time (see --deadline-ms) ends its line with
+" incomplete:R/T".  If any did, the merged line ends the same way, with
+R and T added up over the shards that did, since the matches may then be
+missing some that a full search would have found.  Each shard finds at
+most return_how_many_matches of its own, but the first that many of the
+whole image are always among them.
+
+Only x,y matches can be merged, not the output of --scales or --top.
+
+Note: Can be compiled like so:
+g++ -o bmpgrep_merge bmpgrep_merge.cpp
+
+******************************************************************************
+*****************************************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct Match {
+    int x;
+    int y;
+};
+
+static bool IsInRasterOrder( const Match& a, const Match& b ) {
+    if ( a.y != b.y ) {
+        return a.y < b.y;
+    }
+    return a.x < b.x;
+}
+
+/*
+Reads the one line that a shard printed.  It has no line at all if it
+found nothing.
+*/
+static bool ReadShardLine( const char* FileName, string& line ) {
+    if ( strcmp(FileName, "-") == 0 ) {
+        getline(cin, line);
+        return true;
+    }
+    ifstream file( FileName );
+    if ( !file ) {
+        return false;
+    }
+    getline(file, line);
+    return true;
+}
+
+/*
+Adds the matches of one shard's line to matches, and its progress to
+rows_searched and rows_to_search if it ran out of time.
+*/
+static bool ParseShardLine( const string& line, vector<Match>& matches,
+  long& rows_searched, long& rows_to_search, int& is_complete ) {
+
+    const char* text = line.c_str();
+    char* end;
+    while ( isdigit(*text) ) {
+        Match match;
+        match.x = (int) strtol(text, &end, 10);
+        if ( end == text || *end != ',' ) {
+            return false;
+        }
+        text = end + 1;
+        match.y = (int) strtol(text, &end, 10);
+        if ( end == text ) {
+            return false;
+        }
+        matches.push_back(match);
+        text = end;
+        if ( *text == ',' ) {
+            text++;
+        }
+    }
+
+    if ( *text == ' ' ) {
+        text++;
+    }
+    if ( strncmp(text, "incomplete:", 11) == 0 ) {
+        long searched, total;
+        if ( sscanf(text + 11, "%ld/%ld", &searched, &total) != 2 ) {
+            return false;
+        }
+        rows_searched += searched;
+        rows_to_search += total;
+        is_complete = false;
+        return true;
+    }
+    return *text == '\0' || *text == '\r';
+}
+
+int main( int argc, char* argv[] ) {
+
+    if ( argc < 3 ) {
+        cerr << "Expected return_how_many_matches and at least one shard's"
+          << " output, see the top of bmpgrep_merge.cpp" << endl;
+        return 1;
+    }
+    int return_how_many_matches = atoi(argv[1]);
+
+    vector<Match> matches;
+    long rows_searched = 0;
+    long rows_to_search = 0;
+    int is_complete = true;
+    for ( int index = 2; index < argc; index++ ) {
+        string line;
+        if ( !ReadShardLine(argv[index], line) ) {
+            cerr << "Could not read " << argv[index] << endl;
+            return 1;
+        }
+        if ( !ParseShardLine(line, matches, rows_searched, rows_to_search,
+          is_complete) ) {
+            cerr << "Expected x,y matches in " << argv[index] << ", not "
+              << line << endl;
+            return 1;
+        }
+    }
+
+    // The shards don't overlap, so this is all there is to it
+    sort(matches.begin(), matches.end(), IsInRasterOrder);
+    if ( return_how_many_matches > 0
+      && (int) matches.size() > return_how_many_matches ) {
+        matches.resize(return_how_many_matches);
+    }
+
+    for ( int index = 0; index < (int) matches.size(); index++ ) {
+        if ( index > 0 ) {
+            cout << ",";
+        }
+        cout << matches[index].x << "," << matches[index].y;
+    }
+    if ( !is_complete ) {
+        if ( !matches.empty() ) {
+            cout << " ";
+        }
+        cout << "incomplete:" << rows_searched << "/" << rows_to_search;
+    }
+    if ( !matches.empty() || !is_complete ) {
+        cout << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_perf
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: See bmpgrep_perf.h
+
+******************************************************************************
+*****************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include "bmpgrep_perf.h"
+using namespace std;
+
+static const char* EVENT_NAMES[NUMBER_OF_PERF_EVENTS] = {
+    "cycles",
+    "instructions",
+    "l1d_read_misses",
+    "llc_misses",
+    "branch_misses"
+};
+
+static int OpenEvent( int event ) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch ( event ) {
+        case PERF_CYCLES:
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_L1D_READ_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D
+              | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+              | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_LLC_MISSES:
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        default:
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+    }
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+      | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // This thread, on whichever CPU it runs
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+PerfCounters::PerfCounters() {
+    for ( int event = 0; event < NUMBER_OF_PERF_EVENTS; event++ ) {
+        fds[event] = -1;
+    }
+    memset(phase_start, 0, sizeof(phase_start));
+    thread_id = 0;
+}
+
+PerfCounters::~PerfCounters() {
+    for ( int event = 0; event < NUMBER_OF_PERF_EVENTS; event++ ) {
+        if ( fds[event] >= 0 ) {
+            close(fds[event]);
+        }
+    }
+}
+
+bool PerfCounters::Open() {
+    thread_id = (long) syscall(SYS_gettid);
+    int opened = 0;
+    int open_errno = 0;
+    for ( int event = 0; event < NUMBER_OF_PERF_EVENTS; event++ ) {
+        fds[event] = OpenEvent(event);
+        if ( fds[event] >= 0 ) {
+            opened++;
+        }
+        else {
+            open_errno = errno;
+        }
+    }
+    errno = open_errno;
+    return opened > 0;
+}
+
+/*
+The count of each event, then how long it was enabled, then how long it
+was actually counting.  All 0 for an event that isn't open.
+*/
+void PerfCounters::Read( EventValues values[NUMBER_OF_PERF_EVENTS] ) const {
+    for ( int event = 0; event < NUMBER_OF_PERF_EVENTS; event++ ) {
+        if ( fds[event] < 0 || read(fds[event], values[event].values,
+          sizeof(values[event].values))
+          != (ssize_t) sizeof(values[event].values) ) {
+            memset(values[event].values, 0, sizeof(values[event].values));
+        }
+    }
+}
+
+void PerfCounters::StartPhase() {
+    Read(phase_start);
+}
+
+void PerfCounters::EndPhase( const char* name ) {
+    Phase phase;
+    phase.name = name;
+    phase.thread_id = thread_id;
+    EventValues phase_end[NUMBER_OF_PERF_EVENTS];
+    Read(phase_end);
+    for ( int event = 0; event < NUMBER_OF_PERF_EVENTS; event++ ) {
+        const unsigned long long* start = phase_start[event].values;
+        const unsigned long long* end = phase_end[event].values;
+        unsigned long long count = end[0] - start[0];
+        unsigned long long enabled = end[1] - start[1];
+        unsigned long long running = end[2] - start[2];
+        if ( fds[event] < 0 ) {
+            phase.counts[event] = -1;
+        }
+        else if ( running == 0 || running == enabled ) {
+            phase.counts[event] = (long long) count;
+        }
+        else {
+            // Scaled up to the time that it wasn't being counted
+            phase.counts[event] = (long long) ((double) count * enabled
+              / running);
+        }
+    }
+    phases.push_back(phase);
+    memcpy(phase_start, phase_end, sizeof(phase_start));
+}
+
+void PerfCounters::Print( ostream& out ) const {
+    for ( int index = 0; index < (int) phases.size(); index++ ) {
+        const Phase& phase = phases[index];
+        out << phase.name << "_thread=" << phase.thread_id << endl;
+        for ( int event = 0; event < NUMBER_OF_PERF_EVENTS; event++ ) {
+            out << phase.name << "_" << EVENT_NAMES[event] << "="
+              << phase.counts[event] << endl;
+        }
+    }
+}
@@ -0,0 +1,95 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_perf
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: Hardware performance counters for the phases of one bmpgrep
+run (see --perf-counters), read through Linux's perf_event_open, so that
+a change to the pixel layout or the scan can be judged by the cycles,
+instructions, cache misses and branch mispredictions it costs rather
+than by its wall clock time alone.
+
+A PerfCounters counts the thread that opened it, and any threads that
+thread starts afterwards, such as EasyBMP's decoder threads.  Each
+thread that runs a phase opens its own, so phases that run at the same
+time on different threads, like reading the big and small images, are
+counted apart.
+
+Only user space is counted, which is all that a perf_event_paranoid of
+2 (the usual default) allows.  Counters that the CPU, the kernel or a
+virtual machine doesn't provide read as -1.  When more counters are
+asked for than the CPU can count at once, the kernel takes turns, and
+the counts are scaled up to the whole phase.
+
+******************************************************************************
+*****************************************************************************/
+
+#ifndef _bmpgrep_perf_h_
+#define _bmpgrep_perf_h_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_READ_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    NUMBER_OF_PERF_EVENTS
+};
+
+class PerfCounters {
+  public:
+    PerfCounters();
+    ~PerfCounters();
+
+    /*
+    Starts counting the calling thread.  Returns false, with errno saying
+    why, if none of the counters could be opened.
+    */
+    bool Open();
+
+    // A phase runs from StartPhase(), or the end of the last phase, to
+    // EndPhase(), on the thread that called Open()
+    void StartPhase();
+    void EndPhase( const char* name );
+
+    /*
+    Writes each phase as "name_thread=ID", then "name_COUNTER=value" for
+    cycles, instructions, l1d_read_misses, llc_misses and branch_misses,
+    the same way SearchStats::Print() writes its counters.
+    */
+    void Print( std::ostream& out ) const;
+
+  private:
+    struct Phase {
+        std::string name;
+        long thread_id;
+        long long counts[NUMBER_OF_PERF_EVENTS];
+    };
+
+    struct EventValues {
+        unsigned long long values[3];
+    };
+
+    void Read( EventValues values[NUMBER_OF_PERF_EVENTS] ) const;
+
+    // Not copyable, since it owns file descriptors
+    PerfCounters( const PerfCounters& );
+    PerfCounters& operator=( const PerfCounters& );
+
+    int fds[NUMBER_OF_PERF_EVENTS];
+    long thread_id;
+    EventValues phase_start[NUMBER_OF_PERF_EVENTS];
+    std::vector<Phase> phases;
+};
+
+#endif
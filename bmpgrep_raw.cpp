@@ -0,0 +1,312 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_raw
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: See bmpgrep_raw.h
+
+******************************************************************************
+*****************************************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bmpgrep_raw.h"
+using namespace std;
+
+static bool StartsWith( const char* text, const char* prefix ) {
+    return strncmp(text, prefix, strlen(prefix)) == 0;
+}
+
+// A plain file name that holds a binary PPM
+static bool IsPPMFile( const char* FileName ) {
+    FILE* fp = fopen( FileName, "rb" );
+    if ( fp == NULL ) {
+        return false;
+    }
+    char magic[2];
+    bool is_ppm = fread(magic, 1, 2, fp) == 2 && magic[0] == 'P'
+      && magic[1] == '6';
+    fclose(fp);
+    return is_ppm;
+}
+
+/*
+Splits "a:b:c:rest" into count fields, the last of which gets everything
+that is left, colons and all.
+*/
+static bool SplitFields( const string& text, int count,
+  vector<string>& fields ) {
+    size_t field_start = 0;
+    for ( int index = 0; index < count - 1; index++ ) {
+        size_t colon = text.find(':', field_start);
+        if ( colon == string::npos ) {
+            return false;
+        }
+        fields.push_back(text.substr(field_start, colon - field_start));
+        field_start = colon + 1;
+    }
+    fields.push_back(text.substr(field_start));
+    return true;
+}
+
+RawImage::RawImage() {
+    data = NULL;
+    data_bytes = 0;
+    mapping = NULL;
+    mapping_bytes = 0;
+}
+
+RawImage::~RawImage() {
+    if ( mapping ) {
+        munmap(mapping, mapping_bytes);
+    }
+}
+
+bool RawImage::IsRawImage( const char* Name ) {
+    return IsDescription(Name) || IsPPMFile(Name);
+}
+
+bool RawImage::IsDescription( const char* Name ) {
+    return StartsWith(Name, "raw:") || StartsWith(Name, "ppm:");
+}
+
+bool RawImage::ReadsStdin( const char* Name ) {
+    if ( !IsDescription(Name) ) {
+        return false;
+    }
+    size_t length = strlen(Name);
+    return length >= 2 && strcmp(Name + length - 2, ":-") == 0;
+}
+
+bool RawImage::Read( const char* Name ) {
+
+    if ( !IsDescription(Name) ) {
+        return ReadSource(Name) && ReadPPM();
+    }
+
+    vector<string> fields;
+    if ( StartsWith(Name, "ppm:") ) {
+        SplitFields(Name, 2, fields);
+        return ReadSource(fields[1]) && ReadPPM();
+    }
+
+    int width = 0;
+    int height = 0;
+    char* end;
+    if ( SplitFields(Name, 5, fields) ) {
+        width = (int) strtol(fields[2].c_str(), &end, 10);
+        if ( *end == 'x' ) {
+            height = (int) strtol(end + 1, &end, 10);
+        }
+    }
+    if ( width <= 0 || height <= 0 || *end != '\0' ) {
+        cerr << "Expected raw:FORMAT:WIDTHxHEIGHT:STRIDE:SOURCE, not "
+          << Name << endl;
+        return false;
+    }
+    long stride = strtol(fields[3].c_str(), &end, 10);
+    if ( stride < 0 || *end != '\0' ) {
+        cerr << "Bad stride in " << Name << endl;
+        return false;
+    }
+    return ReadSource(fields[4]) && ReadRaw(fields[1], width, height, stride);
+}
+
+/*
+Files and shared memory objects are mapped, so that pixels that don't
+need converting are never copied at all.  stdin can only be read.
+*/
+bool RawImage::ReadSource( const string& source ) {
+
+    if ( source == "-" ) {
+        char buffer[65536];
+        ssize_t bytes_read;
+        while ( (bytes_read = read(0, buffer, sizeof(buffer))) > 0 ) {
+            contents.insert(contents.end(), buffer, buffer + bytes_read);
+        }
+        if ( contents.empty() ) {
+            cerr << "Nothing on stdin" << endl;
+            return false;
+        }
+        data = &contents[0];
+        data_bytes = (long) contents.size();
+        return true;
+    }
+
+    int fd;
+    if ( StartsWith(source.c_str(), "shm:") ) {
+        fd = shm_open(source.c_str() + 4, O_RDONLY, 0);
+    }
+    else {
+        fd = open(source.c_str(), O_RDONLY);
+    }
+    struct stat source_info;
+    if ( fd < 0 || fstat(fd, &source_info) != 0 || source_info.st_size == 0 ) {
+        cerr << "Could not open " << source << endl;
+        if ( fd >= 0 ) {
+            close(fd);
+        }
+        return false;
+    }
+
+    mapping_bytes = (long) source_info.st_size;
+    mapping = mmap(NULL, mapping_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( mapping == MAP_FAILED ) {
+        cerr << "Could not map " << source << endl;
+        mapping = NULL;
+        return false;
+    }
+    data = (const unsigned char*) mapping;
+    data_bytes = mapping_bytes;
+    return true;
+}
+
+bool RawImage::ReadRaw( const string& format, int width, int height,
+  long stride ) {
+
+    int red_at;
+    int blue_at;
+    int bytes_per_pixel;
+    if ( format == "bgra" ) {
+        red_at = 2;
+        blue_at = 0;
+        bytes_per_pixel = 4;
+    }
+    else if ( format == "bgr" ) {
+        red_at = 2;
+        blue_at = 0;
+        bytes_per_pixel = 3;
+    }
+    else if ( format == "rgb" ) {
+        red_at = 0;
+        blue_at = 2;
+        bytes_per_pixel = 3;
+    }
+    else {
+        cerr << "Unknown raw format " << format << endl;
+        return false;
+    }
+
+    long row_bytes = (long) width * bytes_per_pixel;
+    if ( stride == 0 ) {
+        stride = row_bytes;
+    }
+    if ( stride < row_bytes
+      || data_bytes < stride * (height - 1) + row_bytes ) {
+        cerr << "Expected " << height << " rows of " << stride
+          << " bytes, but only got " << data_bytes << " bytes" << endl;
+        return false;
+    }
+
+    if ( bytes_per_pixel == (int) sizeof(RGBApixel) && stride % 4 == 0
+      && ((size_t) data) % 4 == 0 ) {
+        view = ImageView::FromRows((const RGBApixel*) data, width, height,
+          (int) (stride / 4));
+        return true;
+    }
+
+    pixels.resize((long) width * height);
+    for ( int y = 0; y < height; y++ ) {
+        const unsigned char* source = data + y * stride;
+        RGBApixel* target = &pixels[(long) y * width];
+        for ( int x = 0; x < width; x++ ) {
+            target[x].Red = source[red_at];
+            target[x].Green = source[1];
+            target[x].Blue = source[blue_at];
+            target[x].Alpha = 0;
+            source += bytes_per_pixel;
+        }
+    }
+    view = ImageView::FromRows(&pixels[0], width, height, width);
+    return true;
+}
+
+/*
+The header is "P6", then width, height and the largest sample value,
+separated by whitespace and # comments, then exactly one whitespace
+character before the pixels.
+*/
+bool RawImage::ReadPPM() {
+
+    long position = 2;
+    long header_values[3];
+    if ( data_bytes < 2 || data[0] != 'P' || data[1] != '6' ) {
+        cerr << "Not a binary PPM" << endl;
+        return false;
+    }
+    for ( int index = 0; index < 3; index++ ) {
+        while ( position < data_bytes ) {
+            if ( data[position] == '#' ) {
+                while ( position < data_bytes && data[position] != '\n' ) {
+                    position++;
+                }
+            }
+            else if ( isspace(data[position]) ) {
+                position++;
+            }
+            else {
+                break;
+            }
+        }
+        header_values[index] = 0;
+        int digits = 0;
+        while ( position < data_bytes && isdigit(data[position])
+          && digits < 9 ) {
+            header_values[index] = header_values[index] * 10
+              + (data[position] - '0');
+            position++;
+            digits++;
+        }
+        if ( digits == 0 ) {
+            cerr << "Bad PPM header" << endl;
+            return false;
+        }
+    }
+    position++;
+
+    int width = (int) header_values[0];
+    int height = (int) header_values[1];
+    int max_value = (int) header_values[2];
+    if ( width <= 0 || height <= 0 || max_value <= 0 || max_value > 255 ) {
+        cerr << "Only PPMs with one byte samples are supported" << endl;
+        return false;
+    }
+    long row_bytes = (long) width * 3;
+    if ( data_bytes - position < row_bytes * height ) {
+        cerr << "PPM is shorter than its header says" << endl;
+        return false;
+    }
+
+    const unsigned char* source = data + position;
+    pixels.resize((long) width * height);
+    for ( long index = 0; index < (long) pixels.size(); index++ ) {
+        RGBApixel& target = pixels[index];
+        if ( max_value == 255 ) {
+            target.Red = source[0];
+            target.Green = source[1];
+            target.Blue = source[2];
+        }
+        else {
+            target.Red = (ebmpBYTE) (source[0] * 255 / max_value);
+            target.Green = (ebmpBYTE) (source[1] * 255 / max_value);
+            target.Blue = (ebmpBYTE) (source[2] * 255 / max_value);
+        }
+        target.Alpha = 0;
+        source += 3;
+    }
+    view = ImageView::FromRows(&pixels[0], width, height, width);
+    return true;
+}
@@ -0,0 +1,83 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_raw
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: Reads images that aren't BMP files, for programs that
+capture the screen and would otherwise have to encode every frame as a
+BMP just so that we can decode it again.
+
+An image argument can be written as
+
+  raw:FORMAT:WIDTHxHEIGHT:STRIDE:SOURCE
+  ppm:SOURCE
+
+FORMAT is bgra, bgr or rgb, and STRIDE is the number of bytes from the
+start of one row to the start of the next (0 means the rows are packed).
+Rows are top row first.  SOURCE is a file name, - for stdin, or
+shm:/name for a POSIX shared memory object.  ppm: reads a binary (P6)
+PPM, and a plain file name that turns out to hold one is read as a PPM
+as well.
+
+Files and shared memory are mapped rather than read.  bgra pixels with a
+stride that is a multiple of 4 are searched right where they are, since
+they are laid out just like RGBApixels.  Anything else is converted once.
+
+******************************************************************************
+*****************************************************************************/
+
+#ifndef _bmpgrep_raw_h_
+#define _bmpgrep_raw_h_
+
+#include <string>
+#include <vector>
+#include "libbmpgrep.h"
+
+class RawImage {
+  public:
+    RawImage();
+    ~RawImage();
+
+    // True for anything that Read() should be used for instead of EasyBMP
+    static bool IsRawImage( const char* Name );
+
+    // True for raw: and ppm: names, which may change without a new mtime
+    static bool IsDescription( const char* Name );
+
+    static bool ReadsStdin( const char* Name );
+
+    // Prints why to stderr and returns false if the image can't be read
+    bool Read( const char* Name );
+
+    const ImageView& View() const { return view; }
+
+  private:
+    bool ReadSource( const std::string& source );
+    bool ReadRaw( const std::string& format, int width, int height,
+      long stride );
+    bool ReadPPM();
+
+    // Not copyable, since it may own a mapping
+    RawImage( const RawImage& );
+    RawImage& operator=( const RawImage& );
+
+    // Either mapped, or read into contents
+    const unsigned char* data;
+    long data_bytes;
+    void* mapping;
+    long mapping_bytes;
+    std::vector<unsigned char> contents;
+
+    // Only used when the source pixels had to be converted
+    std::vector<RGBApixel> pixels;
+
+    ImageView view;
+};
+
+#endif
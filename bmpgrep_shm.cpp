@@ -0,0 +1,355 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_shm
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: See bmpgrep_shm.h
+
+******************************************************************************
+*****************************************************************************/
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "bmpgrep_shm.h"
+using namespace std;
+
+static const unsigned int SEGMENT_MAGIC = 0x62677270; // "bgrp"
+static const char* SEGMENT_PREFIX = "bmpgrep-";
+static const char* SEGMENT_DIRECTORY = "/dev/shm";
+
+// The pixels start on their own page, so they can be mapped read-only
+static const long HEADER_BYTES = 4096;
+
+/*
+Lives at the start of every segment.  The writer fills in everything else
+before it sets ready, so a reader that sees ready can trust the rest.
+*/
+struct SharedImageHeader {
+    unsigned int magic;
+    volatile int ready;
+    int creator_pid;
+    int width;
+    int height;
+    ContentDigest digest;
+    volatile int mapped_count;
+    volatile long last_used;
+};
+
+// The constants of xxHash64
+static const unsigned long long PRIME_1 = 11400714785074694791ULL;
+static const unsigned long long PRIME_2 = 14029467366897019727ULL;
+static const unsigned long long PRIME_3 = 1609587929392839161ULL;
+
+static unsigned long long RotateLeft( unsigned long long value, int bits ) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Every bit of the result depends on every bit of hash
+static unsigned long long Avalanche( unsigned long long hash ) {
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/*
+Two independent 64 bit hashes of the whole file, each fed eight bytes at
+a time with xxHash64's round (multiply, rotate, multiply), which spreads
+a change in any byte over the whole word, but with different seeds and
+rotations.  Since this runs over the whole file on every lookup, it has
+to keep up with reading it.
+*/
+static ContentDigest HashBytes( const char* bytes, long count ) {
+    unsigned long long first = PRIME_1 + PRIME_2;
+    unsigned long long second = PRIME_3;
+    long index = 0;
+    for ( ; index + 8 <= count; index += 8 ) {
+        unsigned long long word;
+        memcpy(&word, bytes + index, 8);
+        first = RotateLeft(first + word * PRIME_2, 31) * PRIME_1;
+        second = RotateLeft(second + word * PRIME_1, 27) * PRIME_2;
+    }
+    if ( index < count ) {
+        // The last few bytes, as a word padded with zeros
+        unsigned long long word = 0;
+        memcpy(&word, bytes + index, count - index);
+        first = RotateLeft(first + word * PRIME_2, 31) * PRIME_1;
+        second = RotateLeft(second + word * PRIME_1, 27) * PRIME_2;
+    }
+    ContentDigest digest;
+    digest.file_size = count;
+    digest.hash[0] = Avalanche(first ^ count);
+    digest.hash[1] = Avalanche(second ^ RotateLeft(count, 32));
+    return digest;
+}
+
+static bool ReadWholeFile( const char* FileName, vector<char>& contents ) {
+    FILE* fp = fopen( FileName, "rb" );
+    if ( fp == NULL ) {
+        return false;
+    }
+    char buffer[65536];
+    size_t bytes_read;
+    while ( (bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0 ) {
+        contents.insert(contents.end(), buffer, buffer + bytes_read);
+    }
+    fclose(fp);
+    return !contents.empty();
+}
+
+SharedImage::SharedImage() {
+    image = NULL;
+    header = NULL;
+    pixels = NULL;
+    pixel_bytes = 0;
+}
+
+SharedImage::~SharedImage() {
+    if ( header ) {
+        __sync_fetch_and_sub(&header->mapped_count, 1);
+        munmap(pixels, pixel_bytes);
+        munmap(header, HEADER_BYTES);
+    }
+    delete image;
+}
+
+SharedImageCache::SharedImageCache( long max_bytes ) {
+    this->max_bytes = max_bytes;
+}
+
+SharedImage* SharedImageCache::Get( const char* FileName, double* read_usec ) {
+
+    double phase_start = NowMicroseconds();
+
+    vector<char> contents;
+    if ( !ReadWholeFile(FileName, contents) ) {
+        return NULL;
+    }
+    ContentDigest digest = HashBytes(&contents[0], (long) contents.size());
+    char segment_name[64];
+    snprintf(segment_name, sizeof(segment_name), "/%s%016llx%016llx",
+      SEGMENT_PREFIX, digest.hash[0], digest.hash[1]);
+
+    SharedImage* shared = Map(segment_name, digest);
+    if ( shared == NULL ) {
+        BMP* image = new BMP;
+        if ( !image->ReadFromFile(FileName) ) {
+            delete image;
+            return NULL;
+        }
+        Publish(segment_name, digest, *image);
+        shared = Map(segment_name, digest);
+        if ( shared ) {
+            delete image;
+        }
+        else {
+            // Someone else is publishing it right now, so use our own copy
+            shared = new SharedImage;
+            shared->image = image;
+            shared->view = ImageView(*image);
+        }
+    }
+
+    if ( read_usec ) {
+        *read_usec = NowMicroseconds() - phase_start;
+    }
+    return shared;
+}
+
+SharedImage* SharedImageCache::Map( const char* segment_name,
+  const ContentDigest& digest ) {
+
+    int fd = shm_open(segment_name, O_RDWR, 0);
+    if ( fd < 0 ) {
+        return NULL;
+    }
+
+    struct stat segment_info;
+    if ( fstat(fd, &segment_info) != 0 || segment_info.st_size < HEADER_BYTES ) {
+        // Still being created
+        close(fd);
+        return NULL;
+    }
+
+    SharedImageHeader* header = (SharedImageHeader*) mmap(NULL, HEADER_BYTES,
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ( header == MAP_FAILED ) {
+        close(fd);
+        return NULL;
+    }
+
+    if ( header->magic != SEGMENT_MAGIC || !header->ready ) {
+        if ( header->magic == SEGMENT_MAGIC && kill(header->creator_pid, 0) != 0
+          && errno == ESRCH ) {
+            // Its writer died before finishing it
+            shm_unlink(segment_name);
+        }
+        munmap(header, HEADER_BYTES);
+        close(fd);
+        return NULL;
+    }
+    __sync_synchronize();
+
+    long pixel_bytes = (long) header->width * header->height * sizeof(RGBApixel);
+    if ( header->digest.file_size != digest.file_size
+      || header->digest.hash[0] != digest.hash[0]
+      || header->digest.hash[1] != digest.hash[1]
+      || segment_info.st_size < HEADER_BYTES + pixel_bytes ) {
+        // A hash collision, or not one of ours
+        munmap(header, HEADER_BYTES);
+        close(fd);
+        return NULL;
+    }
+
+    void* pixels = mmap(NULL, pixel_bytes, PROT_READ, MAP_SHARED, fd,
+      HEADER_BYTES);
+    close(fd);
+    if ( pixels == MAP_FAILED ) {
+        munmap(header, HEADER_BYTES);
+        return NULL;
+    }
+
+    __sync_fetch_and_add(&header->mapped_count, 1);
+    header->last_used = (long) time(NULL);
+
+    SharedImage* shared = new SharedImage;
+    shared->header = header;
+    shared->pixels = pixels;
+    shared->pixel_bytes = pixel_bytes;
+    shared->view = ImageView((const RGBApixel*) pixels, header->width,
+      header->height);
+    return shared;
+}
+
+void SharedImageCache::Publish( const char* segment_name,
+  const ContentDigest& digest, BMP& Image ) {
+
+    int width = Image.TellWidth();
+    int height = Image.TellHeight();
+    long pixel_bytes = (long) width * height * sizeof(RGBApixel);
+    long segment_bytes = HEADER_BYTES + pixel_bytes;
+
+    MakeRoom(segment_bytes);
+
+    int fd = shm_open(segment_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if ( fd < 0 ) {
+        return;
+    }
+    if ( ftruncate(fd, segment_bytes) != 0 ) {
+        shm_unlink(segment_name);
+        close(fd);
+        return;
+    }
+    char* segment = (char*) mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+    close(fd);
+    if ( segment == MAP_FAILED ) {
+        shm_unlink(segment_name);
+        return;
+    }
+
+    SharedImageHeader* header = (SharedImageHeader*) segment;
+    header->creator_pid = (int) getpid();
+    header->width = width;
+    header->height = height;
+    header->digest = digest;
+    header->mapped_count = 0;
+    header->last_used = (long) time(NULL);
+    header->magic = SEGMENT_MAGIC;
+
+    // Same layout as ImageView( pixels, width, height ) expects
+    RGBApixel* pixels = (RGBApixel*) (segment + HEADER_BYTES);
+    for ( int x = 0; x < width; x++ ) {
+        memcpy(pixels + (long) x * height, Image(x, 0),
+          height * sizeof(RGBApixel));
+    }
+
+    __sync_synchronize();
+    header->ready = 1;
+    munmap(segment, segment_bytes);
+}
+
+struct SegmentInfo {
+    string name;
+    long bytes;
+    int mapped_count;
+    long last_used;
+};
+
+// Unused segments first, then the least recently used
+static bool EvictFirst( const SegmentInfo& a, const SegmentInfo& b ) {
+    if ( (a.mapped_count > 0) != (b.mapped_count > 0) ) {
+        return a.mapped_count <= 0;
+    }
+    return a.last_used < b.last_used;
+}
+
+void SharedImageCache::MakeRoom( long bytes_needed ) {
+
+    DIR* directory = opendir(SEGMENT_DIRECTORY);
+    if ( directory == NULL ) {
+        return;
+    }
+
+    vector<SegmentInfo> segments;
+    long total_bytes = 0;
+    struct dirent* item;
+    while ( (item = readdir(directory)) != NULL ) {
+        if ( strncmp(item->d_name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) != 0 ) {
+            continue;
+        }
+        SegmentInfo segment;
+        segment.name = string("/") + item->d_name;
+        segment.mapped_count = 0;
+        segment.last_used = 0;
+
+        int fd = shm_open(segment.name.c_str(), O_RDONLY, 0);
+        if ( fd < 0 ) {
+            continue;
+        }
+        struct stat segment_info;
+        if ( fstat(fd, &segment_info) != 0 ) {
+            close(fd);
+            continue;
+        }
+        segment.bytes = (long) segment_info.st_size;
+        if ( segment_info.st_size >= HEADER_BYTES ) {
+            SharedImageHeader* header = (SharedImageHeader*) mmap(NULL,
+              HEADER_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+            if ( header != MAP_FAILED ) {
+                segment.mapped_count = header->mapped_count;
+                segment.last_used = header->last_used;
+                munmap(header, HEADER_BYTES);
+            }
+        }
+        close(fd);
+        total_bytes += segment.bytes;
+        segments.push_back(segment);
+    }
+    closedir(directory);
+
+    sort(segments.begin(), segments.end(), EvictFirst);
+    for ( int index = 0; index < (int) segments.size()
+      && total_bytes + bytes_needed > max_bytes; index++ ) {
+        shm_unlink(segments[index].name.c_str());
+        total_bytes -= segments[index].bytes;
+    }
+}
@@ -0,0 +1,92 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_shm
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: Shares decoded images between unrelated bmpgrep processes on
+the same host, through POSIX shared memory.
+
+Each decoded image is published as its own segment, named after a 128 bit
+hash of the file's contents, so two copies of the same screenshot share a decode
+no matter where they live.  The first process to decode a file publishes
+it, and everyone after that maps the segment read-only instead of decoding
+it again.
+
+No process ever waits on another.  If a segment is still being written
+when we find it, we simply decode the file ourselves.  If its writer died
+half way through, we remove it.
+
+Every segment header carries a count of the processes that have it mapped
+and the time it was last used.  When publishing would take the cache over
+its size budget, the least recently used segments are removed, preferring
+ones that nobody has mapped.  Removing a segment only removes its name, so
+processes that already have it mapped keep working, which is also why a
+count left too high by a crashed process does no harm.
+
+******************************************************************************
+*****************************************************************************/
+
+#ifndef _bmpgrep_shm_h_
+#define _bmpgrep_shm_h_
+
+#include "libbmpgrep.h"
+
+struct SharedImageHeader;
+
+// What a segment is named after, and checked against when it is mapped
+struct ContentDigest {
+    unsigned long long file_size;
+    unsigned long long hash[2];
+};
+
+/*
+One decoded image, either mapped from a shared segment or, if it couldn't
+be shared, decoded privately.  The view stays valid for the lifetime of
+this object.
+*/
+class SharedImage {
+  public:
+    ~SharedImage();
+
+    const ImageView& View() const { return view; }
+    bool IsShared() const { return header != NULL; }
+
+  private:
+    friend class SharedImageCache;
+    SharedImage();
+
+    ImageView view;
+    BMP* image;
+    SharedImageHeader* header;
+    void* pixels;
+    long pixel_bytes;
+};
+
+class SharedImageCache {
+  public:
+    // Publishing evicts old segments to stay under this many bytes
+    explicit SharedImageCache( long max_bytes );
+
+    /*
+    Returns NULL if the file can't be read.  The caller owns the result.
+    read_usec, if given, is set to the time spent reading, hashing and
+    (on a miss) decoding the file.
+    */
+    SharedImage* Get( const char* FileName, double* read_usec );
+
+  private:
+    SharedImage* Map( const char* segment_name, const ContentDigest& digest );
+    void Publish( const char* segment_name, const ContentDigest& digest,
+      BMP& Image );
+    void MakeRoom( long bytes_needed );
+
+    long max_bytes;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_trace
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: See bmpgrep_trace.h
+
+******************************************************************************
+*****************************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "bmpgrep_trace.h"
+using namespace std;
+
+int trace_is_on = false;
+
+// A complete span ('X'), or the beginning ('B') or end ('E') of one
+struct TraceEvent {
+    const char* name;
+    const char* arg_name;
+    long arg_value;
+    double start_usec;
+    double duration_usec;
+    char phase;
+};
+
+struct TraceBuffer {
+    long thread_id;
+    const char* thread_name;
+    vector<TraceEvent> events;
+};
+
+static FILE* trace_file = NULL;
+static double trace_start_usec = 0;
+
+// Only locked when a thread records its first event, and at exit
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<TraceBuffer*> buffers;
+
+static __thread TraceBuffer* thread_buffer = NULL;
+
+// The same clock as NowMicroseconds() in libbmpgrep
+static double MonotonicMicroseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+static TraceBuffer* ThreadBuffer() {
+    if ( thread_buffer == NULL ) {
+        thread_buffer = new TraceBuffer;
+        thread_buffer->thread_id = (long) syscall(SYS_gettid);
+        thread_buffer->thread_name = NULL;
+        thread_buffer->events.reserve(1024);
+        pthread_mutex_lock(&buffers_lock);
+        buffers.push_back(thread_buffer);
+        pthread_mutex_unlock(&buffers_lock);
+    }
+    return thread_buffer;
+}
+
+static void Record( char phase, const char* name, double start_usec,
+  const char* arg_name, long arg_value ) {
+    TraceEvent event;
+    event.name = name;
+    event.arg_name = arg_name;
+    event.arg_value = arg_value;
+    event.start_usec = start_usec;
+    event.duration_usec = MonotonicMicroseconds() - start_usec;
+    event.phase = phase;
+    ThreadBuffer()->events.push_back(event);
+}
+
+void TraceRecordSpan( const char* name, double start_usec,
+  const char* arg_name, long arg_value ) {
+    Record('X', name, start_usec, arg_name, arg_value);
+}
+
+void TraceBegin( const char* name, const char* arg_name, long arg_value ) {
+    if ( trace_is_on ) {
+        Record('B', name, MonotonicMicroseconds(), arg_name, arg_value);
+    }
+}
+
+void TraceEnd() {
+    if ( trace_is_on ) {
+        Record('E', NULL, MonotonicMicroseconds(), NULL, 0);
+    }
+}
+
+void TraceThreadName( const char* name ) {
+    if ( trace_is_on ) {
+        ThreadBuffer()->thread_name = name;
+    }
+}
+
+/*
+One object per line, so that a trace that was cut short is still easy
+to read by eye.  Every thread has stopped recording by the time this
+runs.
+*/
+static void WriteTrace() {
+    trace_is_on = false;
+    int process_id = (int) getpid();
+    const char* separator = "";
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    pthread_mutex_lock(&buffers_lock);
+    for ( int index = 0; index < (int) buffers.size(); index++ ) {
+        const TraceBuffer* buffer = buffers[index];
+        if ( buffer->thread_name ) {
+            fprintf(trace_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+              "\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+              separator, process_id, buffer->thread_id, buffer->thread_name);
+            separator = ",\n";
+        }
+        for ( int event_index = 0; event_index < (int) buffer->events.size();
+          event_index++ ) {
+            const TraceEvent& event = buffer->events[event_index];
+            fprintf(trace_file, "%s{", separator);
+            if ( event.name ) {
+                fprintf(trace_file, "\"name\":\"%s\",\"cat\":\"bmpgrep\",",
+                  event.name);
+            }
+            fprintf(trace_file, "\"ph\":\"%c\",\"ts\":%.3f,", event.phase,
+              event.start_usec - trace_start_usec);
+            if ( event.phase == 'X' ) {
+                fprintf(trace_file, "\"dur\":%.3f,", event.duration_usec);
+            }
+            fprintf(trace_file, "\"pid\":%d,\"tid\":%ld", process_id,
+              buffer->thread_id);
+            if ( event.arg_name ) {
+                fprintf(trace_file, ",\"args\":{\"%s\":%ld}", event.arg_name,
+                  event.arg_value);
+            }
+            fprintf(trace_file, "}");
+            separator = ",\n";
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+bool TraceStart( const char* FileName ) {
+    if ( trace_file ) {
+        return true;
+    }
+    trace_file = fopen(FileName, "w");
+    if ( trace_file == NULL ) {
+        return false;
+    }
+    trace_start_usec = MonotonicMicroseconds();
+    atexit(WriteTrace);
+    trace_is_on = true;
+    return true;
+}
@@ -0,0 +1,63 @@
+/*****************************************************************************
+******************************************************************************
+
+bmpgrep_trace
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: A timeline of one bmpgrep run (see --trace), written in the
+Trace Event Format that chrome://tracing and Perfetto read, so that once
+decoding and scanning overlap on several threads we can still see where
+the wall clock time went: which thread was idle, which one straggled,
+and how long we waited on the disk.
+
+Each thread records its spans into a buffer of its own, so recording
+takes no lock, and does nothing but test a flag until TraceStart() is
+called.  The buffers are kept after their threads exit, and written out
+together when the program exits.
+
+Span and argument names are not copied, so they must be string
+constants.
+
+******************************************************************************
+*****************************************************************************/
+
+#ifndef _bmpgrep_trace_h_
+#define _bmpgrep_trace_h_
+
+extern int trace_is_on;
+
+/*
+Starts recording, to be written to FileName when the program exits.
+Returns false, having recorded nothing, if FileName can't be written.
+*/
+bool TraceStart( const char* FileName );
+
+/*
+A span on the calling thread that started at start_usec, a
+NowMicroseconds() time (CLOCK_MONOTONIC), and ends now.  arg_name, if not
+NULL, is shown with the span along with arg_value, such as the first row
+of a band of rows.  Spans may hold spans of their own.
+*/
+void TraceRecordSpan( const char* name, double start_usec,
+  const char* arg_name, long arg_value );
+
+inline void TraceSpan( const char* name, double start_usec,
+  const char* arg_name = 0, long arg_value = 0 ) {
+    if ( trace_is_on ) {
+        TraceRecordSpan(name, start_usec, arg_name, arg_value);
+    }
+}
+
+// For a span whose start and end are seen by different code
+void TraceBegin( const char* name, const char* arg_name, long arg_value );
+void TraceEnd();
+
+// What the trace viewer calls the calling thread, in place of its id
+void TraceThreadName( const char* name );
+
+#endif
@@ -21,7 +21,8 @@ my @programs = (
     {
         do_compile_and_test => 1,
         name => "bmpgrep",
-        num_tests => 10,
+        sources => "bmpgrep.cpp libbmpgrep.cpp bmpgrep_cache.cpp bmpgrep_shm.cpp bmpgrep_indexed.cpp bmpgrep_raw.cpp bmpgrep_perf.cpp bmpgrep_trace.cpp EasyBMP.cpp -lrt -lpthread",
+        num_tests => 31,
 
         test_1 => "0 10 0 0 0 test_images/big.bmp test_images/small.bmp",
         test_1_description => "return all matches of an exact matching scheme",
@@ -93,6 +94,195 @@ my @programs = (
             return 1 if $r =~ /^731,531,731,594,731,657,731,783(\r\n|\n)$/;
             return 0;
         },
+        test_11 => "--stats 0 10 0 0 0 test_images/big.bmp test_images/small.bmp 2>/dev/null",
+        test_11_description => "stats go to stderr and leave the results alone",
+        test_11_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385,105,685,105,910(\r\n|\n)$/;
+            return 0;
+        },
+        test_12 => "--serve-stdin < test_images/serve_queries.txt",
+        test_12_description => "one line of output per query, in order, including the empty ones",
+        test_12_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385,105,685,105,910\r?\n22,678\r?\n\r?\n731,531\r?\n$/;
+            return 0;
+        },
+        test_13 => "0 10 20 20 20 test_images/indexed_big.bmp test_images/indexed_small.bmp",
+        test_13_description => "8-bit images searched by palette index",
+        test_13_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^150,60,147,135,148,210(\r\n|\n)$/;
+            return 0;
+        },
+        test_14 => "0 10 20 20 20 raw:bgra:345x234:1444:test_images/raw_big.bgra test_images/raw_small.ppm",
+        test_14_description => "a raw BGRA framebuffer with padded rows, and a PPM",
+        test_14_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^150,60,147,135,148,210(\r\n|\n)$/;
+            return 0;
+        },
+        test_15 => "--scales 1,1.5,2 0 10 0 0 0 test_images/scaled_big.bmp test_images/small.bmp",
+        test_15_description => "one pass over several scales of the small image",
+        test_15_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^10,12,1,60,30,1.5(\r\n|\n)$/;
+            return 0;
+        },
+        test_16 => "--top 4 0 0 0 0 0 test_images/indexed_big.bmp test_images/raw_small.ppm",
+        test_16_description => "the closest positions by score, when nothing is an exact match",
+        test_16_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^150,60,13224,147,135,13224,148,210,13224,150,61,23082(\r\n|\n)$/;
+            return 0;
+        },
+        test_17 => "--max-mismatch 2 0 10 0 0 0 test_images/big.bmp test_images/small_damaged.bmp",
+        test_17_description => "a small image with a few damaged pixels still matches",
+        test_17_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385,105,685,105,910(\r\n|\n)$/;
+            return 0;
+        },
+        test_18 => "--simd scalar 0 10 1 1 1 test_images/big.bmp test_images/small.bmp",
+        test_18_description => "the same answer without any vector instructions",
+        test_18_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385,105,685,105,910(\r\n|\n)$/;
+            return 0;
+        },
+        test_19 => "0 0 0 0 0 test_images/mono_big.bmp test_images/mono_small.bmp",
+        test_19_description => "1-bit images searched as packed bits, with a small image over 64 pixels wide",
+        test_19_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^3,25,3,100,3,175(\r\n|\n)$/;
+            return 0;
+        },
+        test_20 => "0 0 0 0 0 test_images/rle_big.bmp test_images/rle_small.bmp",
+        test_20_description => "RLE8 big image searched run by run, with an RLE4 small image",
+        test_20_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^300,30,50,100,250,150(\r\n|\n)$/;
+            return 0;
+        },
+        test_21 => "--serve-stdin < test_images/serve_flat_queries.txt",
+        test_21_description => "a mostly flat big image searched a run at a time, with and without tolerances and a mismatch budget",
+        test_21_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^300,30,50,100,250,150\r?\n300,30,50,100,250,150\r?\n300,30,50,100,250,150,60,250\r?\n$/;
+            return 0;
+        },
+        test_22 => "--serve-stdin < test_images/serve_sum_queries.txt",
+        test_22_description => "queries with tolerances turned down by the sums of the big image's pixels, in one shared pass",
+        test_22_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^9,434\r?\n22,678\r?\n105,385,105,685,105,910\r?\n$/;
+            return 0;
+        },
+        test_23 => "--serve-stdin < test_images/serve_range_queries.txt",
+        test_23_description => "generous tolerances, where the range of each window of the big image turns positions down",
+        test_23_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^9,434\r?\n22,678\r?\n$/;
+            return 0;
+        },
+        test_24 => "--deadline-ms 0 0 10 0 0 0 test_images/big.bmp test_images/small.bmp",
+        test_24_description => "a search with no time at all gives up before the first row, and says so",
+        test_24_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^incomplete:0\/1007(\r\n|\n)$/;
+            return 0;
+        },
+        test_25 => "--deadline-ms 60000 0 10 0 0 0 test_images/big.bmp test_images/small.bmp",
+        test_25_description => "a search that finishes in time is printed as usual",
+        test_25_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385,105,685,105,910(\r\n|\n)$/;
+            return 0;
+        },
+        test_26 => "--shard 2/3 0 10 0 0 0 test_images/big.bmp test_images/small.bmp",
+        test_26_description => "the middle third of the positions, from only the rows of the big image that it needs",
+        test_26_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385(\r\n|\n)$/;
+            return 0;
+        },
+        test_27 => "--perf-counters 0 10 0 0 0 test_images/big.bmp test_images/small.bmp 2>&1 >/dev/null",
+        test_27_description => "the counters of each phase go to stderr, with the thread it ran on (-1 where a VM has none)",
+        test_27_coderef => sub {
+            my $r = shift;
+            return 0 unless $r =~ /^read_big_thread=\d+$/m;
+            return 0 unless $r =~ /^read_small_thread=\d+$/m;
+            return 0 unless $r =~ /^scan_cycles=-?\d+$/m;
+            return 1;
+        },
+        test_28 => "--trace /tmp/bmpgrep_trace_$$.json 0 10 0 0 0 test_images/big.bmp test_images/small.bmp; cat /tmp/bmpgrep_trace_$$.json; rm -f /tmp/bmpgrep_trace_$$.json",
+        test_28_description => "the matches are printed as usual, and the trace written to its file when bmpgrep exits",
+        test_28_coderef => sub {
+            my $r = shift;
+            return 0 unless $r =~ /^105,385,105,685,105,910(\r\n|\n)\{/;
+            return 0 unless $r =~ /"traceEvents"/;
+            return 0 unless $r =~ /"name":"scan"/;
+            return 0 unless $r =~ /"name":"thread_name"/;
+            return 1;
+        },
+        test_29 => "--explain 0 10 0 0 0 test_images/big.bmp test_images/small.bmp 2>&1 >/dev/null",
+        test_29_description => "the engine the planner chose, and its estimate for each engine, go to stderr",
+        test_29_coderef => sub {
+            my $r = shift;
+            return 0 unless $r =~ /^engine=(pixels|anchored|screened|runs)$/m;
+            for my $engine (qw(pixels anchored screened runs)) {
+                return 0 unless $r =~ /^${engine}_usec=-?\d+$/m;
+            }
+            return 1;
+        },
+        test_30 => "0 10 0 0 0 test_images/small.bmp test_images/big.bmp; echo exit=\$?",
+        test_30_description => "a small image wider than the big one has no positions, and is not an error",
+        test_30_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^exit=0(\r\n|\n)$/;
+            return 0;
+        },
+        test_31 => "--stats 0 10 0 0 0 test_images/big.bmp test_images/small.bmp 2>&1 >/dev/null",
+        test_31_description => "the stats that don't depend on timing, and a *_usec line for each phase",
+        test_31_coderef => sub {
+            my $r = shift;
+            for my $phase (qw(read_big read_small compile scan sum_table range_table choose_engine)) {
+                return 0 unless $r =~ /^${phase}_usec=\d+$/m;
+            }
+            return 0 unless $r =~ /^small_pattern_array_size=230$/m;
+            return 0 unless $r =~ /^positions_visited=1271841$/m;
+            return 0 unless $r =~ /^matches=3$/m;
+            return 0 unless $r =~ /^reject_depth=0:1271836,10:2,230:3$/m;
+            return 1;
+        },
+    },
+    {
+        do_compile_and_test => 1,
+        name => "bmpgrep_merge",
+        sources => "bmpgrep_merge.cpp",
+        num_tests => 3,
+
+        test_1 => "0 test_images/shard_3_of_3.txt test_images/shard_1_of_3.txt test_images/shard_2_of_3.txt",
+        test_1_description => "shards put back in raster order, whatever order they are given in",
+        test_1_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385,105,685,105,910(\r\n|\n)$/;
+            return 0;
+        },
+        test_2 => "2 test_images/shard_1_of_3.txt test_images/shard_2_of_3.txt test_images/shard_3_of_3.txt",
+        test_2_description => "only the first two matches of the whole image",
+        test_2_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385,105,685(\r\n|\n)$/;
+            return 0;
+        },
+        test_3 => "0 test_images/shard_1_of_3.txt test_images/shard_2_of_3.txt test_images/shard_3_of_3_late.txt",
+        test_3_description => "a shard that ran out of time makes the whole search incomplete",
+        test_3_coderef => sub {
+            my $r = shift;
+            return 1 if $r =~ /^105,385 incomplete:0\/336(\r\n|\n)$/;
+            return 0;
+        },
     },
 );
 
@@ -133,7 +323,7 @@ sub main {
               unlink($program->{name});
           }
           
-          system("g++ -o $program->{name} $program->{name}.cpp EasyBMP.cpp");
+          system("g++ -o $program->{name} $program->{sources}");
         
         }
 
@@ -0,0 +1,2211 @@
+/*****************************************************************************
+******************************************************************************
+
+libbmpgrep
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: See libbmpgrep.h
+
+******************************************************************************
+*****************************************************************************/
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Each vector kernel is compiled for its own instruction set with the
+// target attribute, and picked at run time.  See SetSimdLevel().
+#define LIBBMPGREP_X86_DISPATCH
+#include <immintrin.h>
+#endif
+#include "bmpgrep_trace.h"
+#include "libbmpgrep.h"
+using namespace std;
+
+static inline double Abs (double Nbr) {
+    if( Nbr >= 0 )
+        return Nbr;
+    else
+        return -Nbr;
+}
+
+int AllowedMismatches( const MatchOptions& options, int pattern_size ) {
+    int from_percent = (int) (options.max_mismatch_percent * pattern_size
+      / 100);
+    return options.max_mismatches > from_percent ? options.max_mismatches
+      : from_percent;
+}
+
+SimdLevel DetectSimdLevel() {
+#ifdef LIBBMPGREP_X86_DISPATCH
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx512f")
+      && __builtin_cpu_supports("avx512bw") ) {
+        return SIMD_AVX512;
+    }
+    if ( __builtin_cpu_supports("avx2") ) {
+        return SIMD_AVX2;
+    }
+    if ( __builtin_cpu_supports("sse2") ) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+static SimdLevel simd_level = DetectSimdLevel();
+
+void SetSimdLevel( SimdLevel level ) {
+    SimdLevel supported = DetectSimdLevel();
+    simd_level = level < supported ? level : supported;
+}
+
+SimdLevel GetSimdLevel() {
+    return simd_level;
+}
+
+const char* SimdLevelName( SimdLevel level ) {
+    switch ( level ) {
+        case SIMD_SSE2: return "sse2";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+double NowMicroseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+void ShardRows( int rows_to_search, int shard, int shard_count,
+  int& first_row, int& end_row ) {
+    rows_to_search = max(rows_to_search, 0);
+    if ( shard_count < 1 || shard < 0 || shard >= shard_count ) {
+        shard = 0;
+        shard_count = 1;
+    }
+    first_row = (int) ((long) rows_to_search * shard / shard_count);
+    end_row = (int) ((long) rows_to_search * (shard + 1) / shard_count);
+}
+
+void ReportProgress( const MatchOptions& options, int rows_searched,
+  int rows_to_search ) {
+    SearchProgress* progress = options.progress;
+    if ( progress ) {
+        progress->rows_to_search = max(rows_to_search, 0);
+        progress->rows_searched = min(rows_searched,
+          progress->rows_to_search);
+        progress->is_complete = progress->rows_searched
+          == progress->rows_to_search;
+    }
+}
+
+ImageView::ImageView() {
+    width = 0;
+    height = 0;
+    row_stride = 1;
+    column_step = 0;
+}
+
+ImageView::ImageView( BMP& Image ) {
+    width = Image.TellWidth();
+    height = Image.TellHeight();
+    row_stride = 1;
+    columns.resize(width);
+    for ( int x = 0; x < width; x++ ) {
+        columns[x] = Image(x, 0);
+    }
+    FindColumnStep();
+}
+
+ImageView::ImageView( const RGBApixel* pixels, int width, int height ) {
+    this->width = width;
+    this->height = height;
+    row_stride = 1;
+    columns.resize(width);
+    for ( int x = 0; x < width; x++ ) {
+        columns[x] = pixels + (long) x * height;
+    }
+    column_step = height;
+}
+
+ImageView ImageView::FromRows( const RGBApixel* pixels, int width,
+  int height, int row_stride ) {
+    ImageView view;
+    view.width = width;
+    view.height = height;
+    view.row_stride = row_stride;
+    view.columns.resize(width);
+    for ( int x = 0; x < width; x++ ) {
+        view.columns[x] = pixels + x;
+    }
+    view.column_step = 1;
+    return view;
+}
+
+void ImageView::FindColumnStep() {
+    column_step = width > 1 ? columns[1] - columns[0] : 1;
+    for ( int x = 2; x < width && column_step != 0; x++ ) {
+        if ( columns[x] - columns[x - 1] != column_step ) {
+            column_step = 0;
+        }
+    }
+}
+
+SearchStats::SearchStats() {
+    read_big_usec = 0;
+    read_small_usec = 0;
+    compile_usec = 0;
+    scan_usec = 0;
+    sum_table_usec = 0;
+    range_table_usec = 0;
+    choose_engine_usec = 0;
+    small_pattern_array_size = 0;
+    positions_visited = 0;
+    sum_rejects = 0;
+    range_rejects = 0;
+    matches = 0;
+}
+
+void SearchStats::Print( ostream& out ) const {
+    out << "read_big_usec=" << (long) read_big_usec << endl
+      << "read_small_usec=" << (long) read_small_usec << endl
+      << "compile_usec=" << (long) compile_usec << endl
+      << "scan_usec=" << (long) scan_usec << endl
+      << "sum_table_usec=" << (long) sum_table_usec << endl
+      << "range_table_usec=" << (long) range_table_usec << endl
+      << "choose_engine_usec=" << (long) choose_engine_usec << endl
+      << "small_pattern_array_size=" << small_pattern_array_size << endl
+      << "positions_visited=" << positions_visited << endl
+      << "sum_rejects=" << sum_rejects << endl
+      << "range_rejects=" << range_rejects << endl
+      << "matches=" << matches << endl
+      << "reject_depth=";
+    int has_written_bucket = 0;
+    for ( int depth = 0; depth < (int) reject_depth.size(); depth++ ) {
+        if ( reject_depth[depth] == 0 ) {
+            continue;
+        }
+        if ( has_written_bucket == 1 ) {
+            out << ",";
+        }
+        out << depth << ":" << reject_depth[depth];
+        has_written_bucket = 1;
+    }
+    out << endl;
+}
+
+SearchProgress::SearchProgress() {
+    is_complete = true;
+    rows_searched = 0;
+    rows_to_search = 0;
+}
+
+MatchOptions::MatchOptions() {
+    return_how_many_matches = 0;
+    tolerance_r = 0;
+    tolerance_g = 0;
+    tolerance_b = 0;
+    max_mismatches = 0;
+    max_mismatch_percent = 0;
+    stats = NULL;
+    runs = NULL;
+    sums = NULL;
+    ranges = NULL;
+    deadline_usec = 0;
+    progress = NULL;
+    shard = 0;
+    shard_count = 1;
+}
+
+RunTable::RunTable() {
+    width = 0;
+    height = 0;
+    row_starts.assign(1, 0);
+}
+
+
+/*
+Only a subset of the small image's pixels get checked.  Walking the small
+image in raster order, a pixel is added to the pattern when its brightness
+differs from the last pixel that was added by at least pattern_threshold.
+Runs of similar pixels are likely to match (or not) together, so checking
+one of them is nearly as good as checking all of them.
+*/
+Matcher::Matcher( const ImageView& Small, int pattern_threshold ) {
+    double phase_start = NowMicroseconds();
+
+    small_width = Small.Width();
+    small_height = Small.Height();
+
+    int last_pattern_pixel_brightness = -1;
+    for (int small_y = 0; small_y < small_height; small_y++) {
+        for (int small_x = 0; small_x < small_width; small_x++) {
+            const RGBApixel* SmallPixel = Small.Pixel(small_x, small_y);
+            int this_pixel_brightness = SmallPixel->Red
+              + SmallPixel->Green + SmallPixel->Blue;
+            if ( Abs( this_pixel_brightness - last_pattern_pixel_brightness )
+              >= pattern_threshold ) {
+                PatternPixel pattern_pixel;
+                pattern_pixel.x = small_x;
+                pattern_pixel.y = small_y;
+                pattern_pixel.red = SmallPixel->Red;
+                pattern_pixel.green = SmallPixel->Green;
+                pattern_pixel.blue = SmallPixel->Blue;
+                fast_pattern.push_back(pattern_pixel);
+
+                last_pattern_pixel_brightness = this_pixel_brightness;
+            }
+        }
+    }
+
+    FindWindow(Small);
+
+    compile_usec = NowMicroseconds() - phase_start;
+}
+
+// A smaller window hardly turns down more than its pixels would
+static const long MIN_SUM_WINDOW_PIXELS = 16;
+
+// Any more, and a SumTable's 32 bit sums could wrap
+static const long MAX_SUM_WINDOW_PIXELS = 0xffffffffL / 255;
+
+/*
+The largest rectangle of pattern pixels, found a row at a time as the
+largest rectangle under the histogram of how many pattern pixels are
+stacked up above each column of that row.
+*/
+void Matcher::FindWindow( const ImageView& Small ) {
+
+    window.x = 0;
+    window.y = 0;
+    window.width = 0;
+    window.height = 0;
+    window.red = 0;
+    window.green = 0;
+    window.blue = 0;
+    memset(&window.low, 0, sizeof(window.low));
+    memset(&window.high, 0, sizeof(window.high));
+
+    vector<char> in_pattern((long) small_width * small_height, 0);
+    for ( int index = 0; index < (int) fast_pattern.size(); index++ ) {
+        const PatternPixel& pixel = fast_pattern[index];
+        in_pattern[(long) pixel.y * small_width + pixel.x] = 1;
+    }
+
+    vector<int> heights(small_width + 1, 0);
+    vector<int> starts;
+    long best_area = 0;
+    for ( int small_y = 0; small_y < small_height; small_y++ ) {
+        for ( int small_x = 0; small_x < small_width; small_x++ ) {
+            if ( in_pattern[(long) small_y * small_width + small_x] ) {
+                heights[small_x]++;
+            }
+            else {
+                heights[small_x] = 0;
+            }
+        }
+
+        // The 0 at heights[small_width] closes off every rectangle
+        starts.clear();
+        for ( int small_x = 0; small_x <= small_width; small_x++ ) {
+            while ( !starts.empty()
+              && heights[starts.back()] >= heights[small_x] ) {
+                int height = heights[starts.back()];
+                starts.pop_back();
+                int left = starts.empty() ? 0 : starts.back() + 1;
+                int width = small_x - left;
+                if ( (long) width * height > best_area ) {
+                    best_area = (long) width * height;
+                    window.x = left;
+                    window.y = small_y - height + 1;
+                    window.width = width;
+                    window.height = height;
+                }
+            }
+            starts.push_back(small_x);
+        }
+    }
+
+    if ( best_area < MIN_SUM_WINDOW_PIXELS ) {
+        window.width = 0;
+        window.height = 0;
+        return;
+    }
+    if ( best_area > MAX_SUM_WINDOW_PIXELS ) {
+        window.height = (int) max(MAX_SUM_WINDOW_PIXELS / window.width, 1L);
+        window.width = (int) min((long) window.width, MAX_SUM_WINDOW_PIXELS);
+    }
+
+    window.low = *Small.Pixel(window.x, window.y);
+    window.high = window.low;
+    for ( int small_x = window.x; small_x < window.x + window.width;
+      small_x++ ) {
+        for ( int small_y = window.y; small_y < window.y + window.height;
+          small_y++ ) {
+            const RGBApixel* SmallPixel = Small.Pixel(small_x, small_y);
+            window.red += SmallPixel->Red;
+            window.green += SmallPixel->Green;
+            window.blue += SmallPixel->Blue;
+            window.low.Red = min(window.low.Red, SmallPixel->Red);
+            window.low.Green = min(window.low.Green, SmallPixel->Green);
+            window.low.Blue = min(window.low.Blue, SmallPixel->Blue);
+            window.high.Red = max(window.high.Red, SmallPixel->Red);
+            window.high.Green = max(window.high.Green, SmallPixel->Green);
+            window.high.Blue = max(window.high.Blue, SmallPixel->Blue);
+        }
+    }
+}
+
+static bool AppendMatch( const Match& match, void* user_data ) {
+    vector<Match>* matches = (vector<Match>*) user_data;
+    matches->push_back(match);
+    return true;
+}
+
+vector<Match> Matcher::Find( const ImageView& Big,
+  const MatchOptions& options ) const {
+    vector<Match> matches;
+    Find(Big, options, AppendMatch, &matches);
+    return matches;
+}
+
+static inline int HasTolerances( const MatchOptions& options ) {
+    if (options.tolerance_r > 0 || options.tolerance_g > 0
+      || options.tolerance_b > 0) {
+        return true;
+    }
+    return false;
+}
+
+static void StartStats( SearchStats* stats, const Matcher& matcher ) {
+    int small_pattern_array_size = (int) matcher.Pattern().size();
+    stats->compile_usec = matcher.CompileMicroseconds();
+    stats->small_pattern_array_size = small_pattern_array_size;
+    stats->positions_visited = 0;
+    stats->sum_rejects = 0;
+    stats->range_rejects = 0;
+    // One bucket per depth, plus a last one for the full matches
+    stats->reject_depth.assign(small_pattern_array_size + 1, 0);
+}
+
+int Matcher::MatchDepth( const ImageView& Big, int big_x, int big_y,
+  const MatchOptions& options, int has_tolerances ) const {
+
+    int small_pattern_array_size = (int) fast_pattern.size();
+    const PatternPixel* pattern = small_pattern_array_size > 0
+      ? &fast_pattern[0] : NULL;
+
+    if ( options.max_mismatches > 0 || options.max_mismatch_percent > 0 ) {
+        return MatchDepthWithMismatches(Big, big_x, big_y, options,
+          AllowedMismatches(options, small_pattern_array_size));
+    }
+
+    /*
+    This is declared here instead of inside the for loop because we
+    return it after the for loop is completed.
+    */
+    int small_pattern_index = 0;
+
+    for ( small_pattern_index = 0;
+        small_pattern_index < small_pattern_array_size;
+        small_pattern_index++ ) {
+
+        const PatternPixel& SmallPixel = pattern[small_pattern_index];
+        const RGBApixel* BigPixel = Big.Pixel(big_x + SmallPixel.x,
+          big_y + SmallPixel.y);
+
+        if ( has_tolerances == false ) {
+            // zero tolerance, so do it faster
+            if ( BigPixel->Red != SmallPixel.red ) {
+                break;
+            }
+            else if ( BigPixel->Green != SmallPixel.green ) {
+                break;
+            }
+            else if ( BigPixel->Blue != SmallPixel.blue ) {
+                break;
+            }
+        }
+        else {
+            if ( Abs(BigPixel->Red - SmallPixel.red )
+                > options.tolerance_r ) {
+                break;
+            }
+            else if ( Abs(BigPixel->Green - SmallPixel.green )
+                > options.tolerance_g ) {
+                break;
+            }
+            else if ( Abs(BigPixel->Blue - SmallPixel.blue )
+                > options.tolerance_b ) {
+                break;
+            }
+        }
+    }
+
+    return small_pattern_index;
+}
+
+/*
+Like MatchDepth, but keeps going until allowed_mismatches + 1 pixels have
+failed, rather than stopping at the first one.
+*/
+int Matcher::MatchDepthWithMismatches( const ImageView& Big, int big_x,
+  int big_y, const MatchOptions& options, int allowed_mismatches ) const {
+
+    int small_pattern_array_size = (int) fast_pattern.size();
+    int mismatches = 0;
+
+    for ( int small_pattern_index = 0;
+        small_pattern_index < small_pattern_array_size;
+        small_pattern_index++ ) {
+
+        const PatternPixel& SmallPixel = fast_pattern[small_pattern_index];
+        const RGBApixel* BigPixel = Big.Pixel(big_x + SmallPixel.x,
+          big_y + SmallPixel.y);
+
+        if ( Abs(BigPixel->Red - SmallPixel.red) > options.tolerance_r
+          || Abs(BigPixel->Green - SmallPixel.green) > options.tolerance_g
+          || Abs(BigPixel->Blue - SmallPixel.blue) > options.tolerance_b ) {
+            mismatches++;
+            if ( mismatches > allowed_mismatches ) {
+                return small_pattern_index;
+            }
+        }
+    }
+
+    return small_pattern_array_size;
+}
+
+/*
+The scan is written once, as templates, and instantiated for each way of
+comparing pixels and each way of finding them in the big image, so that
+the loops over the pattern have no decisions left in them.  PlanScan()
+picks the instantiation once per search.
+*/
+
+// One pattern pixel, made ready for a particular big image
+struct ScanPixel {
+    int x;
+    int y;
+    // From the position being tried, when the big image is StridedLayout
+    long offset;
+    // Red, green and blue where they sit in an RGBApixel, alpha zeroed
+    unsigned int color;
+    int red;
+    int green;
+    int blue;
+};
+
+static unsigned int PackColor( int red, int green, int blue ) {
+    RGBApixel pixel;
+    pixel.Red = (ebmpBYTE) red;
+    pixel.Green = (ebmpBYTE) green;
+    pixel.Blue = (ebmpBYTE) blue;
+    pixel.Alpha = 0;
+    unsigned int packed;
+    memcpy(&packed, &pixel, sizeof(packed));
+    return packed;
+}
+
+static const unsigned int COLOR_MASK = PackColor(255, 255, 255);
+
+static unsigned int PackPixel( const RGBApixel& pixel ) {
+    unsigned int packed;
+    memcpy(&packed, &pixel, sizeof(packed));
+    return packed;
+}
+
+// Zero tolerance: compare the three channels in one go
+struct ExactTest {
+    static inline bool Fails( const RGBApixel* BigPixel,
+      const ScanPixel& SmallPixel, const MatchOptions& ) {
+        unsigned int packed;
+        memcpy(&packed, BigPixel, sizeof(packed));
+        return (packed & COLOR_MASK) != SmallPixel.color;
+    }
+};
+
+struct ToleranceTest {
+    static inline bool Fails( const RGBApixel* BigPixel,
+      const ScanPixel& SmallPixel, const MatchOptions& options ) {
+        return abs(BigPixel->Red - SmallPixel.red) > options.tolerance_r
+          || abs(BigPixel->Green - SmallPixel.green) > options.tolerance_g
+          || abs(BigPixel->Blue - SmallPixel.blue) > options.tolerance_b;
+    }
+};
+
+// Any ImageView: go through its column table
+struct TableLayout {
+    static inline const RGBApixel* At( const ImageView& Big,
+      const RGBApixel*, int big_x, int big_y, const ScanPixel& SmallPixel ) {
+        return Big.Pixel(big_x + SmallPixel.x, big_y + SmallPixel.y);
+    }
+};
+
+// Evenly spaced columns (see ImageView::ColumnStep): one add per pixel
+struct StridedLayout {
+    static inline const RGBApixel* At( const ImageView&,
+      const RGBApixel* origin, int, int, const ScanPixel& SmallPixel ) {
+        return origin + SmallPixel.offset;
+    }
+};
+
+/*
+Sets bit i of the result when pixels[i] is within tolerances of color,
+for up to 64 pixels that are next to each other in memory.  tolerances
+has 255 for alpha, so that alpha never matters.
+*/
+typedef unsigned long long (*AnchorBitsFunction)( const RGBApixel* pixels,
+  int count, const RGBApixel& color, const RGBApixel& tolerances );
+
+static unsigned long long AnchorBitsScalar( const RGBApixel* pixels,
+  int count, const RGBApixel& color, const RGBApixel& tolerances ) {
+    unsigned long long bits = 0;
+    for ( int index = 0; index < count; index++ ) {
+        if ( abs(pixels[index].Red - color.Red) <= tolerances.Red
+          && abs(pixels[index].Green - color.Green) <= tolerances.Green
+          && abs(pixels[index].Blue - color.Blue) <= tolerances.Blue ) {
+            bits |= 1ULL << index;
+        }
+    }
+    return bits;
+}
+
+#ifdef LIBBMPGREP_X86_DISPATCH
+
+/*
+The vector versions take the difference of each byte both ways with
+saturating subtraction, so one of the two is the absolute difference and
+the other is 0.  A pixel is within tolerances when that, less the
+tolerance (again saturating), is 0 in all four bytes.
+*/
+__attribute__((target("sse2")))
+static unsigned long long AnchorBitsSSE2( const RGBApixel* pixels,
+  int count, const RGBApixel& color, const RGBApixel& tolerances ) {
+    const __m128i colors = _mm_set1_epi32(PackPixel(color));
+    const __m128i limits = _mm_set1_epi32(PackPixel(tolerances));
+    const __m128i zero = _mm_setzero_si128();
+    unsigned long long bits = 0;
+    int index = 0;
+    for ( ; index + 4 <= count; index += 4 ) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (pixels + index));
+        __m128i difference = _mm_or_si128(_mm_subs_epu8(block, colors),
+          _mm_subs_epu8(colors, block));
+        __m128i within = _mm_cmpeq_epi32(_mm_subs_epu8(difference, limits),
+          zero);
+        bits |= (unsigned long long) _mm_movemask_ps(_mm_castsi128_ps(within))
+          << index;
+    }
+    if ( index < count ) {
+        bits |= AnchorBitsScalar(pixels + index, count - index, color,
+          tolerances) << index;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2")))
+static unsigned long long AnchorBitsAVX2( const RGBApixel* pixels,
+  int count, const RGBApixel& color, const RGBApixel& tolerances ) {
+    const __m256i colors = _mm256_set1_epi32(PackPixel(color));
+    const __m256i limits = _mm256_set1_epi32(PackPixel(tolerances));
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned long long bits = 0;
+    int index = 0;
+    for ( ; index + 8 <= count; index += 8 ) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) (pixels + index));
+        __m256i difference = _mm256_or_si256(_mm256_subs_epu8(block, colors),
+          _mm256_subs_epu8(colors, block));
+        __m256i within = _mm256_cmpeq_epi32(
+          _mm256_subs_epu8(difference, limits), zero);
+        bits |= (unsigned long long) _mm256_movemask_ps(
+          _mm256_castsi256_ps(within)) << index;
+    }
+    if ( index < count ) {
+        bits |= AnchorBitsSSE2(pixels + index, count - index, color,
+          tolerances) << index;
+    }
+    return bits;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned long long AnchorBitsAVX512( const RGBApixel* pixels,
+  int count, const RGBApixel& color, const RGBApixel& tolerances ) {
+    const __m512i colors = _mm512_set1_epi32(PackPixel(color));
+    const __m512i limits = _mm512_set1_epi32(PackPixel(tolerances));
+    const __m512i zero = _mm512_setzero_si512();
+    unsigned long long bits = 0;
+    int index = 0;
+    for ( ; index + 16 <= count; index += 16 ) {
+        __m512i block = _mm512_loadu_si512((const void*) (pixels + index));
+        __m512i difference = _mm512_or_si512(_mm512_subs_epu8(block, colors),
+          _mm512_subs_epu8(colors, block));
+        __mmask16 within = _mm512_cmpeq_epi32_mask(
+          _mm512_subs_epu8(difference, limits), zero);
+        bits |= (unsigned long long) within << index;
+    }
+    if ( index < count ) {
+        bits |= AnchorBitsAVX2(pixels + index, count - index, color,
+          tolerances) << index;
+    }
+    return bits;
+}
+
+#endif
+
+static AnchorBitsFunction ChooseAnchorBits() {
+#ifdef LIBBMPGREP_X86_DISPATCH
+    switch ( GetSimdLevel() ) {
+        case SIMD_AVX512: return AnchorBitsAVX512;
+        case SIMD_AVX2: return AnchorBitsAVX2;
+        case SIMD_SSE2: return AnchorBitsSSE2;
+        default: break;
+    }
+#endif
+    return AnchorBitsScalar;
+}
+
+static inline int LowestBit( unsigned long long bits ) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    while ( !(bits & 1) ) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+struct ScanPlan;
+
+typedef int (*DepthFunction)( const ScanPlan& plan, const ImageView& Big,
+  int big_x, int big_y );
+
+typedef int (*ScanFunction)( const ScanPlan& plan, const ImageView& Big,
+  MatchCallback callback, void* user_data );
+
+struct ScanPlan {
+    std::vector<ScanPixel> pattern;
+    MatchOptions options;
+    SumWindow window;
+    // Whether options.sums or options.ranges is to be used
+    int screened;
+    int allowed_mismatches;
+    int max_x_to_check;
+    // The rows of positions of options' shard
+    int first_y_to_check;
+    int max_y_to_check;
+    DepthFunction depth;
+    ScanFunction scan;
+    AnchorBitsFunction anchor_bits;
+};
+
+/*
+Same answer as Matcher::MatchDepth, for the pattern pixels from first up
+to (but not including) last.  COUNT_MISMATCHES is only set when there is
+a mismatch budget, so the usual case stops at the first failure.
+*/
+template <class Layout, class Test, bool COUNT_MISMATCHES>
+static inline int PatternDepth( const ScanPlan& plan, const ImageView& Big,
+  int big_x, int big_y, int first, int last ) {
+
+    const ScanPixel* pattern = last > 0 ? &plan.pattern[0] : NULL;
+    const RGBApixel* origin = Big.Pixel(big_x, big_y);
+    int mismatches = 0;
+
+    for ( int small_pattern_index = first;
+        small_pattern_index < last;
+        small_pattern_index++ ) {
+        const ScanPixel& SmallPixel = pattern[small_pattern_index];
+        if ( Test::Fails(Layout::At(Big, origin, big_x, big_y, SmallPixel),
+          SmallPixel, plan.options) ) {
+            if ( !COUNT_MISMATCHES
+              || ++mismatches > plan.allowed_mismatches ) {
+                return small_pattern_index;
+            }
+        }
+    }
+
+    return last;
+}
+
+template <class Layout, class Test, bool COUNT_MISMATCHES>
+static inline int PlannedDepth( const ScanPlan& plan, const ImageView& Big,
+  int big_x, int big_y ) {
+    return PatternDepth<Layout, Test, COUNT_MISMATCHES>(plan, Big, big_x,
+      big_y, 0, (int) plan.pattern.size());
+}
+
+/*
+Whether the big image's pixels under the sum window at this position add
+up to more, or less, than they could if every one of them were within
+tolerance.  PlanScan() only leaves plan.options.sums set when there is
+no mismatch budget.
+*/
+static inline bool WindowFails( const ScanPlan& plan, int big_x, int big_y ) {
+    const SumWindow& window = plan.window;
+    long red, green, blue;
+    plan.options.sums->Sum(big_x + window.x, big_y + window.y, window.width,
+      window.height, red, green, blue);
+    long area = (long) window.width * window.height;
+    return labs(red - window.red) > plan.options.tolerance_r * area
+      || labs(green - window.green) > plan.options.tolerance_g * area
+      || labs(blue - window.blue) > plan.options.tolerance_b * area;
+}
+
+// Whether value is further than tolerance from target
+static inline bool OutOfTolerance( int value, int target, int tolerance ) {
+    return value > target + tolerance || value < target - tolerance;
+}
+
+/*
+Whether the range of the big image's pixels under the sum window at this
+position is too far from the small image's for every one of them to be
+within tolerance.
+*/
+static inline bool RangeFails( const ScanPlan& plan, int big_x, int big_y ) {
+    const SumWindow& window = plan.window;
+    const MatchOptions& options = plan.options;
+    const ColorRange& range = options.ranges->Range(big_x + window.x,
+      big_y + window.y);
+    return OutOfTolerance(range.low.Red, window.low.Red, options.tolerance_r)
+      || OutOfTolerance(range.high.Red, window.high.Red, options.tolerance_r)
+      || OutOfTolerance(range.low.Green, window.low.Green,
+        options.tolerance_g)
+      || OutOfTolerance(range.high.Green, window.high.Green,
+        options.tolerance_g)
+      || OutOfTolerance(range.low.Blue, window.low.Blue, options.tolerance_b)
+      || OutOfTolerance(range.high.Blue, window.high.Blue,
+        options.tolerance_b);
+}
+
+static const int SUM_CHECK_AFTER = 4;
+
+// What ScreenedDepth returns instead of a depth
+static const int SUMS_REJECTED = -1;
+static const int RANGE_REJECTED = -2;
+
+/*
+PlannedDepth, with the sum window checked once the first SUM_CHECK_AFTER
+pattern pixels have passed.  Most positions fail on one of those, and
+cost less that way than a look at the window would.  The range goes
+first, since it is one lookup to the sums' four.
+*/
+template <class Layout, class Test>
+static inline int ScreenedDepth( const ScanPlan& plan, const ImageView& Big,
+  int big_x, int big_y ) {
+    int small_pattern_array_size = (int) plan.pattern.size();
+    int checked = min(SUM_CHECK_AFTER, small_pattern_array_size);
+    int depth = PatternDepth<Layout, Test, false>(plan, Big, big_x, big_y,
+      0, checked);
+    if ( depth < checked ) {
+        return depth;
+    }
+    if ( plan.options.ranges && RangeFails(plan, big_x, big_y) ) {
+        return RANGE_REJECTED;
+    }
+    if ( plan.options.sums && WindowFails(plan, big_x, big_y) ) {
+        return SUMS_REJECTED;
+    }
+    return PatternDepth<Layout, Test, false>(plan, Big, big_x, big_y,
+      checked, small_pattern_array_size);
+}
+
+static inline void CountScreened( SearchStats* stats, int depth ) {
+    if ( depth == RANGE_REJECTED ) {
+        stats->range_rejects++;
+    }
+    else {
+        stats->sum_rejects++;
+    }
+}
+
+template <class Layout, class Test, bool COUNT_MISMATCHES>
+static int PlannedScan( const ScanPlan& plan, const ImageView& Big,
+  MatchCallback callback, void* user_data ) {
+
+    int small_pattern_array_size = (int) plan.pattern.size();
+    SearchStats* stats = plan.options.stats;
+
+    int has_matched_x_times = 0;
+    int keep_searching = true;
+    int searched_to_y = plan.max_y_to_check;
+
+    for (int big_y = plan.first_y_to_check;
+      big_y < plan.max_y_to_check && keep_searching; ++big_y) {
+        if ( PastDeadline(plan.options) ) {
+            searched_to_y = big_y;
+            break;
+        }
+        for (int big_x = 0; big_x < plan.max_x_to_check; ++big_x) {
+
+            int depth = !COUNT_MISMATCHES && plan.screened
+              ? ScreenedDepth<Layout, Test>(plan, Big, big_x, big_y)
+              : PlannedDepth<Layout, Test, COUNT_MISMATCHES>(plan, Big,
+                big_x, big_y);
+            if ( depth < 0 ) {
+                if ( stats ) {
+                    stats->positions_visited++;
+                    CountScreened(stats, depth);
+                }
+                continue;
+            }
+
+            if ( stats ) {
+                stats->positions_visited++;
+                stats->reject_depth[depth]++;
+            }
+
+            // There was a complete match!
+            if (depth == small_pattern_array_size) {
+                Match match;
+                match.x = big_x;
+                match.y = big_y;
+                has_matched_x_times++;
+
+                if ( !callback(match, user_data) || has_matched_x_times
+                  == plan.options.return_how_many_matches ) {
+                    keep_searching = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    ReportProgress(plan.options, searched_to_y - plan.first_y_to_check,
+      plan.max_y_to_check - plan.first_y_to_check);
+    return has_matched_x_times;
+}
+
+/*
+For the strided layouts where the first pattern pixels of neighbouring
+positions sit next to each other in memory: down a column of a decoded
+BMP, or along a row of a framebuffer.  A band of up to 64 rows of
+positions is first checked against the first pattern pixel with
+plan.anchor_bits, a vector at a time, and the rest of the pattern is
+only tried where that matched.  Matches still come out in raster order,
+and the stats come out as if every position had been visited.
+*/
+template <class Test>
+static int AnchoredScan( const ScanPlan& plan, const ImageView& Big,
+  MatchCallback callback, void* user_data ) {
+
+    int small_pattern_array_size = (int) plan.pattern.size();
+    SearchStats* stats = plan.options.stats;
+    const ScanPixel& anchor = plan.pattern[0];
+    long column_step = Big.ColumnStep();
+    int row_stride = Big.RowStride();
+    // Below 0 when the small image is wider than the big one
+    int max_x_to_check = max(plan.max_x_to_check, 0);
+    int first_y_to_check = plan.first_y_to_check;
+    int max_y_to_check = plan.max_y_to_check;
+
+    RGBApixel color;
+    color.Red = (ebmpBYTE) anchor.red;
+    color.Green = (ebmpBYTE) anchor.green;
+    color.Blue = (ebmpBYTE) anchor.blue;
+    color.Alpha = 0;
+    RGBApixel tolerances;
+    tolerances.Red = (ebmpBYTE) min(plan.options.tolerance_r, 255);
+    tolerances.Green = (ebmpBYTE) min(plan.options.tolerance_g, 255);
+    tolerances.Blue = (ebmpBYTE) min(plan.options.tolerance_b, 255);
+    tolerances.Alpha = 255;
+
+    int words_per_row = (max_x_to_check + 63) / 64;
+    vector<unsigned long long> band_bits(64 * (long) words_per_row);
+
+    long positions_visited = (long) max_x_to_check
+      * max(max_y_to_check - first_y_to_check, 0);
+    long positions_tried = 0;
+    int has_matched_x_times = 0;
+    int keep_searching = max_x_to_check > 0;
+    int searched_to_y = max_y_to_check;
+
+    for ( int band_y = first_y_to_check;
+      band_y < max_y_to_check && keep_searching; band_y += 64 ) {
+
+        if ( PastDeadline(plan.options) ) {
+            searched_to_y = band_y;
+            positions_visited = (long) (band_y - first_y_to_check)
+              * max_x_to_check;
+            break;
+        }
+        double band_start = trace_is_on ? NowMicroseconds() : 0;
+        int band_rows = min(64, max_y_to_check - band_y);
+        fill(band_bits.begin(), band_bits.end(), 0ULL);
+        const RGBApixel* band_origin = Big.Pixel(0, band_y) + anchor.offset;
+
+        if ( row_stride == 1 ) {
+            for ( int big_x = 0; big_x < max_x_to_check; big_x++ ) {
+                unsigned long long bits = plan.anchor_bits(band_origin
+                  + big_x * column_step, band_rows, color, tolerances);
+                while ( bits ) {
+                    band_bits[LowestBit(bits) * words_per_row + (big_x >> 6)]
+                      |= 1ULL << (big_x & 63);
+                    bits &= bits - 1;
+                }
+            }
+        }
+        else {
+            for ( int row = 0; row < band_rows; row++ ) {
+                for ( int word = 0; word < words_per_row; word++ ) {
+                    band_bits[row * words_per_row + word] = plan.anchor_bits(
+                      band_origin + (long) row * row_stride + word * 64,
+                      min(64, max_x_to_check - word * 64), color, tolerances);
+                }
+            }
+        }
+
+        for ( int row = 0; row < band_rows && keep_searching; row++ ) {
+            int big_y = band_y + row;
+            if ( row > 0 && PastDeadline(plan.options) ) {
+                searched_to_y = big_y;
+                positions_visited = (long) (big_y - first_y_to_check)
+                  * max_x_to_check;
+                keep_searching = false;
+                break;
+            }
+            for ( int word = 0; word < words_per_row && keep_searching;
+              word++ ) {
+                unsigned long long bits = band_bits[row * words_per_row + word];
+                while ( bits ) {
+                    int big_x = word * 64 + LowestBit(bits);
+                    bits &= bits - 1;
+
+                    positions_tried++;
+                    int depth = plan.screened
+                      ? ScreenedDepth<StridedLayout, Test>(plan, Big, big_x,
+                        big_y)
+                      : PlannedDepth<StridedLayout, Test, false>(plan, Big,
+                        big_x, big_y);
+                    if ( depth < 0 ) {
+                        if ( stats ) {
+                            CountScreened(stats, depth);
+                        }
+                        continue;
+                    }
+                    if ( stats ) {
+                        stats->reject_depth[depth]++;
+                    }
+
+                    // There was a complete match!
+                    if (depth == small_pattern_array_size) {
+                        Match match;
+                        match.x = big_x;
+                        match.y = big_y;
+                        has_matched_x_times++;
+
+                        if ( !callback(match, user_data) || has_matched_x_times
+                          == plan.options.return_how_many_matches ) {
+                            keep_searching = false;
+                            positions_visited = (long) (big_y
+                              - first_y_to_check) * max_x_to_check + big_x + 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        TraceSpan("band", band_start, "first_row", band_y);
+    }
+
+    if ( stats ) {
+        stats->positions_visited += positions_visited;
+        stats->reject_depth[0] += positions_visited - positions_tried;
+    }
+
+    ReportProgress(plan.options, searched_to_y - first_y_to_check,
+      max_y_to_check - first_y_to_check);
+    return has_matched_x_times;
+}
+
+/*
+Adds pixel to the end of run, unless that would spread it too far.  For
+a spread of 0 only the packed colors need comparing.
+*/
+static inline bool ExtendRun( ColorRun& run, const RGBApixel& pixel,
+  int spread ) {
+    if ( spread == 0 ) {
+        if ( (PackPixel(pixel) & COLOR_MASK)
+          != (PackPixel(run.low) & COLOR_MASK) ) {
+            return false;
+        }
+        run.length++;
+        return true;
+    }
+    int low_red = min(run.low.Red, pixel.Red);
+    int low_green = min(run.low.Green, pixel.Green);
+    int low_blue = min(run.low.Blue, pixel.Blue);
+    int high_red = max(run.high.Red, pixel.Red);
+    int high_green = max(run.high.Green, pixel.Green);
+    int high_blue = max(run.high.Blue, pixel.Blue);
+    if ( high_red - low_red > spread || high_green - low_green > spread
+      || high_blue - low_blue > spread ) {
+        return false;
+    }
+    run.low.Red = (ebmpBYTE) low_red;
+    run.low.Green = (ebmpBYTE) low_green;
+    run.low.Blue = (ebmpBYTE) low_blue;
+    run.high.Red = (ebmpBYTE) high_red;
+    run.high.Green = (ebmpBYTE) high_green;
+    run.high.Blue = (ebmpBYTE) high_blue;
+    run.length++;
+    return true;
+}
+
+static inline void StartRun( ColorRun& run, int x, const RGBApixel& pixel ) {
+    run.x = x;
+    run.length = 1;
+    run.low = pixel;
+    run.high = pixel;
+}
+
+/*
+Finds the runs of every row.  With WRITE, each run of row y is written
+to runs[next[y]], and next[y] is moved on; without it, next[y] just
+counts them.  When each column is contiguous, as in a decoded BMP, going
+along a row would touch a different cache line for every pixel, so the
+columns are walked instead, with every row's run kept open as we go.
+*/
+template <bool WRITE>
+static void WalkRuns( const ImageView& Image, int spread, vector<long>& next,
+  ColorRun* runs ) {
+
+    int width = Image.Width();
+    int height = Image.Height();
+    if ( width == 0 ) {
+        return;
+    }
+
+    if ( Image.RowStride() != 1 ) {
+        for ( int y = 0; y < height; y++ ) {
+            ColorRun run;
+            StartRun(run, 0, *Image.Pixel(0, y));
+            for ( int x = 1; x < width; x++ ) {
+                const RGBApixel& pixel = *Image.Pixel(x, y);
+                if ( !ExtendRun(run, pixel, spread) ) {
+                    if ( WRITE ) {
+                        runs[next[y]] = run;
+                    }
+                    next[y]++;
+                    StartRun(run, x, pixel);
+                }
+            }
+            if ( WRITE ) {
+                runs[next[y]] = run;
+            }
+            next[y]++;
+        }
+        return;
+    }
+
+    vector<ColorRun> open(height);
+    const RGBApixel* column = Image.Pixel(0, 0);
+    for ( int y = 0; y < height; y++ ) {
+        StartRun(open[y], 0, column[y]);
+    }
+    for ( int x = 1; x < width; x++ ) {
+        column = Image.Pixel(x, 0);
+        for ( int y = 0; y < height; y++ ) {
+            if ( !ExtendRun(open[y], column[y], spread) ) {
+                if ( WRITE ) {
+                    runs[next[y]] = open[y];
+                }
+                next[y]++;
+                StartRun(open[y], x, column[y]);
+            }
+        }
+    }
+    for ( int y = 0; y < height; y++ ) {
+        if ( WRITE ) {
+            runs[next[y]] = open[y];
+        }
+        next[y]++;
+    }
+}
+
+long RunTable::CountRuns( const ImageView& Image, int spread ) {
+    vector<long> counts(Image.Height(), 0);
+    WalkRuns<false>(Image, spread, counts, NULL);
+    long total = 0;
+    for ( int y = 0; y < Image.Height(); y++ ) {
+        total += counts[y];
+    }
+    return total;
+}
+
+RunTable::RunTable( const ImageView& Image, int spread ) {
+
+    width = Image.Width();
+    height = Image.Height();
+
+    // Count first, so that each row's runs can go straight into place
+    vector<long> next(height, 0);
+    WalkRuns<false>(Image, spread, next, NULL);
+    row_starts.resize(height + 1);
+    row_starts[0] = 0;
+    for ( int y = 0; y < height; y++ ) {
+        row_starts[y + 1] = row_starts[y] + next[y];
+        next[y] = row_starts[y];
+    }
+    runs.resize(row_starts[height]);
+    WalkRuns<true>(Image, spread, next, runs.empty() ? NULL : &runs[0]);
+}
+
+SumTable::SumTable() {
+    width = 0;
+    height = 0;
+    sums.resize(1);
+}
+
+/*
+The scan goes along the rows, so the corners are kept a row at a time,
+and each corner is the one above it plus the sum of its row so far.
+When each column is contiguous, as in a decoded BMP, a band of rows is
+filled in a column at a time, as in WalkRuns, so that the pixels are read
+in the order they sit in memory.
+*/
+SumTable::SumTable( const ImageView& Image ) {
+
+    width = Image.Width();
+    height = Image.Height();
+    long corners_per_row = width + 1;
+    sums.assign(corners_per_row * (height + 1), Sums());
+
+    int band_rows = Image.RowStride() == 1 ? 64 : 1;
+    vector<Sums> so_far(band_rows);
+    for ( int band_y = 0; band_y < height; band_y += band_rows ) {
+        int rows = min(band_rows, height - band_y);
+        fill(so_far.begin(), so_far.end(), Sums());
+        for ( int x = 0; x < width; x++ ) {
+            const RGBApixel* pixel = Image.Pixel(x, band_y);
+            Sums* corner = &sums[(band_y + 1) * corners_per_row + x + 1];
+            for ( int row = 0; row < rows; row++ ) {
+                so_far[row].red += pixel->Red;
+                so_far[row].green += pixel->Green;
+                so_far[row].blue += pixel->Blue;
+                const Sums& above = corner[-corners_per_row];
+                corner->red = above.red + so_far[row].red;
+                corner->green = above.green + so_far[row].green;
+                corner->blue = above.blue + so_far[row].blue;
+                pixel += Image.RowStride();
+                corner += corners_per_row;
+            }
+        }
+    }
+}
+
+RangeTable::RangeTable() {
+    positions_per_column = 0;
+    width = 0;
+    height = 0;
+    window_width = 0;
+    window_height = 0;
+}
+
+// Widens range to take in other
+static inline void Widen( ColorRange& range, const ColorRange& other ) {
+    range.low.Red = min(range.low.Red, other.low.Red);
+    range.low.Green = min(range.low.Green, other.low.Green);
+    range.low.Blue = min(range.low.Blue, other.low.Blue);
+    range.high.Red = max(range.high.Red, other.high.Red);
+    range.high.Green = max(range.high.Green, other.high.Green);
+    range.high.Blue = max(range.high.Blue, other.high.Blue);
+}
+
+/*
+van Herk/Gil-Werman: the ranges of every window of count ranges, window
+at a time, in count - window + 1 outputs.  The input is cut into blocks
+of window ranges.  A window that starts partway into a block ends partway
+into the next one, so it is the range from its start to the end of its
+block (worked out backwards, into suffix) widened by the range from the
+start of the next block to its end (worked out forwards as we go).
+*/
+static void SlideRanges( const ColorRange* input, int count, int window,
+  ColorRange* output, ColorRange* suffix ) {
+
+    for ( int block = 0; block < count; block += window ) {
+        int last = min(block + window, count) - 1;
+        suffix[last] = input[last];
+        for ( int index = last - 1; index >= block; index-- ) {
+            suffix[index] = input[index];
+            Widen(suffix[index], suffix[index + 1]);
+        }
+    }
+
+    ColorRange prefix = ColorRange();
+    for ( int index = 0; index < count; index++ ) {
+        if ( index % window == 0 ) {
+            prefix = input[index];
+        }
+        else {
+            Widen(prefix, input[index]);
+        }
+        int start = index - window + 1;
+        if ( start >= 0 ) {
+            ColorRange& range = output[start];
+            range = suffix[start];
+            Widen(range, prefix);
+        }
+    }
+}
+
+/*
+Widens each of count ranges in into by the one beside it in from.  With
+SSE2 (unless SetSimdLevel() rules it out), two at a time: the low halves take the bytewise minimum, and the
+high halves the maximum.  Alpha is widened along with the rest, though
+nobody looks at it.
+*/
+static void WidenColumn( ColorRange* into, const ColorRange* from,
+  long count ) {
+    long index = 0;
+#ifdef __SSE2__
+    if ( simd_level >= SIMD_SSE2 ) {
+        const __m128i low_mask = _mm_set_epi32(0, -1, 0, -1);
+        for ( ; index + 2 <= count; index += 2 ) {
+            __m128i a = _mm_loadu_si128((const __m128i*) (into + index));
+            __m128i b = _mm_loadu_si128((const __m128i*) (from + index));
+            __m128i widened = _mm_or_si128(
+              _mm_and_si128(low_mask, _mm_min_epu8(a, b)),
+              _mm_andnot_si128(low_mask, _mm_max_epu8(a, b)));
+            _mm_storeu_si128((__m128i*) (into + index), widened);
+        }
+    }
+#endif
+    for ( ; index < count; index++ ) {
+        Widen(into[index], from[index]);
+    }
+}
+
+/*
+Down the columns first, since in a decoded BMP those are contiguous.
+Then along the rows, but a whole column of positions at a time, so that
+that is contiguous too.  That goes a block of window_width columns at a
+time: the block's column ranges are worked out, then its suffixes,
+backwards and straight into the table, and then its prefixes, forwards,
+each widened into the window that ends on it.
+*/
+RangeTable::RangeTable( const ImageView& Image, int window_width,
+  int window_height ) {
+
+    width = Image.Width();
+    height = Image.Height();
+    this->window_width = window_width;
+    this->window_height = window_height;
+    positions_per_column = max(height - window_height + 1, 0);
+    int columns = max(width - window_width + 1, 0);
+    if ( window_width <= 0 || window_height <= 0 || columns == 0
+      || positions_per_column == 0 ) {
+        positions_per_column = 0;
+        return;
+    }
+
+    ranges.resize((long) columns * positions_per_column);
+    vector<ColorRange> column(height);
+    vector<ColorRange> suffix(height);
+    vector<ColorRange> block_ranges((long) window_width
+      * positions_per_column);
+    vector<ColorRange> running(positions_per_column);
+
+    for ( int block = 0; block < width; block += window_width ) {
+        int block_width = min(window_width, width - block);
+
+        for ( int offset = 0; offset < block_width; offset++ ) {
+            for ( int y = 0; y < height; y++ ) {
+                column[y].low = *Image.Pixel(block + offset, y);
+                column[y].high = column[y].low;
+            }
+            SlideRanges(&column[0], height, window_height,
+              &block_ranges[offset * positions_per_column], &suffix[0]);
+        }
+
+        for ( int offset = block_width - 1; offset >= 0; offset-- ) {
+            const ColorRange* down = &block_ranges[offset
+              * positions_per_column];
+            if ( offset == block_width - 1 ) {
+                copy(down, down + positions_per_column, running.begin());
+            }
+            else {
+                WidenColumn(&running[0], down, positions_per_column);
+            }
+            if ( block + offset < columns ) {
+                copy(running.begin(), running.end(), ranges.begin()
+                  + (block + offset) * positions_per_column);
+            }
+        }
+
+        for ( int offset = 0; offset < block_width; offset++ ) {
+            const ColorRange* down = &block_ranges[offset
+              * positions_per_column];
+            if ( offset == 0 ) {
+                copy(down, down + positions_per_column, running.begin());
+            }
+            else {
+                WidenColumn(&running[0], down, positions_per_column);
+            }
+            int start = block + offset - window_width + 1;
+            if ( start >= 0 ) {
+                WidenColumn(&ranges[start * positions_per_column],
+                  &running[0], positions_per_column);
+            }
+        }
+    }
+}
+
+// Whether no pixel of the run can be within tolerance of pixel
+static inline bool RunFails( const ColorRun& run, const ScanPixel& pixel,
+  const MatchOptions& options ) {
+    return pixel.red + options.tolerance_r < run.low.Red
+      || pixel.red - options.tolerance_r > run.high.Red
+      || pixel.green + options.tolerance_g < run.low.Green
+      || pixel.green - options.tolerance_g > run.high.Green
+      || pixel.blue + options.tolerance_b < run.low.Blue
+      || pixel.blue - options.tolerance_b > run.high.Blue;
+}
+
+/*
+Walks the runs of options.runs under the first pattern pixel, a row of
+positions at a time.  A run that pixel can't match turns down all of the
+positions over it at once, and the positions over the other runs are
+tried one by one as usual.  As with AnchoredScan, the stats come out as
+if every position had been visited.
+*/
+template <class Layout, class Test>
+static int RunScan( const ScanPlan& plan, const ImageView& Big,
+  MatchCallback callback, void* user_data ) {
+
+    int small_pattern_array_size = (int) plan.pattern.size();
+    SearchStats* stats = plan.options.stats;
+    const RunTable& table = *plan.options.runs;
+    const ScanPixel& anchor = plan.pattern[0];
+    int max_x_to_check = plan.max_x_to_check;
+
+    int has_matched_x_times = 0;
+    int keep_searching = max_x_to_check > 0;
+    int searched_to_y = plan.max_y_to_check;
+
+    for ( int big_y = plan.first_y_to_check;
+      big_y < plan.max_y_to_check && keep_searching; big_y++ ) {
+
+        if ( PastDeadline(plan.options) ) {
+            searched_to_y = big_y;
+            break;
+        }
+        const ColorRun* runs = table.Runs(big_y + anchor.y);
+        int number_of_runs = table.NumberOfRuns(big_y + anchor.y);
+
+        for ( int run = 0; run < number_of_runs && keep_searching; run++ ) {
+
+            int start_x = max(runs[run].x - anchor.x, 0);
+            int end_x = min(runs[run].x + runs[run].length - anchor.x,
+              max_x_to_check);
+            if ( start_x >= end_x ) {
+                continue;
+            }
+            if ( RunFails(runs[run], anchor, plan.options) ) {
+                if ( stats ) {
+                    stats->positions_visited += end_x - start_x;
+                    stats->reject_depth[0] += end_x - start_x;
+                }
+                continue;
+            }
+
+            for ( int big_x = start_x; big_x < end_x; big_x++ ) {
+
+                int depth = plan.screened
+                  ? ScreenedDepth<Layout, Test>(plan, Big, big_x, big_y)
+                  : PlannedDepth<Layout, Test, false>(plan, Big, big_x, big_y);
+                if ( depth < 0 ) {
+                    if ( stats ) {
+                        stats->positions_visited++;
+                        CountScreened(stats, depth);
+                    }
+                    continue;
+                }
+
+                if ( stats ) {
+                    stats->positions_visited++;
+                    stats->reject_depth[depth]++;
+                }
+
+                // There was a complete match!
+                if (depth == small_pattern_array_size) {
+                    Match match;
+                    match.x = big_x;
+                    match.y = big_y;
+                    has_matched_x_times++;
+
+                    if ( !callback(match, user_data) || has_matched_x_times
+                      == plan.options.return_how_many_matches ) {
+                        keep_searching = false;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    ReportProgress(plan.options, searched_to_y - plan.first_y_to_check,
+      plan.max_y_to_check - plan.first_y_to_check);
+    return has_matched_x_times;
+}
+
+template <class Layout>
+static void UseRunScan( ScanPlan& plan ) {
+    if ( HasTolerances(plan.options) ) {
+        plan.scan = RunScan<Layout, ToleranceTest>;
+    }
+    else {
+        plan.scan = RunScan<Layout, ExactTest>;
+    }
+}
+
+template <class Layout, class Test, bool COUNT_MISMATCHES>
+static void UseKernel( ScanPlan& plan ) {
+    plan.depth = PlannedDepth<Layout, Test, COUNT_MISMATCHES>;
+    plan.scan = PlannedScan<Layout, Test, COUNT_MISMATCHES>;
+}
+
+template <class Layout>
+static void ChooseTest( ScanPlan& plan ) {
+    int count_mismatches = plan.allowed_mismatches > 0;
+    if ( HasTolerances(plan.options) ) {
+        if ( count_mismatches ) {
+            UseKernel<Layout, ToleranceTest, true>(plan);
+        }
+        else {
+            UseKernel<Layout, ToleranceTest, false>(plan);
+        }
+    }
+    else {
+        if ( count_mismatches ) {
+            UseKernel<Layout, ExactTest, true>(plan);
+        }
+        else {
+            UseKernel<Layout, ExactTest, false>(plan);
+        }
+    }
+}
+
+/*
+Whether AnchoredScan can search Big with plan.  The first pattern pixels
+of neighbouring positions have to sit next to each other in memory.
+*/
+static bool CanAnchor( const ScanPlan& plan, const ImageView& Big ) {
+    long column_step = Big.ColumnStep();
+    return column_step != 0 && plan.allowed_mismatches == 0
+      && !plan.pattern.empty()
+      && (Big.RowStride() == 1 || column_step == 1);
+}
+
+static void PlanScan( const Matcher& matcher, const ImageView& Big,
+  const MatchOptions& options, ScanPlan& plan ) {
+
+    const vector<PatternPixel>& pattern = matcher.Pattern();
+    long column_step = Big.ColumnStep();
+
+    plan.options = options;
+    plan.allowed_mismatches = AllowedMismatches(options, (int) pattern.size());
+
+    /*
+    You don't need to check the whole big image.
+    For example, if the small image is 100 pixels wide, then you
+    know that there's no way it could match in the 99 right-most
+    pixels of the big image.  The same idea is applicable for the height.
+    */
+    plan.max_x_to_check = Big.Width() - matcher.Width();
+    ShardRows(Big.Height() - matcher.Height(), options.shard,
+      options.shard_count, plan.first_y_to_check, plan.max_y_to_check);
+
+    plan.pattern.resize(pattern.size());
+    for ( int index = 0; index < (int) pattern.size(); index++ ) {
+        const PatternPixel& SmallPixel = pattern[index];
+        ScanPixel& pixel = plan.pattern[index];
+        pixel.x = SmallPixel.x;
+        pixel.y = SmallPixel.y;
+        pixel.offset = SmallPixel.x * column_step
+          + (long) SmallPixel.y * Big.RowStride();
+        pixel.color = PackColor(SmallPixel.red, SmallPixel.green,
+          SmallPixel.blue);
+        pixel.red = SmallPixel.red;
+        pixel.green = SmallPixel.green;
+        pixel.blue = SmallPixel.blue;
+    }
+
+    if ( column_step != 0 ) {
+        ChooseTest<StridedLayout>(plan);
+    }
+    else {
+        ChooseTest<TableLayout>(plan);
+    }
+
+    plan.anchor_bits = ChooseAnchorBits();
+    if ( CanAnchor(plan, Big) ) {
+        if ( HasTolerances(options) ) {
+            plan.scan = AnchoredScan<ToleranceTest>;
+        }
+        else {
+            plan.scan = AnchoredScan<ExactTest>;
+        }
+    }
+
+    /*
+    The sum window is only sure to be within tolerance when every pattern
+    pixel has to be, and without tolerances the first pattern pixel
+    already turns down nearly everything the window would.
+    */
+    plan.window = matcher.Window();
+    int can_screen = plan.window.width > 0 && plan.allowed_mismatches == 0
+      && HasTolerances(options);
+    const SumTable* sums = options.sums;
+    if ( !can_screen || !sums || sums->Width() != Big.Width()
+      || sums->Height() != Big.Height() ) {
+        plan.options.sums = NULL;
+    }
+    const RangeTable* ranges = options.ranges;
+    if ( !can_screen || !ranges || ranges->Width() != Big.Width()
+      || ranges->Height() != Big.Height()
+      || ranges->WindowWidth() != plan.window.width
+      || ranges->WindowHeight() != plan.window.height ) {
+        plan.options.ranges = NULL;
+    }
+    plan.screened = plan.options.sums || plan.options.ranges;
+    if ( plan.screened ) {
+        if ( column_step != 0 ) {
+            plan.depth = ScreenedDepth<StridedLayout, ToleranceTest>;
+        }
+        else {
+            plan.depth = ScreenedDepth<TableLayout, ToleranceTest>;
+        }
+    }
+
+    const RunTable* runs = options.runs;
+    if ( runs && runs->Width() == Big.Width() && runs->Height() == Big.Height()
+      && plan.allowed_mismatches == 0 && !pattern.empty() ) {
+        if ( column_step != 0 ) {
+            UseRunScan<StridedLayout>(plan);
+        }
+        else {
+            UseRunScan<TableLayout>(plan);
+        }
+    }
+}
+
+int Matcher::Find( const ImageView& Big, const MatchOptions& options,
+  MatchCallback callback, void* user_data ) const {
+
+    double phase_start = NowMicroseconds();
+
+    SearchStats* stats = options.stats;
+    if ( stats ) {
+        StartStats(stats, *this);
+    }
+
+    ScanPlan plan;
+    PlanScan(*this, Big, options, plan);
+    TraceSpan("plan", phase_start);
+    int has_matched_x_times = plan.scan(plan, Big, callback, user_data);
+
+    if ( stats ) {
+        stats->scan_usec = NowMicroseconds() - phase_start;
+        stats->matches = has_matched_x_times;
+    }
+
+    return has_matched_x_times;
+}
+
+/*
+What ChooseEngine() expects things to cost, in nanoseconds, as measured
+on random and blocky 4000x3000 BMPs.  The first pattern pixel costs
+ANCHOR_NS a position, a vector at a time.  A position whose first pixel
+matched costs TRY_NS more to go and look at the rest of it, mostly in
+cache misses, and then PATTERN_PIXEL_NS for each further pixel.  The
+pixels engine costs PIXELS_NS a position instead of the first two.  A
+position that gets as far as the tables costs SCREEN_NS to check against
+them, which is mostly cache misses as well.  The tables cost their
+*_TABLE_NS for each pixel of the big image to build.
+*/
+static const double ANCHOR_NS = 2.0;
+static const double ANCHOR_TOLERANCE_NS = 3.5;
+static const double PIXELS_NS = 6.0;
+static const double PIXELS_TOLERANCE_NS = 45.0;
+static const double TRY_NS = 50.0;
+static const double PATTERN_PIXEL_NS = 3.5;
+static const double SCREEN_NS = 100.0;
+static const double RUN_NS = 8.0;
+static const double RUN_TABLE_NS = 6.5;
+static const double SUM_TABLE_NS = 28.0;
+static const double RANGE_TABLE_NS = 34.0;
+
+/*
+The sample is one position in SAMPLE_SHARE, but no fewer than
+MIN_SAMPLE_POSITIONS, from up to SAMPLE_ROWS rows, so that it stays a
+sliver of the search it is planning.
+*/
+static const int SAMPLE_SHARE = 4096;
+static const int MIN_SAMPLE_POSITIONS = 256;
+static const int SAMPLE_ROWS = 16;
+
+/*
+Each screen sample adds up a whole sum window, at about a nanosecond a
+pixel, so between them they get a hundredth of the time the search
+without tables is expected to take.
+*/
+static const int MIN_SCREEN_SAMPLES = 8;
+static const int MAX_SCREEN_SAMPLES = 64;
+
+const char* SearchEngineName( SearchEngine engine ) {
+    switch ( engine ) {
+        case ENGINE_PIXELS:
+            return "pixels";
+        case ENGINE_ANCHORED:
+            return "anchored";
+        case ENGINE_SCREENED:
+            return "screened";
+        default:
+            return "runs";
+    }
+}
+
+EngineChoice::EngineChoice() {
+    engine = ENGINE_PIXELS;
+    for ( int index = 0; index < NUMBER_OF_ENGINES; index++ ) {
+        estimated_usec[index] = -1;
+    }
+    positions = 0;
+    sampled_rows = 0;
+    anchor_pass_rate = 0;
+    pixels_per_position = 0;
+    screen_reject_rate = 0;
+    pixels_per_run = 0;
+}
+
+void EngineChoice::Print( ostream& out ) const {
+    out << "engine=" << SearchEngineName(engine) << endl;
+    for ( int index = 0; index < NUMBER_OF_ENGINES; index++ ) {
+        out << SearchEngineName((SearchEngine) index) << "_usec="
+          << (long) estimated_usec[index] << endl;
+    }
+    out << "positions=" << positions << endl
+      << "sampled_rows=" << sampled_rows << endl
+      << "anchor_pass_rate=" << anchor_pass_rate << endl
+      << "pixels_per_position=" << pixels_per_position << endl
+      << "screen_reject_rate=" << screen_reject_rate << endl
+      << "pixels_per_run=" << pixels_per_run << endl;
+}
+
+/*
+The same test as RangeFails() and WindowFails(), adding up the big
+image's pixels under the window instead of looking them up in tables
+that haven't been built.
+*/
+static bool WindowWouldFail( const ImageView& Big, const SumWindow& window,
+  const MatchOptions& options, int big_x, int big_y ) {
+    long red = 0, green = 0, blue = 0;
+    RGBApixel low = *Big.Pixel(big_x + window.x, big_y + window.y);
+    RGBApixel high = low;
+    for ( int y = 0; y < window.height; y++ ) {
+        for ( int x = 0; x < window.width; x++ ) {
+            const RGBApixel& pixel = *Big.Pixel(big_x + window.x + x,
+              big_y + window.y + y);
+            red += pixel.Red;
+            green += pixel.Green;
+            blue += pixel.Blue;
+            low.Red = min(low.Red, pixel.Red);
+            low.Green = min(low.Green, pixel.Green);
+            low.Blue = min(low.Blue, pixel.Blue);
+            high.Red = max(high.Red, pixel.Red);
+            high.Green = max(high.Green, pixel.Green);
+            high.Blue = max(high.Blue, pixel.Blue);
+        }
+    }
+    long area = (long) window.width * window.height;
+    return OutOfTolerance(low.Red, window.low.Red, options.tolerance_r)
+      || OutOfTolerance(high.Red, window.high.Red, options.tolerance_r)
+      || OutOfTolerance(low.Green, window.low.Green, options.tolerance_g)
+      || OutOfTolerance(high.Green, window.high.Green, options.tolerance_g)
+      || OutOfTolerance(low.Blue, window.low.Blue, options.tolerance_b)
+      || OutOfTolerance(high.Blue, window.high.Blue, options.tolerance_b)
+      || labs(red - window.red) > options.tolerance_r * area
+      || labs(green - window.green) > options.tolerance_g * area
+      || labs(blue - window.blue) > options.tolerance_b * area;
+}
+
+// Whether a run of exactly one color starts at x,y
+static bool StartsRun( const ImageView& Image, int x, int y ) {
+    return x == 0 || (PackPixel(*Image.Pixel(x, y)) & COLOR_MASK)
+      != (PackPixel(*Image.Pixel(x - 1, y)) & COLOR_MASK);
+}
+
+EngineChoice ChooseEngine( const Matcher& matcher, const ImageView& Big,
+  const MatchOptions& options ) {
+
+    EngineChoice choice;
+
+    // The plan that Find() would make without any tables
+    MatchOptions plain_options = options;
+    plain_options.runs = NULL;
+    plain_options.sums = NULL;
+    plain_options.ranges = NULL;
+    ScanPlan plan;
+    PlanScan(matcher, Big, plain_options, plan);
+
+    int pattern_size = (int) plan.pattern.size();
+    int has_tolerances = HasTolerances(options);
+    int can_anchor = CanAnchor(plan, Big);
+    int rows = max(plan.max_y_to_check - plan.first_y_to_check, 0);
+    int columns = max(plan.max_x_to_check, 0);
+    choice.positions = (long) rows * columns;
+    choice.engine = can_anchor ? ENGINE_ANCHORED : ENGINE_PIXELS;
+    if ( choice.positions == 0 || pattern_size == 0 ) {
+        choice.estimated_usec[choice.engine] = 0;
+        return choice;
+    }
+
+    double image_pixels = (double) Big.Width() * Big.Height();
+    double per_position = can_anchor
+      ? (has_tolerances ? ANCHOR_TOLERANCE_NS : ANCHOR_NS)
+      : (has_tolerances ? PIXELS_TOLERANCE_NS : PIXELS_NS);
+
+    /*
+    The tables cover the whole big image, while a shard only searches
+    its own strip of it, and may only have decoded that much.  RunScan,
+    like Find() with a RunTable, needs the plain test.
+    */
+    const SumWindow& window = matcher.Window();
+    int can_build_tables = options.shard_count <= 1
+      && plan.allowed_mismatches == 0;
+    int can_screen = can_build_tables && window.width > 0 && has_tolerances;
+    // Even with no runs to check, building the RunTable has to pay
+    int is_run_sampled = can_build_tables
+      && image_pixels * RUN_TABLE_NS < choice.positions * per_position;
+
+    /*
+    Try the pattern at positions spread evenly over a few rows spread
+    evenly over the search, as the plain scan would, and keep the ones
+    that got far enough to be checked against the tables.  Where the
+    first pattern pixel lands, count how often a new run starts.
+    */
+    int screen_after = min(SUM_CHECK_AFTER, pattern_size);
+    long anchor_passes = 0;
+    long pixels_checked = 0;
+    long run_starts = 0;
+    vector<Match> screenable;
+    choice.sampled_rows = min(SAMPLE_ROWS, rows);
+    long wanted = max(choice.positions / SAMPLE_SHARE,
+      (long) MIN_SAMPLE_POSITIONS);
+    int sampled_columns = (int) min((long) columns,
+      max(wanted / choice.sampled_rows, 1L));
+    for ( int row = 0; row < choice.sampled_rows; row++ ) {
+        int big_y = plan.first_y_to_check
+          + (int) ((long) rows * (2 * row + 1) / (2 * choice.sampled_rows));
+        for ( int column = 0; column < sampled_columns; column++ ) {
+            int big_x = (int) ((long) columns * (2 * column + 1)
+              / (2 * sampled_columns));
+            int depth = plan.depth(plan, Big, big_x, big_y);
+            anchor_passes += depth > 0;
+            pixels_checked += min(depth + 1, pattern_size);
+            if ( depth >= screen_after ) {
+                Match match;
+                match.x = big_x;
+                match.y = big_y;
+                screenable.push_back(match);
+            }
+            if ( is_run_sampled ) {
+                run_starts += StartsRun(Big, big_x + plan.pattern[0].x,
+                  big_y + plan.pattern[0].y);
+            }
+        }
+    }
+    long sampled = (long) choice.sampled_rows * sampled_columns;
+    choice.anchor_pass_rate = (double) anchor_passes / sampled;
+    choice.pixels_per_position = (double) pixels_checked / sampled;
+    if ( is_run_sampled ) {
+        choice.pixels_per_run = (double) sampled / max(run_starts, 1L);
+    }
+
+    // Scaled up from the sample to the whole search, in nanoseconds
+    double scale = (double) choice.positions / sampled;
+    double tries = anchor_passes * scale;
+    double further_pixels = (pixels_checked - sampled) * scale;
+    double base_ns = choice.positions * per_position
+      + (can_anchor ? tries * TRY_NS : 0)
+      + further_pixels * PATTERN_PIXEL_NS;
+    choice.estimated_usec[choice.engine] = base_ns / 1000;
+
+    // Not worth sampling if building the tables costs more than that
+    long screened_pixels_saved = 0;
+    int screen_samples = 0;
+    if ( can_screen
+      && image_pixels * (SUM_TABLE_NS + RANGE_TABLE_NS) < base_ns ) {
+        double window_pixels = (double) window.width * window.height;
+        screen_samples = (int) min((double) MAX_SCREEN_SAMPLES,
+          max((double) MIN_SCREEN_SAMPLES, base_ns / 100 / window_pixels));
+        screen_samples = min(screen_samples, (int) screenable.size());
+    }
+    if ( screen_samples > 0 ) {
+        int rejects = 0;
+        for ( int sample = 0; sample < screen_samples; sample++ ) {
+            const Match& position = screenable[(long) screenable.size()
+              * sample / screen_samples];
+            if ( WindowWouldFail(Big, window, options, position.x,
+              position.y) ) {
+                rejects++;
+                // The tables save the pixels after the first few
+                screened_pixels_saved += min(plan.depth(plan, Big,
+                  position.x, position.y) + 1, pattern_size) - screen_after;
+            }
+        }
+        choice.screen_reject_rate = (double) rejects / screen_samples;
+    }
+
+    if ( can_screen ) {
+        double screened_ns = base_ns
+          + image_pixels * (SUM_TABLE_NS + RANGE_TABLE_NS)
+          + screenable.size() * scale * SCREEN_NS;
+        if ( screen_samples > 0 ) {
+            screened_ns -= (double) screened_pixels_saved / screen_samples
+              * screenable.size() * scale * PATTERN_PIXEL_NS;
+        }
+        choice.estimated_usec[ENGINE_SCREENED] = screened_ns / 1000;
+    }
+
+    if ( can_build_tables ) {
+        double runs_ns = image_pixels * RUN_TABLE_NS
+          + tries * TRY_NS + further_pixels * PATTERN_PIXEL_NS;
+        if ( is_run_sampled ) {
+            runs_ns += choice.positions / choice.pixels_per_run * RUN_NS;
+        }
+        choice.estimated_usec[ENGINE_RUNS] = runs_ns / 1000;
+    }
+
+    for ( int index = 0; index < NUMBER_OF_ENGINES; index++ ) {
+        if ( choice.estimated_usec[index] >= 0 && choice.estimated_usec[index]
+          < choice.estimated_usec[choice.engine] ) {
+            choice.engine = (SearchEngine) index;
+        }
+    }
+    return choice;
+}
+
+// Whether two jobs would accept exactly the same first pattern pixel
+static bool SameAnchor( const MatchJob& first, const MatchJob& second ) {
+    if ( first.matcher->Pattern().empty()
+      || second.matcher->Pattern().empty() ) {
+        return false;
+    }
+    const PatternPixel& a = first.matcher->Pattern()[0];
+    const PatternPixel& b = second.matcher->Pattern()[0];
+    return a.x == b.x && a.y == b.y && a.red == b.red && a.green == b.green
+      && a.blue == b.blue
+      && first.options.tolerance_r == second.options.tolerance_r
+      && first.options.tolerance_g == second.options.tolerance_g
+      && first.options.tolerance_b == second.options.tolerance_b
+      // With a mismatch budget, a failed first pixel doesn't end anything
+      && first.options.max_mismatches == 0
+      && first.options.max_mismatch_percent == 0
+      && second.options.max_mismatches == 0
+      && second.options.max_mismatch_percent == 0;
+}
+
+void FindMany( const ImageView& Big, vector<MatchJob>& jobs ) {
+
+    double phase_start = NowMicroseconds();
+
+    int job_count = (int) jobs.size();
+    vector<ScanPlan> plans(job_count);
+    vector<int> max_x_to_check(job_count);
+    vector<int> first_y_to_check(job_count);
+    vector<int> max_y_to_check(job_count);
+    vector<int> keep_searching(job_count);
+
+    int overall_first_y = INT_MAX;
+    int overall_max_y = 0;
+    int overall_max_x = 0;
+    for ( int job_index = 0; job_index < job_count; job_index++ ) {
+        MatchJob& job = jobs[job_index];
+        job.matches_found = 0;
+        PlanScan(*job.matcher, Big, job.options, plans[job_index]);
+        first_y_to_check[job_index] = plans[job_index].first_y_to_check;
+        max_y_to_check[job_index] = plans[job_index].max_y_to_check;
+        max_x_to_check[job_index] = plans[job_index].max_x_to_check;
+        keep_searching[job_index] = true;
+        if ( job.options.stats ) {
+            StartStats(job.options.stats, *job.matcher);
+        }
+        if ( first_y_to_check[job_index] < overall_first_y ) {
+            overall_first_y = first_y_to_check[job_index];
+        }
+        if ( max_y_to_check[job_index] > overall_max_y ) {
+            overall_max_y = max_y_to_check[job_index];
+        }
+        if ( max_x_to_check[job_index] > overall_max_x ) {
+            overall_max_x = max_x_to_check[job_index];
+        }
+    }
+    TraceSpan("plan", phase_start);
+
+    /*
+    Jobs that start with the same pattern pixel (usually the same needle
+    at several scales) share one check of it per position, so a position
+    that fails there is turned down once for all of them.  Each job points
+    at the first job of its group.
+    */
+    vector<int> anchor_leader(job_count);
+    vector<long> anchor_checked_at(job_count, -1);
+    vector<int> anchor_matched(job_count);
+    for ( int job_index = 0; job_index < job_count; job_index++ ) {
+        anchor_leader[job_index] = job_index;
+        for ( int earlier = 0; earlier < job_index; earlier++ ) {
+            if ( SameAnchor(jobs[earlier], jobs[job_index]) ) {
+                anchor_leader[job_index] = earlier;
+                break;
+            }
+        }
+    }
+
+    int jobs_still_searching = job_count;
+    vector<int> searched_to_y(max_y_to_check);
+
+    for (int big_y = overall_first_y;
+      big_y < overall_max_y && jobs_still_searching > 0; ++big_y) {
+        // A job that runs out of time stops at the start of a row
+        for ( int job_index = 0; job_index < job_count; job_index++ ) {
+            if ( keep_searching[job_index]
+              && big_y >= first_y_to_check[job_index]
+              && big_y < max_y_to_check[job_index]
+              && PastDeadline(jobs[job_index].options) ) {
+                searched_to_y[job_index] = big_y;
+                keep_searching[job_index] = false;
+                jobs_still_searching--;
+            }
+        }
+        for (int big_x = 0; big_x < overall_max_x; ++big_x) {
+            long position = (long) big_y * overall_max_x + big_x;
+            for ( int job_index = 0; job_index < job_count; job_index++ ) {
+                if ( !keep_searching[job_index]
+                  || big_y < first_y_to_check[job_index]
+                  || big_y >= max_y_to_check[job_index]
+                  || big_x >= max_x_to_check[job_index] ) {
+                    continue;
+                }
+
+                MatchJob& job = jobs[job_index];
+                const ScanPlan& plan = plans[job_index];
+                int depth = 0;
+                int leader = anchor_leader[job_index];
+                if ( leader != job_index
+                  && anchor_checked_at[leader] == position ) {
+                    if ( anchor_matched[leader] ) {
+                        depth = plan.depth(plan, Big, big_x, big_y);
+                    }
+                }
+                else {
+                    depth = plan.depth(plan, Big, big_x, big_y);
+                    // A depth of 0 means the first pattern pixel failed
+                    anchor_checked_at[job_index] = position;
+                    anchor_matched[job_index] = depth != 0;
+                }
+
+                // Turned down by the sum window (see ScreenedDepth)
+                if ( depth < 0 ) {
+                    if ( job.options.stats ) {
+                        job.options.stats->positions_visited++;
+                        CountScreened(job.options.stats, depth);
+                    }
+                    continue;
+                }
+
+                if ( job.options.stats ) {
+                    job.options.stats->positions_visited++;
+                    job.options.stats->reject_depth[depth]++;
+                }
+
+                if (depth == (int) job.matcher->Pattern().size()) {
+                    Match match;
+                    match.x = big_x;
+                    match.y = big_y;
+                    job.matches_found++;
+
+                    if ( !job.callback(match, job.user_data)
+                      || job.matches_found
+                        == job.options.return_how_many_matches ) {
+                        keep_searching[job_index] = false;
+                        jobs_still_searching--;
+                    }
+                }
+            }
+        }
+    }
+
+    double scan_usec = NowMicroseconds() - phase_start;
+    for ( int job_index = 0; job_index < job_count; job_index++ ) {
+        ReportProgress(jobs[job_index].options,
+          searched_to_y[job_index] - first_y_to_check[job_index],
+          max_y_to_check[job_index] - first_y_to_check[job_index]);
+        if ( jobs[job_index].options.stats ) {
+            jobs[job_index].options.stats->scan_usec = scan_usec;
+            jobs[job_index].options.stats->matches
+              = jobs[job_index].matches_found;
+        }
+    }
+}
+
+/*
+Sum of absolute differences of the red, green and blue bytes of count
+pixels, four at a time with SSE2 unless SetSimdLevel() rules it out.
+Alpha is masked off, since decoders don't agree on what to put
+there.
+*/
+static long SumAbsoluteDifferences( const RGBApixel* a, const RGBApixel* b,
+  int count ) {
+    long sum = 0;
+    int index = 0;
+#ifdef __SSE2__
+    if ( simd_level >= SIMD_SSE2 ) {
+        const __m128i color_mask = _mm_set1_epi32(0x00FFFFFF);
+        __m128i sums = _mm_setzero_si128();
+        for ( ; index + 4 <= count; index += 4 ) {
+            __m128i a_pixels = _mm_and_si128(color_mask,
+              _mm_loadu_si128((const __m128i*) (a + index)));
+            __m128i b_pixels = _mm_and_si128(color_mask,
+              _mm_loadu_si128((const __m128i*) (b + index)));
+            sums = _mm_add_epi64(sums, _mm_sad_epu8(a_pixels, b_pixels));
+        }
+        sum = _mm_cvtsi128_si32(sums)
+          + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+    }
+#endif
+    for ( ; index < count; index++ ) {
+        sum += abs(a[index].Red - b[index].Red)
+          + abs(a[index].Green - b[index].Green)
+          + abs(a[index].Blue - b[index].Blue);
+    }
+    return sum;
+}
+
+// Orders a heap with the worst match on top
+static bool IsBetterMatch( const ScoredMatch& a, const ScoredMatch& b ) {
+    if ( a.score != b.score ) {
+        return a.score < b.score;
+    }
+    if ( a.y != b.y ) {
+        return a.y < b.y;
+    }
+    return a.x < b.x;
+}
+
+BestMatcher::BestMatcher( const ImageView& Small ) {
+    small_width = Small.Width();
+    small_height = Small.Height();
+    by_columns.resize((long) small_width * small_height);
+    by_rows.resize((long) small_width * small_height);
+    for ( int small_x = 0; small_x < small_width; small_x++ ) {
+        for ( int small_y = 0; small_y < small_height; small_y++ ) {
+            const RGBApixel* SmallPixel = Small.Pixel(small_x, small_y);
+            by_columns[(long) small_x * small_height + small_y] = *SmallPixel;
+            by_rows[(long) small_y * small_width + small_x] = *SmallPixel;
+        }
+    }
+}
+
+vector<ScoredMatch> BestMatcher::Find( const ImageView& Big, int how_many,
+  SearchStats* stats ) const {
+
+    double phase_start = NowMicroseconds();
+
+    vector<ScoredMatch> best;
+    if ( how_many <= 0 || small_width == 0 || small_height == 0 ) {
+        return best;
+    }
+
+    /*
+    Walk the small image in whichever direction the big image's pixels
+    are next to each other in memory: down the columns of a decoded BMP,
+    or along the rows of a framebuffer.  If neither, go a pixel at a time.
+    */
+    int runs_are_columns = Big.Height() > 1
+      && Big.Pixel(0, 1) - Big.Pixel(0, 0) == 1;
+    int runs_are_rows = !runs_are_columns && Big.Width() > 1
+      && Big.Pixel(1, 0) - Big.Pixel(0, 0) == 1;
+    int run_count = runs_are_columns ? small_width : small_height;
+    int run_length = runs_are_columns ? small_height : small_width;
+
+    // Same bounds as Matcher::Find
+    int max_y_to_check = Big.Height() - small_height;
+    int max_x_to_check = Big.Width() - small_width;
+
+    long positions_visited = 0;
+    for (int big_y = 0; big_y < max_y_to_check; ++big_y) {
+        for (int big_x = 0; big_x < max_x_to_check; ++big_x) {
+
+            positions_visited++;
+
+            // Anything that can't get under this won't make the list
+            long bound = (int) best.size() == how_many ? best.front().score
+              : -1;
+
+            long score = 0;
+            for ( int run = 0; run < run_count; run++ ) {
+                if ( runs_are_columns ) {
+                    score += SumAbsoluteDifferences(Big.Pixel(big_x + run,
+                      big_y), &by_columns[(long) run * run_length],
+                      run_length);
+                }
+                else if ( runs_are_rows ) {
+                    score += SumAbsoluteDifferences(Big.Pixel(big_x,
+                      big_y + run), &by_rows[(long) run * run_length],
+                      run_length);
+                }
+                else {
+                    for ( int small_x = 0; small_x < small_width; small_x++ ) {
+                        score += SumAbsoluteDifferences(Big.Pixel(
+                          big_x + small_x, big_y + run),
+                          &by_rows[(long) run * run_length + small_x], 1);
+                    }
+                }
+                // Ties go to the earlier position, which is already listed
+                if ( bound >= 0 && score >= bound ) {
+                    break;
+                }
+            }
+            if ( bound >= 0 && score >= bound ) {
+                continue;
+            }
+
+            ScoredMatch match;
+            match.x = big_x;
+            match.y = big_y;
+            match.score = score;
+            if ( (int) best.size() == how_many ) {
+                pop_heap(best.begin(), best.end(), IsBetterMatch);
+                best.pop_back();
+            }
+            best.push_back(match);
+            push_heap(best.begin(), best.end(), IsBetterMatch);
+        }
+    }
+
+    sort_heap(best.begin(), best.end(), IsBetterMatch);
+
+    if ( stats ) {
+        stats->scan_usec = NowMicroseconds() - phase_start;
+        stats->positions_visited = positions_visited;
+        stats->matches = (long) best.size();
+    }
+    return best;
+}
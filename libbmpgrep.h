@@ -0,0 +1,650 @@
+/*****************************************************************************
+******************************************************************************
+
+libbmpgrep
+
+Author: Gordon McCreight
+email: gordon@mccreight.com
+
+License: GPL 2
+Copyright: 2009 by Gordon McCreight
+
+description: The search logic behind the bmpgrep program, packaged so that
+it can be linked into another program instead of run as a separate process.
+
+A Matcher is built once from the small image and can then be used to
+search any number of big images.  Find() is const and keeps no state
+between calls, so one Matcher can be shared by several threads, each
+searching its own (or the same) big image.  Images are passed in as
+ImageViews, which only point at pixels that are owned by someone else, so
+callers are free to keep their decoded images around in their own cache.
+
+Example:
+
+  BMP Big, Small;
+  Big.ReadFromFile("big.bmp");
+  Small.ReadFromFile("small.bmp");
+
+  Matcher matcher( ImageView(Small), 30 );
+  MatchOptions options;
+  vector<Match> matches = matcher.Find( ImageView(Big), options );
+
+Can be built into a static library like so:
+g++ -c libbmpgrep.cpp bmpgrep_trace.cpp EasyBMP.cpp
+ar rcs libbmpgrep.a libbmpgrep.o bmpgrep_trace.o EasyBMP.o
+
+******************************************************************************
+*****************************************************************************/
+
+#ifndef _libbmpgrep_h_
+#define _libbmpgrep_h_
+
+#include <vector>
+#include "EasyBMP.h"
+
+/*
+A read-only window onto pixels that are owned by someone else.  The view
+must not outlive the pixels.  EasyBMP stores its pixels a column at a
+time and other sources store them a row at a time, so we hold on to a
+pointer per column, and step between rows within a column by row_stride
+pixels.  That covers both layouts.
+*/
+class ImageView {
+  public:
+    ImageView();
+    explicit ImageView( BMP& Image );
+
+    // For pixels stored one whole column after another, x = 0 first
+    ImageView( const RGBApixel* pixels, int width, int height );
+
+    /*
+    For pixels stored a row at a time, top row first, with row_stride
+    pixels from the start of one row to the start of the next.  A BGRA
+    framebuffer is already laid out like this.
+    */
+    static ImageView FromRows( const RGBApixel* pixels, int width, int height,
+      int row_stride );
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    const RGBApixel* Pixel( int x, int y ) const {
+        return columns[x] + y * row_stride;
+    }
+
+    /*
+    When every column starts the same number of pixels after the one
+    before it, which is true of all of the images we make ourselves, any
+    pixel is Pixel(0, 0) + x * ColumnStep() + y * RowStride().  0 if not.
+    */
+    long ColumnStep() const { return column_step; }
+    int RowStride() const { return row_stride; }
+
+  private:
+    void FindColumnStep();
+
+    std::vector<const RGBApixel*> columns;
+    int width;
+    int height;
+    int row_stride;
+    long column_step;
+};
+
+/*
+One pixel of the small image that the search will check.  See
+Matcher::Matcher for how these get picked.
+*/
+struct PatternPixel {
+    int x;
+    int y;
+    int red;
+    int green;
+    int blue;
+};
+
+struct Match {
+    int x;
+    int y;
+};
+
+/*
+A rectangle of the small image that lies wholly within the pattern, and
+the sums of its red, green and blue values.  A match has every one of
+those pixels within tolerance, so the same rectangle of the big image
+must add up to within tolerance times the area of these sums, and its
+smallest and largest values (low and high) must each be within
+tolerance of these.  Its area is 0 if the pattern has no rectangle big
+enough to be worth checking.
+*/
+struct SumWindow {
+    int x;
+    int y;
+    int width;
+    int height;
+    long red;
+    long green;
+    long blue;
+    RGBApixel low;
+    RGBApixel high;
+};
+
+/*
+Counters for one search.  They are meant to be read by a script that is
+tuning pattern_threshold for a given needle, so Print() writes one
+"name=value" line per counter and the names don't change.
+
+reject_depth is a histogram of how far into the pattern the scan got
+before a position failed.  "0:1000,1:20" means 1000 positions failed on
+the very first pattern pixel and 20 failed on the second.  The last
+bucket counts the full matches.  A histogram that is heavy in the deep
+buckets means the pattern has too many similar pixels up front, and a
+higher pattern_threshold may help.
+
+sum_rejects and range_rejects count the positions that a SumTable or a
+RangeTable turned down (see MatchOptions::sums and ranges) after their
+first few pattern pixels had passed.  They are left out of reject_depth,
+since nobody knows how deep they would have got.
+
+The read_* timings are filled in by whoever decodes the images, since
+the library never sees the files, and so are sum_table_usec and
+range_table_usec by whoever builds the SumTable and RangeTable, and
+choose_engine_usec by whoever calls ChooseEngine().
+*/
+struct SearchStats {
+    double read_big_usec;
+    double read_small_usec;
+    double compile_usec;
+    double scan_usec;
+    double sum_table_usec;
+    double range_table_usec;
+    double choose_engine_usec;
+    int small_pattern_array_size;
+    long positions_visited;
+    long sum_rejects;
+    long range_rejects;
+    long matches;
+    std::vector<long> reject_depth;
+
+    SearchStats();
+    void Print( std::ostream& out ) const;
+};
+
+/*
+A run of pixels in one row of a big image that are all the same color,
+or, for a RunTable built with a spread, all within spread of each other
+in every channel.  low and high are the smallest and largest red, green
+and blue values in the run.
+*/
+struct ColorRun {
+    int x;
+    int length;
+    RGBApixel low;
+    RGBApixel high;
+};
+
+/*
+The runs of each row of a big image, for screenshots that are mostly
+flat areas of color.  Matcher::Find uses one, when it is given one in
+MatchOptions, to turn down every position whose first pattern pixel
+falls in a run that pixel can't match with one check for the whole run,
+instead of one per position.  Then the time a search takes depends on
+how busy the image is rather than on how big it is.
+
+Building it costs about as much as one ordinary search, so it pays off
+when one big image is searched several times, or when most of the image
+is flat.  The results and stats are the same either way.
+*/
+class RunTable {
+  public:
+    RunTable();
+
+    // spread is 0 for runs of exactly one color
+    RunTable( const ImageView& Image, int spread );
+
+    /*
+    How many runs a RunTable of Image would have, which is much quicker
+    to find out than building one.  Nothing is gained from a table with
+    nearly as many runs as pixels.
+    */
+    static long CountRuns( const ImageView& Image, int spread );
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    long NumberOfRuns() const { return (long) runs.size(); }
+
+    // The runs of a row cover it exactly, left to right
+    const ColorRun* Runs( int y ) const { return &runs[row_starts[y]]; }
+    int NumberOfRuns( int y ) const {
+        return (int) (row_starts[y + 1] - row_starts[y]);
+    }
+
+  private:
+    std::vector<ColorRun> runs;
+    std::vector<long> row_starts;
+    int width;
+    int height;
+};
+
+/*
+Summed-area tables of the red, green and blue values of a big image, so
+that the sum of any rectangle of it costs four lookups a channel however
+big the rectangle is.  Matcher::Find and FindMany use one, when they are
+given one in MatchOptions, to turn down a position without looking at
+the rest of its pattern pixels when the big image's pixels under the
+small image's sum window (see Matcher::Window) add up to more, or less,
+than they could if every one of them were within tolerance.  That is
+checked once the first few pattern pixels have passed, since most
+positions fail on one of those, and the sums cost more than a pixel.
+
+It pays off when the pattern would otherwise get a long way into many
+positions before failing, as with generous tolerances.  Building one
+costs more than a search, so it is for a big image that is searched more
+than once.
+
+The sums are kept modulo 2^32, which still gives the exact sum of any
+rectangle of fewer than 2^32 / 255 pixels.  The table takes 12 bytes a
+pixel.
+*/
+class SumTable {
+  public:
+    SumTable();
+    explicit SumTable( const ImageView& Image );
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    // The sums of the width x height rectangle whose top left is x,y
+    void Sum( int x, int y, int width, int height, long& red, long& green,
+      long& blue ) const {
+        const Sums* top = &sums[(long) y * (this->width + 1) + x];
+        const Sums* bottom = top + (long) height * (this->width + 1);
+        red = (unsigned int) (bottom[width].red - bottom[0].red
+          - top[width].red + top[0].red);
+        green = (unsigned int) (bottom[width].green - bottom[0].green
+          - top[width].green + top[0].green);
+        blue = (unsigned int) (bottom[width].blue - bottom[0].blue
+          - top[width].blue + top[0].blue);
+    }
+
+  private:
+    struct Sums {
+        unsigned int red;
+        unsigned int green;
+        unsigned int blue;
+    };
+
+    // Of every pixel above and to the left of each corner, a row of
+    // width + 1 corners at a time
+    std::vector<Sums> sums;
+    int width;
+    int height;
+};
+
+/*
+The smallest and largest red, green and blue values in a rectangle of
+pixels.
+*/
+struct ColorRange {
+    RGBApixel low;
+    RGBApixel high;
+};
+
+/*
+The ColorRange of every window_width x window_height rectangle of a big
+image, for the size of a Matcher's sum window.  Like a SumTable, it lets
+Find() and FindMany() turn a position down by looking at the window as
+a whole, here when its range is further than the tolerance from the
+small image's.  That catches the positions a SumTable can't, where the
+big image's pixels add up about right but are too flat, or too busy, as
+in noisy, low contrast captures.
+
+Each range is worked out with the van Herk/Gil-Werman algorithm, down
+the columns and then along the rows, which costs the same few
+comparisons a pixel however big the window is.  The table takes 8 bytes
+a position, and one is needed for each size of window, so like a
+SumTable it is for a big image that is searched more than once.
+*/
+class RangeTable {
+  public:
+    RangeTable();
+    RangeTable( const ImageView& Image, int window_width, int window_height );
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    int WindowWidth() const { return window_width; }
+    int WindowHeight() const { return window_height; }
+
+    // Of the window whose top left is x,y
+    const ColorRange& Range( int x, int y ) const {
+        return ranges[(long) x * positions_per_column + y];
+    }
+
+  private:
+    // A column of positions at a time
+    std::vector<ColorRange> ranges;
+    long positions_per_column;
+    int width;
+    int height;
+    int window_width;
+    int window_height;
+};
+
+/*
+How far a search got.  Every position in the first rows_searched rows of
+positions was tried, out of rows_to_search (of its shard, if it has
+one).  is_complete is only false
+for a search that ran out of time (see MatchOptions::deadline_usec); one
+that stopped because it had found enough matches still counts as
+complete.
+*/
+struct SearchProgress {
+    int is_complete;
+    int rows_searched;
+    int rows_to_search;
+
+    SearchProgress();
+};
+
+struct MatchOptions {
+    // 0 means find as many as possible
+    int return_how_many_matches;
+
+    // 0-255 per channel.  All zeroes means an exact match.
+    int tolerance_r;
+    int tolerance_g;
+    int tolerance_b;
+
+    /*
+    How many pattern pixels may fail the tolerance test at a position that
+    still counts as a match, for captures with a cursor or a little
+    flicker in them.  Either as a count, or as a percentage of the pattern
+    (rounded down); the larger of the two is used.  A position is given up
+    on as soon as one more pixel than that has failed.
+    */
+    int max_mismatches;
+    double max_mismatch_percent;
+
+    // If set, the counters for this search are written here.  Give each
+    // thread its own SearchStats.
+    SearchStats* stats;
+
+    /*
+    If set, a RunTable of the big image, which Matcher::Find uses to skip
+    runs when no pixel is allowed to fail.  Ignored if it is the wrong
+    size for the big image, and by FindMany().
+    */
+    const RunTable* runs;
+
+    /*
+    If set, a SumTable of the big image, which is used when there are
+    tolerances and no pixel is allowed to fail.  Ignored if it is the
+    wrong size for the big image.
+    */
+    const SumTable* sums;
+
+    /*
+    Likewise a RangeTable of the big image.  Ignored unless its window is
+    the size of the Matcher's sum window.
+    */
+    const RangeTable* ranges;
+
+    /*
+    If not 0, the NowMicroseconds() time to give up at.  The clock is only
+    checked before each row of positions, so a search can run over by
+    about a row's worth.  The matches found by then are still reported,
+    and progress, if set, says how far the search got.  Ignored by
+    BestMatcher.
+    */
+    double deadline_usec;
+    SearchProgress* progress;
+
+    /*
+    Only search strip number shard (counting from 0) of shard_count
+    horizontal strips of positions, so that one search can be split
+    between machines.  See ShardRows().  Matches are still in the big
+    image's coordinates, and the stats only count the strip's positions.
+    */
+    int shard;
+    int shard_count;
+
+    MatchOptions();
+};
+
+/*
+Called once per match, in raster order.  Return false to stop the search.
+*/
+typedef bool (*MatchCallback)( const Match& match, void* user_data );
+
+class Matcher {
+  public:
+    /*
+    "pattern_threshold" determines how aggressively the pattern for the
+    small image is shrunk.  See the top of bmpgrep.cpp for details.
+    */
+    Matcher( const ImageView& Small, int pattern_threshold );
+
+    std::vector<Match> Find( const ImageView& Big,
+      const MatchOptions& options ) const;
+
+    // Returns the number of matches that were passed to the callback
+    int Find( const ImageView& Big, const MatchOptions& options,
+      MatchCallback callback, void* user_data ) const;
+
+    int Width() const { return small_width; }
+    int Height() const { return small_height; }
+    const std::vector<PatternPixel>& Pattern() const { return fast_pattern; }
+    double CompileMicroseconds() const { return compile_usec; }
+
+    /*
+    The largest rectangle of the small image whose pixels are all in the
+    pattern.  With a pattern_threshold of 0 that is the whole small
+    image.
+    */
+    const SumWindow& Window() const { return window; }
+
+    /*
+    How many pattern pixels were checked at big_x,big_y before the one
+    that failed it (the first mismatch, or the first one over
+    options.max_mismatches).  Pattern().size() means a full match.
+    Find() and FindMany() use copies of this that are specialized for
+    the options and the layout of Big, and give the same answers.
+    */
+    int MatchDepth( const ImageView& Big, int big_x, int big_y,
+      const MatchOptions& options, int has_tolerances ) const;
+
+  private:
+    int MatchDepthWithMismatches( const ImageView& Big, int big_x, int big_y,
+      const MatchOptions& options, int allowed_mismatches ) const;
+    void FindWindow( const ImageView& Small );
+
+    std::vector<PatternPixel> fast_pattern;
+    SumWindow window;
+    int small_width;
+    int small_height;
+    double compile_usec;
+};
+
+/*
+One needle's share of a FindMany() pass.  matches_found is filled in by
+FindMany().
+*/
+struct MatchJob {
+    const Matcher* matcher;
+    MatchOptions options;
+    MatchCallback callback;
+    void* user_data;
+    int matches_found;
+};
+
+/*
+Searches for several small images in the same big image with a single
+pass over it.  Each position of the big image is tried against every
+needle while its pixels are still in the cache, instead of streaming the
+whole big image through memory once per needle.  Needles that start
+with the same pattern pixel and tolerances, like one needle at several
+scales, share the check of that pixel at each position.  Each job sees its
+matches in raster order, exactly as Matcher::Find would report them.
+stats->scan_usec is the time for the whole pass, since it is shared.
+*/
+void FindMany( const ImageView& Big, std::vector<MatchJob>& jobs );
+
+/*
+score is the sum of the absolute differences of the red, green and blue
+values of every pixel of the small image, so 0 is an exact match.
+*/
+struct ScoredMatch {
+    int x;
+    int y;
+    long score;
+};
+
+/*
+Finds the positions that are closest to the small image, for when there
+may not be an exact match within any reasonable tolerance.  Unlike
+Matcher, it compares every pixel of the small image, not a pattern.
+
+A position is abandoned as soon as its partial score can no longer beat
+the worst of the best matches found so far (partial distance
+elimination), so once a few good matches turn up most positions only cost
+a column or two of the small image.  The differences are summed sixteen
+bytes at a time with SSE2 where it is available.
+*/
+class BestMatcher {
+  public:
+    explicit BestMatcher( const ImageView& Small );
+
+    /*
+    Returns up to how_many matches, best first.  Equal scores are in
+    raster order.  Only stats->scan_usec, positions_visited and matches
+    are filled in.
+    */
+    std::vector<ScoredMatch> Find( const ImageView& Big, int how_many,
+      SearchStats* stats = NULL ) const;
+
+    int Width() const { return small_width; }
+    int Height() const { return small_height; }
+
+  private:
+    // The small image twice, a column at a time and a row at a time, so
+    // that either can be walked alongside the big image's memory order
+    std::vector<RGBApixel> by_columns;
+    std::vector<RGBApixel> by_rows;
+    int small_width;
+    int small_height;
+};
+
+/*
+The ways Matcher::Find can search a big image.  pixels tries every
+position in turn, and is what a mismatch budget or an unusual layout
+gets.  anchored checks the first pattern pixel a vector at a time (see
+SimdLevel), and is what everything else gets.  screened is anchored with
+a SumTable and a RangeTable, and runs walks a RunTable, which both cost
+a pass over the big image to build first.
+*/
+enum SearchEngine {
+    ENGINE_PIXELS,
+    ENGINE_ANCHORED,
+    ENGINE_SCREENED,
+    ENGINE_RUNS,
+    NUMBER_OF_ENGINES
+};
+
+// "pixels", "anchored", "screened" or "runs"
+const char* SearchEngineName( SearchEngine engine );
+
+/*
+Which engine ChooseEngine() expects to be quickest for one search, and
+why.  estimated_usec includes building the engine's tables, and is below
+0 for an engine that can't do the search.  The rest are what the
+estimates were worked out from, by trying the pattern on a sample of
+positions from sampled_rows evenly spaced rows: how many positions the
+search has, the share of them whose first pattern pixel matched, how
+many pattern pixels a position cost on average, the share of the
+positions that got past the first few pattern pixels that the tables
+would have turned down, and how many pixels there are to a run of one
+color.  The last two are 0 when they weren't sampled, because building
+that engine's tables alone would cost more than searching without them.
+*/
+struct EngineChoice {
+    SearchEngine engine;
+    double estimated_usec[NUMBER_OF_ENGINES];
+    long positions;
+    int sampled_rows;
+    double anchor_pass_rate;
+    double pixels_per_position;
+    double screen_reject_rate;
+    double pixels_per_run;
+
+    EngineChoice();
+
+    // One "name=value" per line, like SearchStats::Print()
+    void Print( std::ostream& out ) const;
+};
+
+/*
+Picks the engine for searching Big with matcher and options, from a cost
+model whose constants were measured on an x86 core with AVX2.  The
+sample is about one position in 4096, so it costs around a hundredth
+of the search itself.  A shard (see MatchOptions::shard) gets neither
+table, since they cover the whole big image.  The caller builds
+whatever tables the engine needs and hands them over in MatchOptions;
+the matches are the same whichever engine is used.
+*/
+EngineChoice ChooseEngine( const Matcher& matcher, const ImageView& Big,
+  const MatchOptions& options );
+
+/*
+Which vector instructions the search may use.  The scan looks for the
+first pattern pixel 4 (SSE2), 8 (AVX2) or 16 (AVX-512) pixels at a time,
+and only tries the rest of the pattern where it matched.  Each variant is
+compiled in (on x86 with gcc or clang) whatever the compiler flags, and
+the default is the best one that this CPU has, so one binary runs well
+everywhere.  SetSimdLevel() can only go down from there, which is handy
+for ruling the vector code out when debugging.  Building a RangeTable
+and BestMatcher's scoring have an SSE2 version only, which SIMD_SCALAR
+rules out as well.
+*/
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+SimdLevel DetectSimdLevel();
+void SetSimdLevel( SimdLevel level );
+SimdLevel GetSimdLevel();
+
+// "scalar", "sse2", "avx2" or "avx512", as --simd takes them
+const char* SimdLevelName( SimdLevel level );
+
+// How many of a pattern's pixels options allows to fail
+int AllowedMismatches( const MatchOptions& options, int pattern_size );
+
+double NowMicroseconds();
+
+/*
+The rows of positions, from first_row up to (but not including) end_row,
+that strip number shard of shard_count gets out of rows_to_search.  The
+strips are as even as whole rows allow, and cover every row exactly
+once.  A strip also needs the small image's height worth of pixel rows
+below its last row of positions.
+*/
+void ShardRows( int rows_to_search, int shard, int shard_count,
+  int& first_row, int& end_row );
+
+// Whether options has a deadline that has passed
+inline bool PastDeadline( const MatchOptions& options ) {
+    return options.deadline_usec != 0
+      && NowMicroseconds() >= options.deadline_usec;
+}
+
+/*
+Writes how far a search got to options.progress, if it is set.  Every
+search ends with this, rows_searched < rows_to_search meaning that it
+stopped at the deadline.
+*/
+void ReportProgress( const MatchOptions& options, int rows_searched,
+  int rows_to_search );
+
+#endif